@@ -0,0 +1,40 @@
+#pragma once
+
+#include <math.h>
+
+#include "persistence.h"
+
+// RDRAM retention model, shared by the canary estimate of power off duration and the host tools
+
+#define DECAY_MAX (0.5f)	// Bits decay to a ground state: a fully decayed canary has about half its bits flipped
+#define DECAY_SHAPE (4.0f)	// Cells keep their charge for a while, then most fail within a few seconds
+
+// Rough retention times (ms) for each heap: about 63% of the bits that can flip have flipped
+static const float heap_retention_ms[TOTAL_HEAPS] = { 8000.0f, 6000.0f, 4000.0f, 3000.0f, 2500.0f, 2000.0f };
+
+// Weibull distributed cell retention times: proportion of flipped bits after a power off.
+// Almost nothing flips well below the retention time, so short power offs keep whole chunks.
+static inline float decay_model(float retention_ms, float shape, float off_ms) {
+	return DECAY_MAX * (1.0f - expf(-powf(off_ms / retention_ms, shape)));
+}
+
+static inline float heap_decay(int heap, float off_ms) {
+	return decay_model(heap_retention_ms[heap], DECAY_SHAPE, off_ms);
+}
+
+// Inverse of heap_decay(): power off duration from the proportion of flipped bits
+static inline float heap_off_ms(int heap, float decay) {
+	return heap_retention_ms[heap] * powf(-logf(1.0f - decay / DECAY_MAX), 1.0f / DECAY_SHAPE);
+}
+
+// Replicas are spread evenly over heaps first_heap..last_heap
+static inline int first_heap(persistence_level_t level, int last_heap) {
+	switch (level) {
+		case LOW:
+			return 2;
+		case LOWEST:
+			return last_heap;
+		default:
+			return 0;
+	}
+}
@@ -1,29 +1,132 @@
 #include <libdragon.h>
 #include "game_state.h"
 #include "persistence.h"
+#include "save.h"
 #include "pc64.h"
 
 
-const level_t levels[TOTAL_LEVELS] = {
-	// cons.	att/s	att.grace	%att	%heat	%hipersist	rst/c	longrst		power	timer	desc
-	{ 1,		1.5f,	0.8f,		0,		0,		0,			0,		false,		0,		20,		"Your competitors are after you!\n\nPress and hold buttons to defend against attacks, don't let them overheat your console!" },
-	{ 2,		0.7f,	1.5f,		0,		0,		0,			0,		false,		0,		30,		"To defend multiple consoles, plug your controller into the corresponding slot.\n\nBetter get closer!" },
-	{ 2,		1.0f,	1.5f,		0,		0,		0,			1,		false,		0,		60,		"You are now allowed to reset each console once to mitigate overheat. Hitting the RESET button will help you cool the console you're plugged into.\n\nTold ya to get closer!" },
-	{ 3,		0.7f,	1.5f,		0.1f,	0,		0,			1,		true,		0,		60,		"Up next: long reset (holding 5 seconds) can cool your consoles even more.\n\nBeware: attacks will keep coming at your consoles!" },
-	{ 3,		0.7f,	1.5f,		0.9f,	0.9f,	0,			0,		false,		1,		60,		"One last trick in your bag: if things go out of hand, go hit that big POWER switch! Keep the console off for a few seconds, let your enemies feel the slow decay of that dear RDRAM!\n\nBut remember: don't let the memory decay to the point where you'll lose your consoles..." },
-	{ 3,		1.5f,	0.5f,		0.8f,	0.8f,	0.25f,		1,		true,		1,		60,		"Let's make it a bit harder..." },
-	{ 4,		1.0f,	1.5f,		0.7f,	0.8f,	0.25f,		2,		true,		1,		60,		"How about one more console?\n\nOK, you get 2 resets per console this time." },
-	{ 4,		1.2f,	1.0f,		0.5f,	0.5f,	0.35f,		0,		true,		2,		60,		"You're doing good, keep going!\n\nHow about a challenge: no reset, but 2 power offs allowed!" },
-	{ 4,		1.5f,	1.0f,		0.2f,	0.5f,	0.5f,		1,		true,		2,		60,		"Almost there..." },
-	{ 4,		1.5f,	0.5f,		0.1f,	0.5f,	0.75f,		0,		true,		3,		90,		"One last effort!" }
+// Persisted fields: ids only need to tell consoles apart, timers are stored in 1/100s
+
+static const field_t console_fields[] = {
+	FIELD(console_t, id,			FIELD_UNSIGNED,	4,	0),
+	FIELD(console_t, scale.v[0],	FIELD_FIXED,	13,	4096.0f),
+	FIELD(console_t, scale.v[1],	FIELD_FIXED,	13,	4096.0f),
+	FIELD(console_t, scale.v[2],	FIELD_FIXED,	13,	4096.0f),
+	FIELD(console_t, rotation.v[0],	FIELD_FIXED,	16,	8192.0f),
+	FIELD(console_t, rotation.v[1],	FIELD_FIXED,	16,	8192.0f),
+	FIELD(console_t, rotation.v[2],	FIELD_FIXED,	16,	8192.0f),
+	FIELD(console_t, position.v[0],	FIELD_FIXED,	16,	64.0f),
+	FIELD(console_t, position.v[1],	FIELD_FIXED,	16,	64.0f),
+	FIELD(console_t, position.v[2],	FIELD_FIXED,	16,	64.0f),
+};
+
+static const field_t attacker_fields[] = {
+	FIELD(attacker_t, spawned,			FIELD_UNSIGNED,	1,	0),
+	FIELD(attacker_t, level,			FIELD_UNSIGNED,	3,	0),
+	FIELD(attacker_t, rival_type,		FIELD_UNSIGNED,	1,	0),
+	FIELD(attacker_t, queue.buttons[0],	FIELD_UNSIGNED,	2,	0),
+	FIELD(attacker_t, queue.buttons[1],	FIELD_UNSIGNED,	2,	0),
+	FIELD(attacker_t, queue.buttons[2],	FIELD_UNSIGNED,	2,	0),
+	FIELD(attacker_t, queue.buttons[3],	FIELD_UNSIGNED,	2,	0),
+	FIELD(attacker_t, queue.start,		FIELD_UNSIGNED,	2,	0),
+	FIELD(attacker_t, queue.end,		FIELD_UNSIGNED,	2,	0),
+	FIELD(attacker_t, last_attack,		FIELD_FIXED,	16,	100.0f),
+	FIELD(attacker_t, id,				FIELD_UNSIGNED,	4,	0),
+	FIELD(attacker_t, min_replicas,		FIELD_SIGNED,	8,	0),
+	FIELD(attacker_t, seq,				FIELD_UNSIGNED,	16,	0),
 };
 
+static const field_t overheat_fields[] = {
+	FIELD(overheat_t, overheat_level,	FIELD_UNSIGNED,	3,	0),
+	FIELD(overheat_t, last_overheat,	FIELD_FIXED,	16,	100.0f),
+	FIELD(overheat_t, id,				FIELD_UNSIGNED,	4,	0),
+	FIELD(overheat_t, min_replicas,		FIELD_SIGNED,	8,	0),
+	FIELD(overheat_t, seq,				FIELD_UNSIGNED,	16,	0),
+};
+
+static const field_t global_state_fields[] = {
+	FIELD(global_state_t, id,								FIELD_UNSIGNED,	4,	0),
+	FIELD(global_state_t, game_state,						FIELD_UNSIGNED,	3,	0),
+	FIELD(global_state_t, game_over,						FIELD_UNSIGNED,	2,	0),
+	FIELD(global_state_t, current_level,					FIELD_UNSIGNED,	4,	0),
+	FIELD(global_state_t, level_reset_count_per_console[0],	FIELD_UNSIGNED,	4,	0),
+	FIELD(global_state_t, level_reset_count_per_console[1],	FIELD_UNSIGNED,	4,	0),
+	FIELD(global_state_t, level_reset_count_per_console[2],	FIELD_UNSIGNED,	4,	0),
+	FIELD(global_state_t, level_reset_count_per_console[3],	FIELD_UNSIGNED,	4,	0),
+	FIELD(global_state_t, level_power_cycle_count,			FIELD_UNSIGNED,	4,	0),
+	FIELD(global_state_t, practice,							FIELD_UNSIGNED,	1,	0),
+	FIELD(global_state_t, rng.state,						FIELD_UNSIGNED,	32,	0),
+	FIELD(global_state_t, seq,								FIELD_UNSIGNED,	16,	0),
+};
+
+static const field_t counters_fields[] = {
+	FIELD(counters_t, id,					FIELD_UNSIGNED,	4,	0),
+	FIELD(counters_t, reset_count,			FIELD_UNSIGNED,	20,	0),
+	FIELD(counters_t, power_cycle_count,	FIELD_UNSIGNED,	16,	0),
+	FIELD(counters_t, games_count,			FIELD_UNSIGNED,	1,	0),
+	FIELD(counters_t, seq,					FIELD_UNSIGNED,	16,	0),
+};
+
+static const field_t level_clock_fields[] = {
+	FIELD(level_clock_t, id,	FIELD_UNSIGNED,	4,	0),
+	FIELD(level_clock_t, timer,	FIELD_FIXED,	24,	1000.0f),
+};
+
+static const field_t profile_fields[] = {
+	FIELD(profile_t, games_played,	FIELD_UNSIGNED,	16,	0),
+	FIELD(profile_t, best_level,	FIELD_UNSIGNED,	4,	0),
+};
+
+const schema_t console_schema = SCHEMA(console_fields);
+const schema_t attacker_schema = SCHEMA(attacker_fields);
+const schema_t overheat_schema = SCHEMA(overheat_fields);
+const schema_t global_state_schema = SCHEMA(global_state_fields);
+const schema_t counters_schema = SCHEMA(counters_fields);
+const schema_t level_clock_schema = SCHEMA(level_clock_fields);
+const schema_t profile_schema = SCHEMA(profile_fields);
+
+
+#ifdef DEBUG_MODE
+// Round trip of representative values through each schema, to catch fields that are too narrow
+void check_schemas() {
+	console_t console = { .id = 3, .scale = {{ 0.18f, 0.18f, 0.18f }}, .rotation = {{ 0, T3D_DEG_TO_RAD(-45.0f), 0 }}, .position = {{ -50.0f, 0, -40.0f }} };
+	attacker_t attacker = { .spawned = true, .level = QUEUE_LENGTH, .rival_type = PLAYSTATION, .queue = { { BTN_A, BTN_B, BTN_C_UP, BTN_C_DOWN }, 3, 2 }, .last_attack = 89.99f, .id = 3, .min_replicas = ATTACKER_REPLICAS, .seq = 0xfffe };
+	overheat_t overheat = { .overheat_level = 4, .last_overheat = -0.02f, .id = 3, .min_replicas = OVERHEAT_REPLICAS, .seq = 0xfffe };
+	global_state_t state = { .game_state = GAME_OVER, .game_over = PARTIAL_RESTORATION, .current_level = TOTAL_LEVELS-1, .level_reset_count_per_console = { 3, 3, 3, 3 }, .level_power_cycle_count = 4, .practice = true, .rng = { 0xdeadbeef }, .seq = 0xfffe };
+	counters_t counters = { .reset_count = 9999, .power_cycle_count = 9999, .games_count = true, .seq = 0xfffe };
+	level_clock_t clock = { .timer = 89.984f };
+	profile_t prof = { .games_played = 0xffff, .best_level = TOTAL_LEVELS-1 };
+	bool ok = schema_check(&console_schema, &console)
+		&& schema_check(&attacker_schema, &attacker)
+		&& schema_check(&overheat_schema, &overheat)
+		&& schema_check(&global_state_schema, &state)
+		&& schema_check(&counters_schema, &counters)
+		&& schema_check(&level_clock_schema, &clock)
+		&& schema_check(&profile_schema, &prof);
+	debugf_uart("Schemas: %s (packed sizes %d/%d/%d/%d/%d/%d/%d)\n", ok ? "OK" : "FAILED",
+		schema_packed_size(&console_schema), schema_packed_size(&attacker_schema), schema_packed_size(&overheat_schema),
+		schema_packed_size(&global_state_schema), schema_packed_size(&counters_schema), schema_packed_size(&level_clock_schema), schema_packed_size(&profile_schema));
+	assert(ok);
+	// Sizes the host tools rely on (see sim.h)
+	assert(schema_packed_size(&console_schema) == CONSOLE_PAYLOAD_SIZE);
+	assert(schema_packed_size(&attacker_schema) == ATTACKER_PAYLOAD_SIZE);
+	assert(schema_packed_size(&overheat_schema) == OVERHEAT_PAYLOAD_SIZE);
+	assert(schema_packed_size(&global_state_schema) == GLOBAL_STATE_PAYLOAD_SIZE);
+	assert(schema_packed_size(&level_clock_schema) == LEVEL_CLOCK_PAYLOAD_SIZE);
+}
+#endif
+
 
 console_t consoles[MAX_CONSOLES];
 displayable_t console_displayables[MAX_CONSOLES];
 attacker_t console_attackers[MAX_CONSOLES];
 overheat_t console_overheat[MAX_CONSOLES];
 global_state_t global_state;
+counters_t global_counters;
+level_clock_t level_clock;
+profile_t profile;
+
+rng_t replica_rng;
 
 uint32_t consoles_count = 0;
 
@@ -36,10 +139,10 @@ void dump_game_state() {
 	// Global state
 	debugf_uart("\tGLOB: %d | %d || %02d | %02d | %02d %02d %02d %02d | %02d || %06.3f || %d\n",
 		global_state.game_state, global_state.current_level,
-		global_state.reset_count, global_state.power_cycle_count,
+		global_counters.reset_count, global_counters.power_cycle_count,
 		global_state.level_reset_count_per_console[0], global_state.level_reset_count_per_console[1], global_state.level_reset_count_per_console[2], global_state.level_reset_count_per_console[3],
 		global_state.level_power_cycle_count,
-		global_state.level_timer,
+		level_clock.timer,
 		global_state.wrong_joypads_count_displayed
 	);
 	// Consoles
@@ -72,91 +175,112 @@ void dump_game_state() {
 #endif
 }
 
+// Events and snapshots
+
+static int events_since_snapshot = 0;
+
+static void log_event(event_type_t type, uint8_t target, int16_t arg) {
+	append_event(type, target, arg);
+	// Snapshot often enough for the log to always cover the events since the last snapshot
+	if (++events_since_snapshot >= EVENT_SNAPSHOT_INTERVAL) {
+		snapshot_game_state();
+	}
+}
+
+void snapshot_game_state() {
+	debugf_uart("snapshot game state at event %d\n", event_log_head());
+	events_since_snapshot = 0;
+	// Written by the next flush_dirty(), or by the emergency flush if reset is pressed first
+	mark_global_state_dirty();
+	mark_dirty(global_counters.replicas, &global_counters, &counters_schema, &global_counters.seq, PRIORITY_LOW);
+	for (int i=0; i<consoles_count; i++) {
+		attacker_t* attacker = &console_attackers[i];
+		if (attacker->replicas != NO_REPLICAS) {
+			mark_dirty(attacker->replicas, attacker, &attacker_schema, &attacker->seq, PRIORITY_HIGH);
+		}
+		overheat_t* overheat = &console_overheat[i];
+		if (overheat->replicas != NO_REPLICAS) {
+			mark_dirty(overheat->replicas, overheat, &overheat_schema, &overheat->seq, PRIORITY_HIGH);
+		}
+	}
+}
+
+// From the reset NMI, or from the main loop once the write the NMI interrupted is complete
+void emergency_commit_game_state() {
+	if (!emergency_begin(emergency_commit_game_state)) {
+		return;
+	}
+	// Level timer and gameplay stream are only persisted periodically: make sure the latest values are written
+	if (level_clock.replicas != NO_REPLICAS) {
+		mark_dirty(level_clock.replicas, &level_clock, &level_clock_schema, NULL, PRIORITY_NORMAL);
+	}
+	if (global_state.replicas != NO_REPLICAS) {
+		mark_global_state_dirty();
+	}
+	emergency_flush();
+}
+
 void replicate_global_state() {
 	debugf_uart("replicate global state\n");
-	replicate(HIGHEST, GLOBAL_STATE_MAGIC, &global_state, GLOBAL_STATE_PAYLOAD_SIZE, GLOBAL_STATE_REPLICAS, true, true, global_state.replicas);
-	debugf_uart("replicas: %p - %p\n", global_state.replicas[0], global_state.replicas[GLOBAL_STATE_REPLICAS-1]);
+	global_state.seq = event_log_head();
+	global_state.replicas = replicate(HIGHEST, GLOBAL_STATE_MAGIC, &global_state, &global_state_schema, GLOBAL_STATE_REPLICAS, true, true);
+	global_counters.seq = event_log_head();
+	global_counters.replicas = replicate(HIGHEST, COUNTERS_MAGIC, &global_counters, &counters_schema, COUNTERS_REPLICAS, true, true);
+	level_clock.replicas = replicate(HIGHEST, LEVEL_CLOCK_MAGIC, &level_clock, &level_clock_schema, LEVEL_CLOCK_REPLICAS, true, true);
+	debugf_uart("replicas: %d/%d/%d\n", global_state.replicas, global_counters.replicas, level_clock.replicas);
 	//dump_game_state();
 }
 
+void mark_global_state_dirty() {
+	mark_dirty(global_state.replicas, &global_state, &global_state_schema, &global_state.seq, PRIORITY_NORMAL);
+}
+
 void update_global_state() {
-	//debugf_uart("updating global state replicas: %p %p %p %p\n", global_state.replicas[0], global_state.replicas[1], global_state.replicas[2], global_state.replicas[3]);
-	update_replicas(global_state.replicas, &global_state, GLOBAL_STATE_PAYLOAD_SIZE, GLOBAL_STATE_REPLICAS, true);
+	global_state.seq = event_log_head();
+	//debugf_uart("updating global state replicas: %d\n", global_state.replicas);
+	update_replicas(global_state.replicas, &global_state, &global_state_schema, true);
 	//dump_game_state();
 }
 
-void init_global_state() {
-	global_state.id = 0;
-	global_state.game_state = INTRO;
-	global_state.current_level = 0;
-	global_state.reset_count = 0;
-	global_state.power_cycle_count = 0;
-	memset(&global_state.level_reset_count_per_console, 0, sizeof(global_state.level_reset_count_per_console));
-	global_state.level_power_cycle_count = 0;
-	global_state.level_timer = 0;
-	replicate_global_state();
+void update_counters() {
+	global_counters.seq = event_log_head();
+	update_replicas(global_counters.replicas, &global_counters, &counters_schema, true);
 }
 
-void reset_level_global_state(int next_level) {
-	global_state.current_level = next_level;
-	memset(&global_state.level_reset_count_per_console, 0, sizeof(global_state.level_reset_count_per_console));
-	global_state.level_power_cycle_count = 0;
-	global_state.level_timer = levels[next_level].duration;
-	update_global_state();
+void update_level_clock() {
+	update_replicas(level_clock.replicas, &level_clock, &level_clock_schema, true);
 }
 
-void reset_global_state () {
+void init_global_state() {
 	global_state.id = 0;
+	global_counters.id = 0;
+	level_clock.id = 0;
 	global_state.game_state = INTRO;
 	global_state.current_level = 0;
-	global_state.reset_count = 0;
-	global_state.power_cycle_count = 0;
+	global_counters.reset_count = 0;
+	global_counters.power_cycle_count = 0;
 	memset(&global_state.level_reset_count_per_console, 0, sizeof(global_state.level_reset_count_per_console));
 	global_state.level_power_cycle_count = 0;
-	global_state.level_timer = 0;
-	global_state.games_count++;
-	global_state.practice = false;
-	update_global_state();
-}
-
-void set_game_state(game_state_t state) {
-	global_state.game_state = state;
-	update_global_state();
+	level_clock.timer = 0;
+	replicate_global_state();
 }
 
-void set_game_over(game_over_t reason) {
-	global_state.game_over = reason;
-	update_global_state();
+// Lifetime profile lives in cartridge save, loaded once at boot
+void init_profile() {
+	memset(&profile, 0, sizeof(profile));
+	if (save_register(PROFILE_SAVE_RECORD, &profile, &profile_schema)) {
+		debugf_uart("Profile: %d games, best level %d\n", profile.games_played, profile.best_level);
+	}
 }
 
 void inc_reset_count() {
-	global_state.reset_count++;
-	update_global_state();
+	global_counters.reset_count++;
+	log_event(EVENT_INC_RESET_COUNT, 0, 0);
 }
 
 void inc_power_cycle_count() {
-	global_state.power_cycle_count++;
-	update_global_state();
-}
-
-void inc_level_reset_count_per_console(int idx) {
-	global_state.level_reset_count_per_console[idx]++;
-	update_global_state();
-}
-
-void inc_level_power_cycle_count() {
-	global_state.level_power_cycle_count++;
-	update_global_state();
-}
-
-void set_level_timer(float t) {
-	global_state.level_timer = t;
-	update_global_state();
-}
-
-void set_practice(bool p) {
-	global_state.practice = p;
-	update_global_state();
+	global_counters.power_cycle_count++;
+	log_event(EVENT_INC_POWER_CYCLE_COUNT, 0, 0);
 }
 
 
@@ -164,14 +288,14 @@ void set_practice(bool p) {
 
 void replicate_console(console_t* console) {
 	debugf_uart("replicate console #%d\n", console->id);
-	replicate(HIGHEST, CONSOLE_MAGIC | console->id, console, CONSOLE_PAYLOAD_SIZE, CONSOLE_REPLICAS, true, true, console->replicas);
-	debugf_uart("replicas: %p - %p\n", console->replicas[0], console->replicas[CONSOLE_REPLICAS-1]);
+	console->replicas = replicate(HIGHEST, CONSOLE_MAGIC | console->id, console, &console_schema, CONSOLE_REPLICAS, true, true);
+	debugf_uart("replicas: %d\n", console->replicas);
 	//dump_game_state();
 }
 
 void update_console(console_t* console) {
-	//debugf_uart("updating console replicas: %p %p %p %p\n", console->replicas[0], console->replicas[1], console->replicas[2], console->replicas[3]);
-	update_replicas(console->replicas, console, CONSOLE_PAYLOAD_SIZE, CONSOLE_REPLICAS, true);
+	//debugf_uart("updating console replicas: %d\n", console->replicas);
+	update_replicas(console->replicas, console, &console_schema, true);
 	//dump_game_state();
 }
 
@@ -189,137 +313,114 @@ console_t* add_console() {
 
 void replicate_overheat(overheat_t* overheat) {
 	debugf_uart("replicate overheat #%d min_replicas=%d count=%d\n", overheat->id, overheat->min_replicas, OVERHEAT_REPLICAS);
-	float r = rand() / (float) RAND_MAX;
+	overheat->seq = event_log_head();
+	float r = rng_float(&replica_rng);
 	persistence_level_t persistence = r < levels[global_state.current_level].high_persistence_threshold ? HIGHEST : LOWEST;
-	replicate(persistence, OVERHEAT_MAGIC | overheat->id, overheat, OVERHEAT_PAYLOAD_SIZE, OVERHEAT_REPLICAS, true, true, overheat->replicas);
-	debugf_uart("replicas: %p - %p\n", overheat->replicas[0], overheat->replicas[OVERHEAT_REPLICAS-1]);
+	overheat->replicas = replicate(persistence, OVERHEAT_MAGIC | overheat->id, overheat, &overheat_schema, OVERHEAT_REPLICAS, true, true);
+	debugf_uart("replicas: %d\n", overheat->replicas);
 	//dump_game_state();
 }
 
 void update_overheat(overheat_t* overheat) {
-	//debugf_uart("updating overheat replicas: %p %p %p %p\n", overheat->replicas[0], overheat->replicas[1], overheat->replicas[2], overheat->replicas[3]);
-	update_replicas(overheat->replicas, overheat, OVERHEAT_PAYLOAD_SIZE, OVERHEAT_REPLICAS, true);
+	overheat->seq = event_log_head();
+	//debugf_uart("updating overheat replicas: %d\n", overheat->replicas);
+	update_replicas(overheat->replicas, overheat, &overheat_schema, true);
 	//dump_game_state();
 }
 
 void persist_overheat(overheat_t* overheat) {
 	// Replicate on first spawn, update otherwise
-	if (overheat->replicas[0] == NULL) {
+	if (overheat->replicas == NO_REPLICAS) {
 		overheat->min_replicas = (int) OVERHEAT_REPLICAS * levels[global_state.current_level].overheat_restore_threshold;
 		if (overheat->min_replicas > 0) {
-			overheat->min_replicas += rand() % ((OVERHEAT_REPLICAS - overheat->min_replicas) / 3);
+			overheat->min_replicas += rng_below(&replica_rng, (OVERHEAT_REPLICAS - overheat->min_replicas) / 3);
 		}
 		replicate_overheat(overheat);
 	} else {
-		update_overheat(overheat);
+		log_event(EVENT_SET_OVERHEAT, overheat->id | (overheat->overheat_level << 4), EVENT_TIME(overheat->last_overheat));
 	}
 }
 
-void increase_overheat(int idx) {
-	overheat_t* overheat = &console_overheat[idx];
-	overheat->id = idx;
-	overheat->overheat_level++;
-	overheat->last_overheat = global_state.level_timer;
-	debugf_uart("increase heat %d: level=%d\n", idx, overheat->overheat_level);
-	persist_overheat(overheat);
-}
 
-void decrease_overheat(int idx) {
-	overheat_t* overheat = &console_overheat[idx];
-	if (console_overheat[idx].overheat_level > 0) {
-		overheat->overheat_level--;
-		overheat->last_overheat = global_state.level_timer;	// To avoid immediate increase (TODO Add grace period of a few additional seconds?)
-		debugf_uart("decrease heat %d: level=%d\n", idx, overheat->overheat_level);
-		persist_overheat(overheat);
-	}
-}
+// Attackers
 
-void reset_overheat_timer(int idx) {
-	overheat_t* overheat = &console_overheat[idx];
-	overheat->id = idx;
-	overheat->last_overheat = global_state.level_timer;
-	persist_overheat(overheat);
+// Replicas required for a successful restoration are drawn when the attacker spawns
+static void persist_spawned_attacker(attacker_t* attacker) {
+	attacker->min_replicas = (int) ATTACKER_REPLICAS * levels[global_state.current_level].attacker_restore_threshold;
+	if (attacker->min_replicas > 0) {
+		attacker->min_replicas += rng_below(&replica_rng, (ATTACKER_REPLICAS - attacker->min_replicas) / 3);
+	}
+	replicate_attacker(attacker);
 }
 
-
-// Attackers
-
 void replicate_attacker(attacker_t* attacker) {
 	debugf_uart("replicate attacker #%d min_replicas=%d count=%d\n", attacker->id, attacker->min_replicas, ATTACKER_REPLICAS);
-	float r = rand() / (float) RAND_MAX;
+	attacker->seq = event_log_head();
+	float r = rng_float(&replica_rng);
 	persistence_level_t persistence = r < levels[global_state.current_level].high_persistence_threshold ? HIGHEST : LOW;
-	replicate(persistence, ATTACKER_MAGIC | attacker->id, attacker, ATTACKER_PAYLOAD_SIZE, ATTACKER_REPLICAS, true, true, attacker->replicas);
-	debugf_uart("replicas: %p - %p\n", attacker->replicas[0], attacker->replicas[ATTACKER_REPLICAS-1]);
+	attacker->replicas = replicate(persistence, ATTACKER_MAGIC | attacker->id, attacker, &attacker_schema, ATTACKER_REPLICAS, true, true);
+	debugf_uart("replicas: %d\n", attacker->replicas);
 	//dump_game_state();
 }
 
 void update_attacker(attacker_t* attacker) {
-	//debugf_uart("updating attacker replicas: %p %p %p %p\n", attacker->replicas[0], attacker->replicas[1], attacker->replicas[2], attacker->replicas[3]);
-	update_replicas(attacker->replicas, attacker, ATTACKER_PAYLOAD_SIZE, ATTACKER_REPLICAS, true);
+	attacker->seq = event_log_head();
+	//debugf_uart("updating attacker replicas: %d\n", attacker->replicas);
+	update_replicas(attacker->replicas, attacker, &attacker_schema, true);
 	//dump_game_state();
 }
 
-void shrink_attacker(int idx) {
-	attacker_t* attacker = &console_attackers[idx];
-	if (attacker->spawned && attacker->level > 0) {
-		// If level was QUEUE_LENGTH, avoid immediate reaction
-		if (attacker->level == QUEUE_LENGTH) {
-			attacker->last_attack = global_state.level_timer;
-			reset_overheat_timer(idx);
-		}
-		attacker->level--;
-		attacker->queue.start = (attacker->queue.start + 1) % QUEUE_LENGTH;
-		debugf_uart("shrink %d: level=%d start=%d\n", idx, attacker->level, attacker->queue.start);
-		update_attacker(attacker);
-	}
-}
-
-void grow_attacker(int idx) {
-	attacker_t* attacker = &console_attackers[idx];
-	//debugf_uart("grow_attacker: %f\n", attacker->last_attack - global_state.level_timer);
-	if (attacker->spawned && attacker->level < QUEUE_LENGTH) {
-		if (attacker->level == 0) {
-			// Re-spawning
-			attacker->rival_type = (rand() % TOTAL_RIVALS);
-			// TODO Should have a new random level of persistence?
-		}
-		attacker->level++;
-		attacker->queue.buttons[attacker->queue.end] = (rand() % TOTAL_BUTTONS);
-		attacker->queue.end = (attacker->queue.end + 1) % QUEUE_LENGTH;
-		attacker->last_attack = global_state.level_timer;
-		reset_overheat_timer(idx);
-		debugf_uart("grow %d: level=%d end=%d\n", idx, attacker->level, attacker->queue.end);
-		update_attacker(attacker);
-	}
-}
 
-void spawn_attacker(int idx) {
-	//debugf_uart("spawn_attacker: %f\n", levels[global_state.current_level].duration - global_state.level_timer);
-	attacker_t* attacker = &console_attackers[idx];
-	attacker->id = idx;
-	attacker->spawned = true;
-	attacker->rival_type = (rand() % TOTAL_RIVALS);
-	attacker->level = 0;
-	attacker->last_attack = global_state.level_timer;
-	attacker->queue.start = 0;
-	attacker->queue.end = 0;
-	attacker->min_replicas = (int) ATTACKER_REPLICAS * levels[global_state.current_level].attacker_restore_threshold;
-	if (attacker->min_replicas > 0) {
-		attacker->min_replicas += rand() % ((ATTACKER_REPLICAS - attacker->min_replicas) / 3);
-	}
-	debugf_uart("spawn %d: level=%d start=%d end=%d\n", idx, attacker->level, attacker->queue.start, attacker->queue.end);
-	replicate_attacker(attacker);
-	grow_attacker(idx);
-}
+// Gameplay changes reported by the simulation (see sim.h)
 
-queue_button_t get_attacker_button(int idx, int i) {
-	attack_queue_t* queue = &console_attackers[idx].queue;
-	if (queue->start < queue->end) {
-		return queue->buttons[queue->start + i];
-	} else if (i <= (TOTAL_BUTTONS-1-queue->start)) {
-		return queue->buttons[queue->start + i];
-	} else {
-		return queue->buttons[i - (TOTAL_BUTTONS-queue->start)];
+void persist_sim_event(sim_event_t event, int arg) {
+	switch (event) {
+		case SIM_ATTACKER_SPAWNED:
+			persist_spawned_attacker(&console_attackers[arg]);
+			break;
+		case SIM_ATTACKER_GROWN: {
+			attacker_t* attacker = &console_attackers[arg];
+			queue_button_t button = attacker->queue.buttons[(attacker->queue.end + QUEUE_LENGTH - 1) % QUEUE_LENGTH];
+			log_event(EVENT_GROW_ATTACKER, arg | (button << 4) | (attacker->rival_type << 6), EVENT_TIME(attacker->last_attack));
+			break;
+		}
+		case SIM_ATTACKER_SHRUNK:
+			log_event(EVENT_SHRINK_ATTACKER, arg, EVENT_TIME(level_clock.timer));
+			break;
+		case SIM_OVERHEAT_CHANGED:
+			persist_overheat(&console_overheat[arg]);
+			break;
+		case SIM_LEVEL_RESET_COUNTED:
+			log_event(EVENT_INC_LEVEL_RESET_COUNT, arg, 0);
+			break;
+		case SIM_LEVEL_POWER_CYCLE_COUNTED:
+			log_event(EVENT_INC_LEVEL_POWER_CYCLE_COUNT, 0, 0);
+			break;
+		case SIM_CLOCK_TICKED:
+			mark_dirty(level_clock.replicas, &level_clock, &level_clock_schema, NULL, PRIORITY_NORMAL);
+			break;
+		case SIM_STATE_CHANGED:
+			update_global_state();
+			break;
+		case SIM_LEVEL_RESET:
+			if (!global_state.practice && arg < TOTAL_LEVELS && arg > profile.best_level) {
+				profile.best_level = arg;
+				save_mark(PROFILE_SAVE_RECORD);
+			}
+			update_global_state();
+			update_level_clock();
+			break;
+		case SIM_NEW_GAME:
+			global_counters.reset_count = 0;
+			global_counters.power_cycle_count = 0;
+			global_counters.games_count++;
+			profile.games_played++;
+			save_mark(PROFILE_SAVE_RECORD);
+			update_global_state();
+			update_counters();
+			update_level_clock();
+			break;
+		default:
+			break;
 	}
 }
-
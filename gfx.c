@@ -1,5 +1,6 @@
 #include <t3d/tpx.h>
 #include "gfx.h"
+#include "pc64.h"
 
 
 // Checkered background
@@ -65,24 +66,137 @@ void drawprogress(int x, int y, float scale, float progress, color_t col, sprite
 
 // Black bars on console reset
 
-void draw_bars(float height) {
+void draw_bars(float height, int size) {
+  float max = size / 2 - 1;
   if(height > 0) {
-	if (height > 39)	height = 39;
+	if (height > max)	height = max;
 	// White line in the middle
-	uint8_t intensity = (int) (height * 0xff / 39);
+	uint8_t intensity = (int) (height * 0xff / max);
 	rdpq_set_mode_standard();
 	rdpq_mode_blender(RDPQ_BLENDER_MULTIPLY);
 	rdpq_mode_combiner(RDPQ_COMBINER_FLAT);
 	rdpq_set_prim_color(RGBA32(0xff, 0xff, 0xff, intensity));
-	rdpq_fill_rectangle(0, 0, 80, 80);
+	rdpq_fill_rectangle(0, 0, size, size);
 	// Black bars top and bottom
 	rdpq_set_prim_color(RGBA32(0, 0, 0, 0xff));
-	rdpq_fill_rectangle(0, 0, 80, height);
-	rdpq_fill_rectangle(0, 80 - height, 80, 80);
+	rdpq_fill_rectangle(0, 0, size, height);
+	rdpq_fill_rectangle(0, size - height, size, size);
   }
 }
 
 
+// CRT screens in 8 bits: luminance of an RGBA16 surface of the same size
+
+void convert_to_i8(const surface_t* src, surface_t* dst) {
+	// Through the cache: both surfaces are allocated uncached
+	data_cache_hit_invalidate(CachedAddr(src->buffer), src->stride * src->height);
+	for (int y=0; y<src->height; y++) {
+		const uint16_t* in = (const uint16_t*) CachedAddr(src->buffer + y * src->stride);
+		uint8_t* out = (uint8_t*) CachedAddr(dst->buffer + y * dst->stride);
+		for (int x=0; x<src->width; x++) {
+			uint16_t p = in[x];
+			// 5-bit channels weighted as in BT.601, then scaled to 8 bits
+			uint32_t l = ((p >> 11) & 0x1f) * 77 + ((p >> 6) & 0x1f) * 150 + ((p >> 1) & 0x1f) * 29;
+			out[x] = (l * 33) >> 10;
+		}
+	}
+	data_cache_hit_writeback(CachedAddr(dst->buffer), dst->stride * dst->height);
+}
+
+
+// Surface pool: render targets used level after level are allocated once, at startup
+
+typedef struct {
+	surface_t surface;	// First: handed out surfaces are their pool entry
+	bool used;
+} pooled_surface_t;
+
+static pooled_surface_t pool[POOL_SURFACES];
+static int pool_count;
+
+static surface_t* pool_add(tex_format_t format, int width, int height) {
+	if (pool_count == POOL_SURFACES) {
+		debugf_uart("Pool: full, cannot add %dx%d surface\n", width, height);
+		return NULL;
+	}
+	pooled_surface_t* pooled = &pool[pool_count++];
+	pooled->surface = surface_alloc(format, width, height);
+	pooled->used = false;
+	return &pooled->surface;
+}
+
+void pool_reserve(tex_format_t format, int width, int height, int count) {
+	for (int i=0; i<count; i++) {
+		pool_add(format, width, height);
+	}
+}
+
+surface_t* pool_acquire(tex_format_t format, int width, int height) {
+	pooled_surface_t* found = NULL;
+	for (int i=0; i<pool_count && found == NULL; i++) {
+		surface_t* surface = &pool[i].surface;
+		if (!pool[i].used && surface_get_format(surface) == format && surface->width == width && surface->height == height) {
+			found = &pool[i];
+		}
+	}
+	if (found == NULL) {
+		// Not reserved: allocated now, and kept for later
+		debugf_uart("Pool: allocating an unreserved %dx%d surface\n", width, height);
+		surface_t* surface = pool_add(format, width, height);
+		if (surface == NULL) {
+			return NULL;
+		}
+		found = (pooled_surface_t*) surface;
+	}
+	found->used = true;
+	return &found->surface;
+}
+
+void pool_release(surface_t* surface) {
+	if (surface != NULL) {
+		((pooled_surface_t*) surface)->used = false;
+	}
+}
+
+int pool_bytes() {
+	int bytes = 0;
+	for (int i=0; i<pool_count; i++) {
+		bytes += pool[i].surface.stride * pool[i].surface.height;
+	}
+	return bytes;
+}
+
+
+// Level arena: per-console buffers of a level are carved out of one block allocated at startup,
+// and all given back at once when the level is cleared
+
+static uint8_t* arena;
+static int arena_size;
+static int arena_used;
+static int arena_peak;
+
+void arena_init(int size) {
+	arena = malloc_uncached(size);
+	arena_size = size;
+	arena_used = 0;
+}
+
+void* arena_alloc(int size) {
+	int offset = (arena_used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	assertf(offset + size <= arena_size, "Arena: full, cannot allocate %d bytes (%d/%d used)", size, arena_used, arena_size);
+	arena_used = offset + size;
+	arena_peak = MAX(arena_peak, arena_used);
+	return arena + offset;
+}
+
+void arena_reset() {
+	arena_used = 0;
+}
+
+int arena_bytes() {
+	return arena_peak;
+}
+
 // Gauges for overheat, reset count, power cycle count
 
 void draw_gauge(int x, int y, int height, int item_width, int spacing, int border, int item_count, int item_max, color_t color, color_t border_color) {
@@ -103,6 +217,8 @@ void draw_gauge(int x, int y, int height, int item_width, int spacing, int borde
 
 // Smoke particle system
 
+rng_t vfx_rng;
+
 static void gradient_smoke(uint8_t *color, float t, int heat_level) {
     t = fminf(1.0f, fmaxf(0.0f, t));
 	// Gray to red-ish
@@ -118,18 +234,18 @@ static void gradient_smoke(uint8_t *color, float t, int heat_level) {
  */
 static void simulate_particles_smoke(particles_t* particles, int heat_level, float posX, float posZ) {
   int p = particles->currentPart / 2;
-  if(particles->currentPart % (1+(rand() % 3)) == 0) {
+  if(particles->currentPart % (1+rng_below(&vfx_rng, 3)) == 0) {
     int8_t *ptPos  = tpx_buffer_s8_get_pos(particles->buffer, p);
     int8_t *size   = tpx_buffer_s8_get_size(particles->buffer, p);
     uint8_t *color = tpx_buffer_s8_get_rgba(particles->buffer, p);
 
-    ptPos[0] = posX + (rand() % 16) - 8;
+    ptPos[0] = posX + (int) rng_below(&vfx_rng, 16) - 8;
     ptPos[1] = -126;
     gradient_smoke(color, 0, heat_level);
     color[3] = ((PhysicalAddr(ptPos) % 8) * 32);
 
-    ptPos[2] = posZ + (rand() % 16) - 8;
-    *size = 118 + (rand() % 10);
+    ptPos[2] = posZ + (int) rng_below(&vfx_rng, 16) - 8;
+    *size = 118 + rng_below(&vfx_rng, 10);
   }
   particles->currentPart = (particles->currentPart + 1) % particles->particleCount;
 
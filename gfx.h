@@ -5,6 +5,7 @@
 #include "game_state.h"
 
 #define PARTICLE_COUNT_MAX (72)
+#define PARTICLES_BYTES (sizeof(TPXParticleS8) * PARTICLE_COUNT_MAX / 2)	// Two particles per TPXParticleS8
 
 // One particle system per console
 typedef struct {
@@ -17,8 +18,24 @@ typedef struct {
 } particles_t;
 static particles_t console_particles[MAX_CONSOLES];
 
+// Render targets allocated once and handed out by format and size
+#define POOL_SURFACES (3 * MAX_CONSOLES + 1)
+// Level arena alignment (matrices, particles)
+#define ARENA_ALIGN (16)
+
+extern rng_t vfx_rng;	// RNG_STREAM_VFX
+
 void draw_bg(sprite_t* pattern, sprite_t* gradient, float offset, color_t base_color);
 void drawprogress(int x, int y, float scale, float progress, color_t col, sprite_t* spr_progress, sprite_t* spr_circlemask);
-void draw_bars(float height);
+void draw_bars(float height, int size);
+void convert_to_i8(const surface_t* src, surface_t* dst);
+void pool_reserve(tex_format_t format, int width, int height, int count);
+surface_t* pool_acquire(tex_format_t format, int width, int height);
+void pool_release(surface_t* surface);
+int pool_bytes();
+void arena_init(int size);
+void* arena_alloc(int size);
+void arena_reset();
+int arena_bytes();
 void draw_gauge(int x, int y, int height, int item_width, int spacing, int border, int item_count, int item_max, color_t color, color_t border_color);
 void drawsmoke(particles_t* particles, T3DVec3 position, float console_scale, int frameIdx, float frametime, int heat_level, sprite_t* spr_swirl);
@@ -9,8 +9,13 @@
 #include "game_state.h"
 #include "gfx.h"
 #include "logo.h"
+#include "perf.h"
 #include "persistence.h"
+#include "ports.h"
 #include "recovery.h"
+#include "replay.h"
+#include "save.h"
+#include "sim.h"
 #include "pc64.h"
 
 
@@ -19,10 +24,32 @@ static char __attribute__((aligned(16))) heaps_buf[40];
 
 
 #define FB_COUNT (3)
-#define OFFSCREEN_SIZE (80)
+#ifndef OFFSCREEN_SIZE
+#define OFFSCREEN_SIZE (80)			// CRT screen resolution: 80 (as laid out in the model) or 40
+#endif
+#ifndef CRT_FORMAT
+#define CRT_FORMAT FMT_RGBA16		// Texture of the CRT screens: FMT_RGBA16, or FMT_I8 (grayscale, converted by the CPU)
+#endif
+#define CRT_LOOKUP_SLOT (1)			// rdpq lookup address of the surface shown by the CRT being drawn
+#define CRT_SCALE (OFFSCREEN_SIZE / 80.0f)
+#define CRT_SCALE_LOG (OFFSCREEN_SIZE == 40 ? -1 : 0)	// Model UVs are in 80x80 texels
+#define CRT_BYTES (OFFSCREEN_SIZE * OFFSCREEN_SIZE * TEX_FORMAT_BITDEPTH(CRT_FORMAT) / 8)
+#define CRT_PIECES (CRT_BYTES <= 4096 ? 1 : (CRT_BYTES <= 2*4096 ? 2 : 4))	// TMEM uploads per screen
+_Static_assert(OFFSCREEN_SIZE == 80 || OFFSCREEN_SIZE == 40, "CRT model UVs can only be scaled by powers of two");
+#define CONSOLE_BYTES (3 * sizeof(T3DMat4FP) * FB_COUNT + PARTICLES_BYTES)	// Level arena use per console
+#define LEVEL_ARENA_SIZE (MAX_CONSOLES * CONSOLE_BYTES)
 #define MUSIC_CHANNEL (4)
 #define SFX_CHANNEL (0)
 #define FONT_HALODEK (2)
+#define SAVE_STEP_BUDGET TICKS_FROM_US(2000)	// Cartridge save commits must not stall a frame
+#define JOYPAD_SAMPLE_HZ (240)		// 4x the frame rate
+#define JOYPAD_SAMPLES (32)			// Samples kept between two frames
+#ifndef INPUT_RECORD_PATH
+#define INPUT_RECORD_PATH "sd:/input.rec"	// INPUT_RECORD builds (SD card of a flashcart)
+#endif
+#ifndef INPUT_REPLAY_PATH
+#define INPUT_REPLAY_PATH "rom:/input.rec"	// INPUT_REPLAY builds (copy the recording into filesystem/)
+#endif
 
 static T3DViewport viewport;
 static T3DVec3 camPos = {{ 0.0f, 70.0f, 120.0f }};
@@ -69,13 +96,44 @@ static rdpq_textparms_t descparms = { .align = ALIGN_CENTER, .width = 280, .heig
 
 
 static int current_joypad = -1;
-static float holding = 0.0f;
+static sim_input_t joypad_input;	// Latest state, with the buttons pressed during the frame
+static sim_sample_t joypad_samples[JOYPAD_SAMPLES];
+static int joypad_samples_count;
+static uint8_t joypad_ports;
+static uint16_t joypad_held;
+
+typedef struct {
+	uint32_t ticks;
+	uint8_t ports;		// Connected ports, one bit per port
+	uint16_t held;		// Buttons of the single connected port (sim_button_t)
+	uint16_t pressed;
+} joypad_sample_t;
+
+static joypad_sample_t samples[JOYPAD_SAMPLES];
+static volatile uint32_t samples_head;	// Written by the sampling timer
+static uint32_t samples_tail;
+static joypad_sample_t last_sample;
+static uint32_t samples_ticks;			// Latest drain
+#ifdef DEBUG_MODE
+static uint32_t latency_press;			// Sample time of a press not displayed yet
+static rspq_syncpoint_t latency_sync;
+static uint32_t latency_pending;		// Press time of the frame behind latency_sync
+static uint32_t latency_last_ticks;
+static uint32_t latency_max_ticks;
+#endif
 static uint32_t held_ms;
+#ifdef INPUT_REPLAY
+static bool replaying = false;
+static uint32_t replay_frames;
+static uint32_t replay_start;
+#endif
 static reset_type_t rst;
 static bool wrong_joypads_count = false;
 static bool paused = false;
 static bool in_reset = false;
 
+static sim_t sim;
+
 
 // These variables keep their value during a reset, so we can measure reset time and
 // apply gameplay to the console the player was plugged into when the reset button was hit
@@ -90,6 +148,9 @@ static volatile uint32_t reset_ticks __attribute__((section(".persistent")));
 static void reset_interrupt_callback(void) {
 	// Keep track of the time the player pressed the reset button
 	reset_ticks = TICKS_READ() | 1;
+	// Write pending game state before the console actually resets
+	emergency_commit_game_state();
+	save_flush();
 	if (global_state.game_state == IN_GAME) {
 		// Keep track of the current console
 		reset_console = current_joypad;
@@ -100,63 +161,105 @@ static void reset_interrupt_callback(void) {
 }
 
 
+// CRT screens: each console's offscreen surface is only redrawn when what it shows changes, and
+// consoles showing the same thing display the same surface (CRT_NO_CACHE redraws all every frame)
+
+typedef struct {
+	int8_t level;		// Attacker level (-1 when not spawned)
+	int8_t rival;
+	uint8_t bars;		// Reset bars height, in quarter pixels
+} crt_content_t;
+
+static surface_t crt_placeholder;
+static surface_t* crt_z;							// Offscreen passes run one after another: one depth buffer
+static crt_content_t crt_contents[MAX_CONSOLES];	// What each console's surface holds...
+static bool crt_valid[MAX_CONSOLES];				// ...if anything yet
+static int crt_sources[MAX_CONSOLES];				// Console whose surface each console shows
+static rspq_syncpoint_t crt_syncs[MAX_CONSOLES];	// Redraws waiting for their conversion to CRT_FORMAT...
+static bool crt_converting[MAX_CONSOLES];
+static rspq_syncpoint_t crt_back_syncs[MAX_CONSOLES];	// ...into crt_back, once the frames that sampled it are done
+static rspq_syncpoint_t crt_sampled;				// After the latest frame
+static int crt_uploaded;							// Piece of the screen in TMEM, while recording a CRT block
+static uint32_t crt_redraws;
+static uint32_t crt_shown;		// Consoles drawn, one per frame each
+
+
 // Console setup
 
 // This is a callback for t3d_model_draw_custom, it is used when a texture in a model is set to dynamic/"reference"
 void dynamic_tex_cb(void* userData, const T3DMaterial* material, rdpq_texparms_t *tileParams, rdpq_tile_t tile) {
   if(tile != TILE0)return; // this callback can happen 2 times per mesh, you are allowed to skip calls
 
-  surface_t *offscreenSurf = (surface_t*)userData;
+  surface_t *offscreenSurf = (surface_t*)userData;	// Placeholder, see CRT_LOOKUP_SLOT
+
+  // the screen in the TV model is split into 4 materials for each quadrant, determined by the texture
+  // reference set in fast64 (which can be used as an arbitrary value)
+  int quadrant = material->textureA.texReference - 1;
+  if (quadrant < 0 || quadrant > 3) return;
+  // each upload covers as much of the screen as fits in TMEM: all of it, a half (two quadrants) or a quadrant.
+  // Texture coordinates stay those of the whole surface, so the next quadrants can reuse what is loaded.
+  int piece = CRT_PIECES == 1 ? 0 : (CRT_PIECES == 2 ? quadrant / 2 : quadrant);
+  if (piece == crt_uploaded) return;
+  crt_uploaded = piece;
   rdpq_sync_tile();
 
   int sHalf = OFFSCREEN_SIZE / 2;
   int sFull = OFFSCREEN_SIZE;
-
-  // upload a slice of the offscreen-buffer, the screen in the TV model is split into 4 materials for each section
-  // if you are working with a small enough single texture, you can ofc use a normal sprite upload.
-  // the quadrant is determined by the texture reference set in fast64, which can be used as an arbitrary value
-  switch(material->textureA.texReference) { // Note: TILE1 is used here due to CC shenanigans
-    case 1: rdpq_tex_upload_sub(TILE1, offscreenSurf, NULL,  0,     0,     sHalf, sHalf); break;
-    case 2: rdpq_tex_upload_sub(TILE1, offscreenSurf, NULL,  sHalf, 0,     sFull, sHalf); break;
-    case 3: rdpq_tex_upload_sub(TILE1, offscreenSurf, NULL,  0,     sHalf, sHalf, sFull); break;
-    case 4: rdpq_tex_upload_sub(TILE1, offscreenSurf, NULL,  sHalf, sHalf, sFull, sFull); break;
-  }
+  int s0 = CRT_PIECES == 4 ? (quadrant % 2) * sHalf : 0;
+  int t0 = CRT_PIECES == 1 ? 0 : (quadrant / 2) * sHalf;
+  int s1 = CRT_PIECES == 4 ? s0 + sHalf : sFull;
+  int t1 = CRT_PIECES == 1 ? sFull : t0 + sHalf;
+  rdpq_texparms_t params = { .s.scale_log = CRT_SCALE_LOG, .t.scale_log = CRT_SCALE_LOG };
+  rdpq_tex_upload_sub(TILE1, offscreenSurf, &params, s0, t0, s1, t1); // Note: TILE1 is used here due to CC shenanigans
 }
 
 static void setup_console(int i, console_t* console) {
 	displayable_t* displayable = console->displayable;
-	displayable->model = console_model;
-	displayable->mat_fp = malloc_uncached(sizeof(T3DMat4FP) * FB_COUNT);
-	displayable->skel = t3d_skeleton_create_buffered(displayable->model, 1 /* FIXME FB_COUNT*/);
-	displayable->bone = t3d_skeleton_find_bone(&displayable->skel, "console");
-	displayable->offscreen_surf = surface_alloc(FMT_RGBA16, OFFSCREEN_SIZE, OFFSCREEN_SIZE);
-	displayable->offscreen_surf_z = surface_alloc(FMT_RGBA16, OFFSCREEN_SIZE, OFFSCREEN_SIZE);
-	rspq_block_begin();
-		t3d_model_draw_custom(displayable->model, (T3DModelDrawConf){
-			.userData = &displayable->offscreen_surf,
-			.dynTextureCb = dynamic_tex_cb,
-			.matrices = displayable->skel.bufferCount == 1
-				? displayable->skel.boneMatricesFP
-				: (const T3DMat4FP*)t3d_segment_placeholder(T3D_SEGMENT_SKELETON)
-		});
-	displayable->dpl = rspq_block_end();
-
-	displayable->model2 = n64_model;
-	displayable->mat_fp2 = malloc_uncached(sizeof(T3DMat4FP) * FB_COUNT);
-	rspq_block_begin();
-		t3d_model_draw(displayable->model2);
-	displayable->dpl2 = rspq_block_end();
+	if (displayable->dpl == NULL) {
+		// Skeleton and display lists only depend on the console slot: built once, kept level after level
+		displayable->model = console_model;
+		displayable->skel = t3d_skeleton_create_buffered(displayable->model, 1 /* FIXME FB_COUNT*/);
+		displayable->bone = t3d_skeleton_find_bone(&displayable->skel, "console");
+		crt_uploaded = -1;
+		rspq_block_begin();
+			t3d_model_draw_custom(displayable->model, (T3DModelDrawConf){
+				.userData = &crt_placeholder,
+				.dynTextureCb = dynamic_tex_cb,
+				.matrices = displayable->skel.bufferCount == 1
+					? displayable->skel.boneMatricesFP
+					: (const T3DMat4FP*)t3d_segment_placeholder(T3D_SEGMENT_SKELETON)
+			});
+		displayable->dpl = rspq_block_end();
+
+		displayable->model2 = n64_model;
+		rspq_block_begin();
+			t3d_model_draw(displayable->model2);
+		displayable->dpl2 = rspq_block_end();
+	}
+	displayable->mat_fp = arena_alloc(sizeof(T3DMat4FP) * FB_COUNT);
+	displayable->mat_fp2 = arena_alloc(sizeof(T3DMat4FP) * FB_COUNT);
+	displayable->offscreen_surf = pool_acquire(FMT_RGBA16, OFFSCREEN_SIZE, OFFSCREEN_SIZE);
+	if (CRT_FORMAT != FMT_RGBA16) {
+		// Black until the first conversion
+		displayable->crt_surf = pool_acquire(CRT_FORMAT, OFFSCREEN_SIZE, OFFSCREEN_SIZE);
+		displayable->crt_back = pool_acquire(CRT_FORMAT, OFFSCREEN_SIZE, OFFSCREEN_SIZE);
+		memset(displayable->crt_surf->buffer, 0, displayable->crt_surf->stride * OFFSCREEN_SIZE);
+		crt_back_syncs[i] = rspq_syncpoint_new();
+	}
+	crt_valid[i] = false;
+	crt_converting[i] = false;
 	// Particles
 	particles_t* particles = &console_particles[i];
-	uint32_t allocSize = sizeof(TPXParticleS8) * PARTICLE_COUNT_MAX / 2;
-	particles->buffer = malloc_uncached(allocSize);
-	memset(particles->buffer, 0, allocSize);
-	particles->mat_fp = malloc_uncached(sizeof(T3DMat4FP) * FB_COUNT);
+	particles->buffer = arena_alloc(PARTICLES_BYTES);
+	memset(particles->buffer, 0, PARTICLES_BYTES);
+	particles->mat_fp = arena_alloc(sizeof(T3DMat4FP) * FB_COUNT);
 }
 
-
 // Level setup
 
+static uint32_t level_switch_ticks;		// Last load or clear
+static int heap_peak;					// Seen at level switches (and by the debug overlay)
+
 const float console_scales[MAX_CONSOLES] = { 0.18f, 0.18f, 0.13f, 0.10f };
 const T3DVec3 console_positions[MAX_CONSOLES][MAX_CONSOLES] = {
 	{ (T3DVec3){{0, 0, -25.0f}},		(T3DVec3){{0, 0, 0}}, 				(T3DVec3){{0, 0, 0}}, 				(T3DVec3){{0, 0, 0}} },
@@ -171,7 +274,18 @@ const T3DVec3 console_rotations[MAX_CONSOLES][MAX_CONSOLES] = {
 	{ (T3DVec3){{0, T3D_DEG_TO_RAD(-45.0f), 0}}, 	(T3DVec3){{0, T3D_DEG_TO_RAD(-10.0f), 0}},	(T3DVec3){{0, T3D_DEG_TO_RAD(10.0f), 0}}, 	(T3DVec3){{0, T3D_DEG_TO_RAD(45.0f), 0}} }
 };
 
+static void report_level_switch(const char* step, uint32_t start) {
+	uint32_t ticks = TICKS_SINCE(start);
+	heap_stats_t stats;
+	sys_get_heap_stats(&stats);
+	heap_peak = MAX(heap_peak, stats.used);
+	level_switch_ticks = ticks;
+	debugf_uart("Level %s in %ldus, heap %d used (peak %d), arena %d/%d\n",
+		step, TICKS_TO_US(ticks), stats.used, heap_peak, arena_bytes(), LEVEL_ARENA_SIZE);
+}
+
 void load_level(int next_level) {
+	uint32_t start = TICKS_READ();
 	debugf_uart("Loading level %d\n", next_level);
 	const level_t* level = &levels[next_level];
 
@@ -186,41 +300,43 @@ void load_level(int next_level) {
 		console->position = console_positions[level->consoles_count-1][i];
 		replicate_console(console);
 	}
+	report_level_switch("loaded", start);
 }
 
 void clear_level() {
+	uint32_t start = TICKS_READ();
 	debugf_uart("Clearing level %d\n", global_state.current_level);
 	const level_t* level = &levels[global_state.current_level];
 	debugf_uart("Erasing %d/%d consoles\n", consoles_count, level->consoles_count);
 	int count = consoles_count;
 	for (int i=0; i<count; i++) {
 		console_t* console = &consoles[i];
-		erase_and_free_replicas(console->replicas, CONSOLE_REPLICAS);
+		erase_and_free_replicas(&console->replicas);
+		// Skeleton and display lists stay for the next level, buffers go with the arena below
 		displayable_t* displayable = console->displayable;
-		free_uncached(displayable->mat_fp);
-		t3d_skeleton_destroy(&displayable->skel);
-		surface_free(&displayable->offscreen_surf);
-		surface_free(&displayable->offscreen_surf_z);
-		rspq_block_free(displayable->dpl);
-		free_uncached(displayable->mat_fp2);
-		rspq_block_free(displayable->dpl2);
-		memset(displayable, 0, sizeof(displayable_t));
+		pool_release(displayable->offscreen_surf);
+		pool_release(displayable->crt_surf);
+		pool_release(displayable->crt_back);
+		displayable->offscreen_surf = NULL;
+		displayable->crt_surf = NULL;
+		displayable->crt_back = NULL;
+		displayable->mat_fp = NULL;
+		displayable->mat_fp2 = NULL;
 		memset(console, 0, sizeof(console_t));
-		particles_t* particles = &console_particles[i];
-		free_uncached(particles->buffer);
-		free_uncached(particles->mat_fp);
-		memset(particles, 0, sizeof(particles_t));
+		memset(&console_particles[i], 0, sizeof(particles_t));
 
 		attacker_t* attacker = &console_attackers[i];
-		erase_and_free_replicas(attacker->replicas, ATTACKER_REPLICAS);
+		erase_and_free_replicas(&attacker->replicas);
 		memset(attacker, 0, sizeof(attacker_t));
 
 		overheat_t* overheat = &console_overheat[i];
-		erase_and_free_replicas(overheat->replicas, OVERHEAT_REPLICAS);
+		erase_and_free_replicas(&overheat->replicas);
 		memset(overheat, 0, sizeof(overheat_t));
 
 		consoles_count--;
 	}
+	arena_reset();
+	report_level_switch("cleared", start);
 }
 
 
@@ -252,256 +368,322 @@ static void play_menu_music() {
 
 // Game logic loop
 
-void update() {
-	t3d_viewport_set_projection(&viewport, T3D_DEG_TO_RAD(45.0f), 10.0f, 150.0f);
-	t3d_viewport_look_at(&viewport, &camPos, &camTarget, &(T3DVec3){{0,1,0}});
-
-	switch (global_state.game_state) {
-		case INTRO: {
-			// Only accept first controller to start the game
-			if (current_joypad == 0) {
-				joypad_buttons_t pressed = joypad_get_buttons_pressed(current_joypad);
-				if (pressed.a || pressed.start) {
-					set_game_state(NEXT_LEVEL);
-					reset_level_global_state(global_state.current_level);
-					//play_menu_music();
-					wav64_play(&sfx_blip, SFX_CHANNEL);
-				}
-				if (global_state.games_count > 0 && pressed.z) {
-					reset_level_global_state(5);
-					load_level(5);
-					play_ingame_music();
-					set_game_state(IN_GAME);
-					set_practice(true);
-					wav64_play(&sfx_blip, SFX_CHANNEL);
-				}
-			}
+static void on_sim_event(sim_t* sim, sim_event_t event, int arg) {
+	persist_sim_event(event, arg);
+	switch (event) {
+		case SIM_LEVEL_STARTED:
+			load_level(arg);
+			play_ingame_music();
 			break;
-		}
-		case IN_GAME: {
-			set_level_timer(global_state.level_timer - frametime);
-			bool cleared = (global_state.level_timer < 0.0f);
-
-			// Spawn attackers and add attacks
-			const level_t* level = &levels[global_state.current_level];
-			for (int i=0; i<consoles_count; i++) {
-				console_t* console = &consoles[i];
-				attacker_t* attacker = &console_attackers[i];
-				overheat_t* overheat = &console_overheat[i];
-				if (!attacker->spawned || (attacker->level < QUEUE_LENGTH && attacker->last_attack - level->attack_grace_pediod >= global_state.level_timer)) {
-					float r = rand() / (float) RAND_MAX;
-					float threshold = frametime * level->attack_rate;
-					float max_time_between_attacks = 2.0f * (1.0f / level->attack_rate);
-					if (r < threshold || attacker->last_attack - global_state.level_timer >= max_time_between_attacks) {
-						wav64_play(&sfx_attack, SFX_CHANNEL);
-						if (!attacker->spawned) {
-							spawn_attacker(i);
-						} else if (attacker->last_attack - level->attack_grace_pediod >= global_state.level_timer) {
-							grow_attacker(i);
-						}
-					}
-				}
-				bool overheating = attacker->spawned && attacker->level == QUEUE_LENGTH;
-				if (overheating && overheat->last_overheat - global_state.level_timer >= OVERHEAT_PERIOD) {
+		case SIM_LEVEL_ENDED:
+			clear_level();
+			play_menu_music();
+			break;
+		case SIM_SOUND:
+			switch (arg) {
+				case SIM_SOUND_BLIP:
+					wav64_play(&sfx_blip, SFX_CHANNEL);
+					break;
+				case SIM_SOUND_ATTACK:
+					wav64_play(&sfx_attack, SFX_CHANNEL);
+					break;
+				case SIM_SOUND_WHOOSH:
 					wav64_play(&sfx_whoosh, SFX_CHANNEL);
-					increase_overheat(i);
-					// Game over if reached level 4
-					if (overheat->overheat_level > 3) {
-						debugf_uart("OVERHEAT GAME OVER %d\n", i);
-						clear_level();
-						wav64_play(&sfx_gameover, SFX_CHANNEL);
-						play_menu_music();
-						set_game_state(GAME_OVER);
-						set_game_over(OVERHEATED);
-					}
-				}
+					break;
+				case SIM_SOUND_GAME_OVER:
+					wav64_play(&sfx_gameover, SFX_CHANNEL);
+					break;
 			}
+			break;
+		default:
+			break;
+	}
+}
 
-			// Handle inputs
-			if (current_joypad != -1) {
-				joypad_buttons_t pressed = joypad_get_buttons_pressed(current_joypad);
-				attacker_t* attacker = &console_attackers[current_joypad];
-				if (attacker->spawned && attacker->level > 0) {
-					queue_button_t btn = get_attacker_button(current_joypad, 0);
-					joypad_buttons_t down = joypad_get_buttons(current_joypad);
-					bool held = false;
-					switch (btn) {
-						case BTN_A:
-							held = down.a && !down.b && !down.c_up && !down.c_down;
-							break;
-						case BTN_B:
-							held = down.b && !down.a && !down.c_up && !down.c_down;
-							break;
-						case BTN_C_UP:
-							held = down.c_up && !down.a && !down.b && !down.c_down;
-							break;
-						case BTN_C_DOWN:
-							held = down.c_down && !down.a && !down.b && !down.c_up;
-							break;
-					}
-					if (held) {
-						holding += frametime;
-						if (holding >= BUTTON_HOLD_THRESHOLD) {	// TODO Threshold depending on enemy strength
-							shrink_attacker(current_joypad);
-							holding = 0;
-						}
-					} else {
-						holding = 0;
-					}
-				}
+static uint16_t sim_buttons(joypad_buttons_t buttons) {
+	return (buttons.a ? SIM_BUTTON_A : 0)
+		| (buttons.b ? SIM_BUTTON_B : 0)
+		| (buttons.z ? SIM_BUTTON_Z : 0)
+		| (buttons.start ? SIM_BUTTON_START : 0)
+		| (buttons.c_up ? SIM_BUTTON_C_UP : 0)
+		| (buttons.c_down ? SIM_BUTTON_C_DOWN : 0)
+		| (buttons.l ? SIM_BUTTON_L : 0)
+		| (buttons.r ? SIM_BUTTON_R : 0)
+		| (buttons.d_up ? SIM_BUTTON_D_UP : 0)
+		| (buttons.d_down ? SIM_BUTTON_D_DOWN : 0)
+		| (buttons.c_right ? SIM_BUTTON_C_RIGHT : 0);
+}
 
-#ifdef DEBUG_MODE
-				// Debug commands
-				if (pressed.r) {
-					// Spawn attacker
-					int idx = current_joypad;
-					if (!console_attackers[idx].spawned) {
-						spawn_attacker(idx);
-					} else {
-						grow_attacker(idx);
-					}
-				}
-				if (pressed.l) {
-					// Shrink attacker
-					int idx = current_joypad;
-					if (console_attackers[idx].spawned) {
-						shrink_attacker(idx);
-					}
-				}
-				if (pressed.d_up) {
-					// Increase heat
-					int idx = current_joypad;
-					increase_overheat(idx);
-					// Game over if reached level 4
-					if (console_overheat[idx].overheat_level > 3) {
-						debugf_uart("OVERHEAT GAME OVER %d\n", idx);
-						clear_level();
-						wav64_play(&sfx_gameover, SFX_CHANNEL);
-						play_menu_music();
-						set_game_state(GAME_OVER);
-						set_game_over(OVERHEATED);
-					}
-				}
-				if (pressed.d_down) {
-					// Decrease heat
-					int idx = current_joypad;
-					if (console_overheat[idx].overheat_level > 0) {
-						decrease_overheat(idx);
-					}
-				}
-				if (pressed.start) {
-					cleared = true;
-				}
+#ifdef INPUT_REPLAY
+// Recorded resets and power cycles are applied in place, as the followup boot sequence does after a full restoration
+static void replay_boot(const replay_record_t* record) {
+	if (record->kind == REPLAY_POWER_CYCLE) {
+		inc_power_cycle_count();
+		sim_power_cycle(&sim);
+	} else {
+		inc_reset_count();
+		sim_reset(&sim, record->console, record->held_ms, &global_state.rng);
+	}
+}
 #endif
 
-				if (global_state.practice && pressed.z) {
-					set_game_state(INTRO);
-					clear_level();
-					reset_global_state();
-					play_menu_music();
-					wav64_play(&sfx_blip, SFX_CHANNEL);
-				}
-			}
+// Joypad sampling: a timer reads the joypad several times per frame, so that each fixed step of
+// the rules sees the input of its own time, even when a frame lasts several steps
 
-			// Handle end condition and change level
-			if (!global_state.practice && cleared) {
-				set_game_state(NEXT_LEVEL);
-				// TODO Keep level displayed for a few seconds, clear when loading the next level
-				clear_level();
-				reset_level_global_state(global_state.current_level + 1);
-				play_menu_music();
-				wav64_play(&sfx_blip, SFX_CHANNEL);
+static int single_port(uint8_t ports) {
+	int port = -1;
+	for (int i=0; i<MAX_CONSOLES; i++) {
+		if (ports & (1 << i)) {
+			if (port != -1) {
+				return -1;
 			}
-			break;
+			port = i;
 		}
-		case NEXT_LEVEL: {
-			if (current_joypad != -1) {
-				joypad_buttons_t pressed = joypad_get_buttons_pressed(current_joypad);
-				if (pressed.a || pressed.start) {
-					// Load next level
-					int next_level = global_state.current_level;
-					if (next_level < TOTAL_LEVELS) {
-						load_level(next_level);
-						play_ingame_music();
-						set_game_state(IN_GAME);
-					} else {
-						wav64_play(&sfx_blip, SFX_CHANNEL);
-						set_game_state(FINISHED);
-					}
+	}
+	return port;
+}
+
+// Timer interrupt: only changes (and presses) are kept
+static void sample_joypad(int ovfl) {
+	joypad_poll();
+	joypad_sample_t sample = { .ticks = TICKS_READ(), .ports = ports_connected() };
+	ports_poll(sample.ticks);
+	int port = single_port(sample.ports);
+	if (port != -1) {
+		sample.held = sim_buttons(ports_buttons(port));
+		sample.pressed = sample.held & ~(port == single_port(last_sample.ports) ? last_sample.held : 0);
+	}
+	if (sample.ports == last_sample.ports && sample.held == last_sample.held && sample.pressed == 0) {
+		return;
+	}
+	last_sample = sample;
+	if (samples_head - samples_tail == JOYPAD_SAMPLES) {
+		// Not drained yet (long frame): fold into the newest sample
+		joypad_sample_t* newest = &samples[(samples_head - 1) % JOYPAD_SAMPLES];
+		sample.pressed |= newest->pressed;
+		*newest = sample;
+		return;
+	}
+	samples[samples_head % JOYPAD_SAMPLES] = sample;
+	samples_head++;
+}
+
+// Identify the current joypad port, make sure only one is plugged, and collect the frame's samples
+static void poll_joypad() {
+	joypad_samples_count = 0;
+#ifdef INPUT_REPLAY
+	if (replaying) {
+		replay_record_t record;
+		while ((replaying = replay_next(&record)) && record.kind != REPLAY_FRAME) {
+			if (record.kind == REPLAY_SAMPLE) {
+				if (joypad_samples_count < JOYPAD_SAMPLES) {
+					sim_sample_t* sample = &joypad_samples[joypad_samples_count++];
+					sample->time = record.time;
+					replay_sim_input(&record, &sample->input);
 				}
+			} else {
+				replay_boot(&record);
 			}
-			break;
 		}
-		case FINISHED: {
-			if (current_joypad != -1) {
-				joypad_buttons_t pressed = joypad_get_buttons_pressed(current_joypad);
-				if (pressed.start) {
-					reset_global_state();
-					wav64_play(&sfx_blip, SFX_CHANNEL);
-				}
+		if (replaying) {
+			replay_sim_input(&record, &joypad_input);
+			if (joypad_samples_count == 0) {
+				joypad_samples[joypad_samples_count++] = (sim_sample_t) { .time = 0, .input = joypad_input };
 			}
-			break;
+			wrong_joypads_count = (record.ports & (record.ports - 1)) != 0;
+			current_joypad = joypad_input.port;
+			frametime = record.dt;
+			replay_frames++;
+			return;
 		}
-		case GAME_OVER: {
-			if (current_joypad != -1) {
-				joypad_buttons_t pressed = joypad_get_buttons_pressed(current_joypad);
-				if (pressed.start) {
-					reset_global_state();
-					wav64_play(&sfx_blip, SFX_CHANNEL);
-				}
-			}
-			break;
+		uint32_t elapsed_ms = TICKS_TO_MS(TICKS_SINCE(replay_start));
+		debugf_uart("Replay: %ld frames in %ldms (%.2fms per frame)\n", replay_frames, elapsed_ms, elapsed_ms / (float) replay_frames);
+		replay_close();
+	}
+#endif
+
+	joypad_sample_t drained[JOYPAD_SAMPLES];
+	int count = 0;
+	uint32_t now = TICKS_READ();
+	disable_interrupts();
+	while (samples_tail != samples_head) {
+		drained[count++] = samples[samples_tail % JOYPAD_SAMPLES];
+		samples_tail++;
+	}
+	enable_interrupts();
+
+	uint16_t pressed = 0;
+	for (int i=0; i<count; i++) {
+		joypad_sample_t* s = &drained[i];
+		float time = TICKS_DISTANCE(samples_ticks, s->ticks) / (float) TICKS_PER_SECOND;
+		sim_sample_t* sample = &joypad_samples[joypad_samples_count++];
+		sample->time = time < 0.0f ? 0.0f : (time > frametime ? frametime : time);
+		sample->input = (sim_input_t) { .port = single_port(s->ports), .held = s->held, .pressed = s->pressed };
+		if (sample->input.port == -1) {
+			sample->input.held = 0;
+			sample->input.pressed = 0;
+		}
+		pressed |= sample->input.pressed;
+		joypad_ports = s->ports;
+		joypad_held = sample->input.held;
+#ifdef DEBUG_MODE
+		if ((s->pressed & ~SIM_BUTTON_C_RIGHT) && latency_press == 0) {
+			latency_press = s->ticks | 1;
 		}
+#endif
+#ifdef INPUT_RECORD
+		replay_record(&(replay_record_t) { .kind = REPLAY_SAMPLE, .time = sample->time, .ports = s->ports, .held = sample->input.held, .pressed = sample->input.pressed });
+#endif
 	}
+	samples_ticks = now;
+
+	wrong_joypads_count = (joypad_ports & (joypad_ports - 1)) != 0;
+	current_joypad = single_port(joypad_ports);
+	joypad_input = (sim_input_t) { .port = current_joypad, .held = joypad_held, .pressed = pressed };
+
+#ifdef INPUT_RECORD
+	// Frames only carry the state after their samples
+	replay_record(&(replay_record_t) { .kind = REPLAY_FRAME, .ports = joypad_ports, .held = joypad_held, .dt = frametime });
+#endif
+}
+
+void update() {
+	t3d_viewport_set_projection(&viewport, T3D_DEG_TO_RAD(45.0f), 10.0f, 150.0f);
+	t3d_viewport_look_at(&viewport, &camPos, &camTarget, &(T3DVec3){{0,1,0}});
+
+	sim.practice_unlocked = global_counters.games_count > 0 || profile.games_played > 0;
+	sim_advance_samples(&sim, joypad_samples, joypad_samples_count, frametime, &global_state.rng);
 }
 
 
 // Render to console screens
 
+static crt_content_t crt_content(int i) {
+	attacker_t* attacker = &console_attackers[i];
+	crt_content_t content = {
+		.level = attacker->spawned ? attacker->level : -1,
+		.rival = attacker->spawned ? attacker->rival_type : -1
+	};
+	if (i == reset_console) {
+		float height = exception_reset_time()/2;
+		content.bars = height <= 0 ? 0 : (height > 39 ? 39 : height) * 4;
+	}
+	return content;
+}
+
+static bool crt_same(crt_content_t a, crt_content_t b) {
+	return a.level == b.level && a.rival == b.rival && a.bars == b.bars;
+}
+
+static void draw_crt(console_t* console, crt_content_t content) {
+	// Render the offscreen-scene first, for that we attach the extra buffer instead of the screen one
+	rdpq_attach_clear(console->displayable->offscreen_surf, crt_z);
+
+	// Laid out for 80x80
+	int level = content.level < 0 ? 0 : content.level;
+	int x = 0;
+	int y = 0;
+	float s = 1.0f - (.25f * level);
+	if (s > 0.0f) {
+		rdpq_set_mode_standard();
+		rdpq_sprite_blit(logo_n64, x, y, &(rdpq_blitparms_t) {
+			.scale_x = s * CRT_SCALE, .scale_y = s * CRT_SCALE,
+		});
+	}
+	if (content.level > 0) {
+		// Draw attacker logo (size grows with attacker level)
+		x = (80 - 20 * level) * CRT_SCALE;
+		y = (80 - 20 * level) * CRT_SCALE;
+		s = .25f * level * CRT_SCALE;
+		sprite_t* spr = NULL;
+		switch (content.rival) {
+			case SATURN:
+				spr = logo_saturn;
+				break;
+			case PLAYSTATION:
+				spr = logo_playstation;
+				break;
+		}
+		rdpq_set_mode_standard();
+		rdpq_sprite_blit(spr, x, y, &(rdpq_blitparms_t) {
+			.scale_x = s, .scale_y = s,
+		});
+	}
+
+	draw_bars(content.bars / 4.0f * CRT_SCALE, OFFSCREEN_SIZE);
+
+	rdpq_detach();
+}
+
+// Surface sampled by a console's CRT
+static void* crt_buffer(int i) {
+	displayable_t* displayable = consoles[crt_sources[i]].displayable;
+	return CRT_FORMAT == FMT_RGBA16 ? displayable->offscreen_surf->buffer : displayable->crt_surf->buffer;
+}
+
 void render_offscreen() {
 	if (global_state.game_state == IN_GAME) {
-		for (int i=0; i<consoles_count; i++) {
-			console_t* console = &consoles[i];
-			// ======== Draw (Offscreen) ======== //
-			// Render the offscreen-scene first, for that we attach the extra buffer instead of the screen one
-			rdpq_attach_clear(&console->displayable->offscreen_surf, &console->displayable->offscreen_surf_z);
-
-			attacker_t* attacker = &console_attackers[i];
-			int x = 0;
-			int y = 0;
-			float s = 1.0f - (.25f * attacker->level);
-			if (s > 0.0f) {
-				rdpq_set_mode_standard();
-				rdpq_sprite_blit(logo_n64, x, y, &(rdpq_blitparms_t) {
-					.scale_x = s, .scale_y = s,
-				});
+		// Redraws the RDP is done with: converted into the back surface, which the CRT shows from now on
+		// (the front one may still be sampled by frames the RDP has not finished)
+		for (int k=0; k<consoles_count; k++) {
+			displayable_t* displayable = consoles[k].displayable;
+			if (crt_converting[k] && rspq_syncpoint_check(crt_syncs[k]) && rspq_syncpoint_check(crt_back_syncs[k])) {
+				convert_to_i8(displayable->offscreen_surf, displayable->crt_back);
+				surface_t* front = displayable->crt_surf;
+				displayable->crt_surf = displayable->crt_back;
+				displayable->crt_back = front;
+				crt_back_syncs[k] = crt_sampled;
+				crt_converting[k] = false;
 			}
-			if (attacker->spawned && attacker->level > 0) {
-				// Draw attacker logo (size grows with attacker level)
-				x = 80 - 20 * attacker->level;
-				y = 80 - 20 * attacker->level;
-				s = .25f * attacker->level;
-				sprite_t* spr = NULL;
-				switch (attacker->rival_type) {
-					case SATURN:
-						spr = logo_saturn;
-						break;
-					case PLAYSTATION:
-						spr = logo_playstation;
-						break;
+		}
+
+		crt_content_t wanted[MAX_CONSOLES];
+		bool kept[MAX_CONSOLES] = { false };
+		for (int i=0; i<consoles_count; i++) {
+			wanted[i] = crt_content(i);
+			crt_sources[i] = -1;
+#ifdef CRT_NO_CACHE
+			crt_valid[i] = false;
+#endif
+		}
+		// Surfaces that already hold what a console wants
+		for (int i=0; i<consoles_count; i++) {
+			for (int k=0; k<consoles_count; k++) {
+				if (crt_valid[k] && crt_same(crt_contents[k], wanted[i])) {
+					crt_sources[i] = k;
+					kept[k] = true;
+					break;
 				}
-				rdpq_set_mode_standard();
-				rdpq_sprite_blit(spr, x, y, &(rdpq_blitparms_t) {
-					.scale_x = s, .scale_y = s,
-				});
 			}
-
-			if (i == reset_console) {
-				draw_bars(exception_reset_time()/2);
+		}
+		// Others are drawn once, preferably on their own surface, and shared
+		for (int i=0; i<consoles_count; i++) {
+			if (crt_sources[i] != -1) {
+				continue;
+			}
+			int target = i;
+			if (kept[target]) {
+				// Fewer surfaces are kept than consoles are served: one is free
+				for (target=0; kept[target]; target++);
+			}
+			PERF_RDP_BEGIN(PERF_RDP_OFFSCREEN + i);
+			draw_crt(&consoles[target], wanted[i]);
+			PERF_RDP_END(PERF_RDP_OFFSCREEN + i);
+			if (CRT_FORMAT != FMT_RGBA16) {
+				crt_syncs[target] = rspq_syncpoint_new();
+				crt_converting[target] = true;
+			}
+			crt_contents[target] = wanted[i];
+			crt_valid[target] = true;
+			kept[target] = true;
+			crt_redraws++;
+			for (int j=i; j<consoles_count; j++) {
+				if (crt_sources[j] == -1 && crt_same(wanted[j], wanted[i])) {
+					crt_sources[j] = target;
+				}
 			}
-
-			rdpq_detach();
 		}
+		crt_shown += consoles_count;
 	}
 }
 
@@ -549,6 +731,7 @@ void render_3d() {
 				// CRT model uses primary color to blend texture and noise
 				uint8_t blend = (uint8_t)(noise_strength * 255.4f);
     			rdpq_set_prim_color(RGBA32(blend, blend, blend, 255 - blend));
+				rdpq_set_lookup_address(CRT_LOOKUP_SLOT, crt_buffer(i));
 				rspq_block_run(console->displayable->dpl);
 				
 				if(console->displayable->bone >= 0) {
@@ -612,20 +795,32 @@ void render_2d() {
 		heap_size -= 4*1024*1024;
 	}
 	heaps_stats(heaps_buf, 40);
+	save_stats_t save = save_stats();
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 140, "         Save : %ld/%ld %dus", save.commits, save.coalesced, (int) TICKS_TO_US(save.max_ticks));
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 150, "Reset console : %d", reset_console);
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 160, "    Boot type : %s", rst == RESET_COLD ? "COLD" : "WARM");
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 170, "     Restored : %d/%d/%d/%d", restored_global_state_count, restored_consoles_count, restored_attackers_count, restored_overheat_count);
-	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 180, "       Resets : %ld/%d-%d-%d-%d", global_state.reset_count, global_state.level_reset_count_per_console[0], global_state.level_reset_count_per_console[1], global_state.level_reset_count_per_console[2], global_state.level_reset_count_per_console[3]);
-	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 190, " Power cycles : %ld/%d", global_state.power_cycle_count, global_state.level_power_cycle_count);
-	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 200, "         Heap : %d/%d", stats.used, heap_size);
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 180, "       Resets : %ld/%d-%d-%d-%d", global_counters.reset_count, global_state.level_reset_count_per_console[0], global_state.level_reset_count_per_console[1], global_state.level_reset_count_per_console[2], global_state.level_reset_count_per_console[3]);
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 190, " Power cycles : %ld/%d", global_counters.power_cycle_count, global_state.level_power_cycle_count);
+	heap_peak = MAX(heap_peak, stats.used);
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 200, "         Heap : %d/%d <%d", stats.used, heap_size, heap_peak);
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 16, 210, "  Heaps stats : %s", heaps_buf);
 
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 140, "Dropped   : %ld steps", sim.dropped_steps);
+	ports_stats_t ports = ports_stats();
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 90, "Switch    : %ldus", TICKS_TO_US(level_switch_ticks));
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 100, "CRT       : %ld/%ld", crt_redraws, crt_shown);
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 110, "CRT loads : %dx%dB", CRT_PIECES, CRT_BYTES / CRT_PIECES);
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 120, "Ports     : %ld/%ld %ldms", ports.probes, ports.switches, TICKS_TO_MS(ports.last_ticks));
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 130, "Latency   : %ldms <%ldms", TICKS_TO_MS(latency_last_ticks), TICKS_TO_MS(latency_max_ticks));
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 150, "State     : %d", global_state.game_state);
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 160, "Level     : %d", global_state.current_level);
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 170, "Ignored   : %d/%d", restored_attackers_ignored, restored_overheat_ignored);
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 180, "Port      : %d", current_joypad);
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 190, "Reset held: %ldms", held_ms);
 	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 200, "FPS   : %.2f", display_get_fps());
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, 200, 210, "Decay : %d/%ldms", restored_decay.decay, restored_decay.off_ms);
+	perf_draw(16, 16);
 #endif
 
 	switch (global_state.game_state) {
@@ -635,7 +830,7 @@ void render_2d() {
 			if (current_joypad != 0) {
 				rdpq_text_printf(&descparms, FONT_BUILTIN_DEBUG_MONO, 20, 110, "Please make sure to plug a single controller to the first port");
 			}
-			if (global_state.games_count > 0) {
+			if (global_counters.games_count > 0 || profile.games_played > 0) {
 				rdpq_text_printf(&descparms, FONT_BUILTIN_DEBUG_MONO, 20, 150, "Press Z to practice");
 			}
 			break;
@@ -666,9 +861,9 @@ void render_2d() {
 					// Draw queue
 					for (int j=0; j<attacker->level; j++) {
 						int btn_x = x + (j * 32 * s);
-						queue_button_t btn = get_attacker_button(i, j);
+						queue_button_t btn = get_attacker_button(attacker, j);
 						if (i == current_joypad && j == 0) {
-							drawprogress(btn_x - (8*s), y - (8*s), s, holding/BUTTON_HOLD_THRESHOLD, RGBA32(255, 0, 0, 255), spr_progress, spr_circlemask);
+							drawprogress(btn_x - (8*s), y - (8*s), s, sim_interpolated_holding(&sim)/BUTTON_HOLD_THRESHOLD, RGBA32(255, 0, 0, 255), spr_progress, spr_circlemask);
 						}
 						sprite_t* spr = NULL;
 						switch (btn) {
@@ -736,7 +931,7 @@ void render_2d() {
 				bool overheating = attacker->spawned && attacker->level == QUEUE_LENGTH;
 				draw_gauge(x + 26, 225, 6, 5, 0, 1, overheat->overheat_level, 3,
 					overheat->overheat_level > 0 ? RGBA32(0xff, 0xc0 - 0x60 * (overheat->overheat_level - 1), 0, 0xff) : RGBA32(0, 0, 0, 0xff),
-					overheating ? RGBA32((int) fabs((fmodf((overheat->last_overheat - global_state.level_timer) * (overheat->overheat_level + 1), 2.0f) - 1) * 0xff), 0, 0, 0xff) : RGBA32(0, 0, 0, 0xc0)
+					overheating ? RGBA32((int) fabs((fmodf((overheat->last_overheat - sim_interpolated_timer(&sim)) * (overheat->overheat_level + 1), 2.0f) - 1) * 0xff), 0, 0, 0xff) : RGBA32(0, 0, 0, 0xc0)
 				);
 				if (level->max_resets_per_console > 0) {
 					rdpq_mode_begin();
@@ -763,8 +958,11 @@ void render_2d() {
 			rdpq_sync_pipe();
 			if (global_state.practice) {
 				rdpq_text_printf(&textparms, FONT_HALODEK, 0, 30, "PRACTICE");
+				if (restored_decay.decay == DECAY_PARTIAL) {
+					rdpq_text_printf(&textparms, FONT_BUILTIN_DEBUG_MONO, 0, 45, "Powered off for about %.1fs", restored_decay.off_ms / 1000.0f);
+				}
 			} else {
-        		rdpq_text_printf(&textparms, FONT_HALODEK, 0, 30, "%d", (int) ceilf(global_state.level_timer));
+        		rdpq_text_printf(&textparms, FONT_HALODEK, 0, 30, "%d", (int) ceilf(sim_interpolated_timer(&sim)));
 			}
 			break;
 		}
@@ -843,17 +1041,31 @@ int main(void) {
 
 	//rdpq_debug_start();
 
-    // Initialize the random number generator, then call rand() every
-    // frame so to get random behavior also in emulators.
-    uint32_t seed;
-    getentropy(&seed, sizeof(seed));
-    srand(seed);
-    register_VI_handler((void(*)(void))rand);
+	// Independent streams for gameplay, replica placement and particles, so that a run can be
+	// reproduced from its seed. The gameplay stream is replaced by the restored one, if any.
+	uint32_t seed;
+	getentropy(&seed, sizeof(seed));
+#ifdef INPUT_REPLAY
+	// Recordings start from an initial boot, with the seed they were recorded with
+	replaying = replay_open(INPUT_REPLAY_PATH, &seed);
+#endif
+	rng_seed_stream(&global_state.rng, seed, RNG_STREAM_GAMEPLAY);
+	rng_seed_stream(&replica_rng, seed, RNG_STREAM_REPLICAS);
+	rng_seed_stream(&vfx_rng, seed, RNG_STREAM_VFX);
+	debugf_uart("Seed: %08lx\n", seed);
+
+	sim = (sim_t) {
+		.global = &global_state,
+		.clock = &level_clock,
+		.attackers = console_attackers,
+		.overheat = console_overheat,
+		.notify = on_sim_event
+	};
 
 	debugf_uart("Seed OK\n");
 
 	// Skip restoration / force cold boot behaviour by holding R+A during startup
-	bool forceColdBoot;
+	bool forceColdBoot = false;
 	joypad_poll();
 	JOYPAD_PORT_FOREACH(port) {
 		joypad_buttons_t held = joypad_get_buttons_held(port);
@@ -863,6 +1075,12 @@ int main(void) {
 		}
 	}
 
+#ifdef INPUT_REPLAY
+	if (replaying) {
+		forceColdBoot = true;
+	}
+#endif
+
 	debugf_uart("Joypad poll OK\n");
 
 	bool useExpansionPak;
@@ -872,6 +1090,9 @@ int main(void) {
 	debugf_uart("Expansion Pak: %d\n", useExpansionPak);
 	init_heaps(useExpansionPak);
 
+	save_init(&eeprom_backend);
+	init_profile();
+
 
 	// Try to restore game data after a warm or cold boot
 
@@ -881,13 +1102,27 @@ int main(void) {
 		debugf_uart("Restoration done\n");
 	}
 
+#ifdef INPUT_RECORD
+	// A restored game carries on with the current recording
+	debug_init_sdfs("sd:/", -1);
+	replay_record_open(INPUT_RECORD_PATH, seed, restored_something);
+#endif
+
 
 	// Clear all replicas to avoid bad data in next restoration
 
 	debugf_uart("Clearing heaps\n");
 	clear_heaps();
+	init_event_log();
 	debugf_uart("Heaps cleared\n");
 
+#ifdef DEBUG_MODE
+	check_schemas();
+#endif
+#ifdef PERSISTENCE_BENCHMARK
+	benchmark_write_policies();
+#endif
+
 
 	// If initializing game from scratch, display logos
 
@@ -915,6 +1150,17 @@ int main(void) {
 	wav64_open(&sfx_gameover, "rom://gameover.wav64");
 
 	console_model = t3d_model_load("rom:/crt.t3dm");
+	crt_placeholder = surface_make_placeholder_linear(CRT_LOOKUP_SLOT, CRT_FORMAT, OFFSCREEN_SIZE, OFFSCREEN_SIZE);
+	// CRT render targets for the largest level, and the shared depth buffer
+	pool_reserve(FMT_RGBA16, OFFSCREEN_SIZE, OFFSCREEN_SIZE, MAX_CONSOLES + 1);
+	if (CRT_FORMAT != FMT_RGBA16) {
+		pool_reserve(CRT_FORMAT, OFFSCREEN_SIZE, OFFSCREEN_SIZE, 2 * MAX_CONSOLES);
+	}
+	crt_z = pool_acquire(FMT_RGBA16, OFFSCREEN_SIZE, OFFSCREEN_SIZE);
+	crt_sampled = rspq_syncpoint_new();
+	int depth_bytes = crt_z->stride * OFFSCREEN_SIZE;
+	debugf_uart("Surface pool: %d bytes (%d saved at %d consoles by sharing the depth buffer)\n", pool_bytes(), (MAX_CONSOLES - 1) * depth_bytes, MAX_CONSOLES);
+	arena_init(LEVEL_ARENA_SIZE);
 	n64_model = t3d_model_load("rom:/console.t3dm");
 	
 	bg_pattern = sprite_load("rom:/pattern.i8.sprite");
@@ -972,7 +1218,10 @@ int main(void) {
 		
 		// Check validity of restored data: game over if broken level
 		if (validate_recovered()) {
-    		global_state = restored_global_state;
+			// Restored data was written straight into the live game state
+			if (global_state.rng.state == 0) {
+				rng_seed_stream(&global_state.rng, seed, RNG_STREAM_GAMEPLAY);
+			}
 			replicate_global_state();
 
 			debugf_uart("game_state: %d\n", global_state.game_state);
@@ -981,45 +1230,50 @@ int main(void) {
 			if (global_state.game_state == IN_GAME) {
 				// Restored at least once console: keep playing
 				consoles_count = restored_consoles_count;
-				for (int i=0; i<restored_consoles_count; i++) {
-					uint32_t id = restored_consoles[i].id;
+				for (int id=0; id<MAX_CONSOLES; id++) {
+					if (!(restored_consoles_mask & (1 << id))) {
+						continue;
+					}
 					console_t* console = &consoles[id];
-					*console = restored_consoles[i];
 					debugf_uart("restored: %d\n", console->id);
-					console->displayable = &console_displayables[i];
+					console->displayable = &console_displayables[id];
 					// Recreate replicas (alternative would be to keep replicas as-is)
 					replicate_console(console);
 				}
 				debugf_uart("Consoles restored\n");
 
-				for (int i=0; i<restored_overheat_count; i++) {
-					uint32_t id = restored_overheat[i].id;
-					if (restored_overheat_counts[id] < restored_overheat[i].min_replicas) {
-						debugf_uart("overheat #%d restored with not enough replicas (%d<%d): NOT RESTORING\n", id, restored_overheat_counts[id], restored_overheat[i].min_replicas);
-						restored_overheat_ignored++;
+				for (int id=0; id<MAX_CONSOLES; id++) {
+					if (!(restored_overheat_mask & (1 << id))) {
 						continue;
 					}
 					overheat_t* overheat = &console_overheat[id];
-					*overheat = restored_overheat[i];
+					if (restored_overheat_counts[id] < overheat->min_replicas) {
+						debugf_uart("overheat #%d restored with not enough replicas (%d<%d): NOT RESTORING\n", id, restored_overheat_counts[id], overheat->min_replicas);
+						restored_overheat_ignored++;
+						memset(overheat, 0, sizeof(overheat_t));
+						continue;
+					}
 					debugf_uart("restored overheat: %d\n", overheat->id);
 					replicate_overheat(overheat);
 				}
 
-				for (int i=0; i<restored_attackers_count; i++) {
-					uint32_t id = restored_attackers[i].id;
-					if (restored_attackers_counts[id] < restored_attackers[i].min_replicas) {
-						debugf_uart("attacker #%d restored with not enough replicas (%d<%d): NOT RESTORING\n", id, restored_attackers_counts[id], restored_attackers[i].min_replicas);
-						restored_attackers_ignored++;
+				for (int id=0; id<MAX_CONSOLES; id++) {
+					if (!(restored_attackers_mask & (1 << id))) {
 						continue;
 					}
 					attacker_t* attacker = &console_attackers[id];
-					*attacker = restored_attackers[i];
+					if (restored_attackers_counts[id] < attacker->min_replicas) {
+						debugf_uart("attacker #%d restored with not enough replicas (%d<%d): NOT RESTORING\n", id, restored_attackers_counts[id], attacker->min_replicas);
+						restored_attackers_ignored++;
+						memset(attacker, 0, sizeof(attacker_t));
+						continue;
+					}
 					debugf_uart("restored attacker: %d\n", attacker->id);
 					if (attacker->spawned) {
 						replicate_attacker(attacker);
 						// Make sure overheat timer makes sense if it was not restored along with attacker
 						if (console_overheat[attacker->id].last_overheat == 0) {
-							reset_overheat_timer(attacker->id);
+							sim_reset_overheat_timer(&sim, attacker->id);
 						}
 					} else {
 						debugf_uart("restored unspawned attacker --> not replicating\n");
@@ -1032,81 +1286,24 @@ int main(void) {
 				}
 				
 				debugf_uart("Consoles setup OK\n");
+			} else {
+				discard_recovered_level();
 			}
 
 			if (rst == RESET_COLD) {
 				debugf_uart("Cold\n");
 				inc_power_cycle_count();
-				if (global_state.game_state == IN_GAME && !global_state.practice) {
-					inc_level_power_cycle_count();
-					// TODO Handle too many power cycles in level --> game over
-					if (global_state.level_power_cycle_count > levels[global_state.current_level].max_power_cycles) {
-						debugf_uart("Too many power cycles in level %d: %d > %d\n", global_state.current_level, global_state.level_power_cycle_count, levels[global_state.current_level].max_power_cycles);
-						// TODO Game Over --> display reason?
-						clear_level();
-						wav64_play(&sfx_gameover, SFX_CHANNEL);
-						play_menu_music();
-						set_game_state(GAME_OVER);
-						set_game_over(TOO_MANY_POWER_CYCLES);
-					}
-				}
+				sim_power_cycle(&sim);
+#ifdef INPUT_RECORD
+				replay_record(&(replay_record_t) { .kind = REPLAY_POWER_CYCLE });
+#endif
 			} else {
 				debugf_uart("Warm\n");
 				inc_reset_count();
-				if (global_state.game_state == IN_GAME) {
-					bool gameover = false;
-					if (!global_state.practice) {
-						inc_level_reset_count_per_console(reset_console);
-						if (reset_console != -1 && global_state.level_reset_count_per_console[reset_console] > levels[global_state.current_level].max_resets_per_console) {
-							debugf_uart("Too many resets for console %d in level %d: %d > %d\n", reset_console, global_state.current_level, global_state.level_reset_count_per_console[reset_console], levels[global_state.current_level].max_resets_per_console);
-							clear_level();
-							wav64_play(&sfx_gameover, SFX_CHANNEL);
-							play_menu_music();
-							set_game_state(GAME_OVER);
-							set_game_over(TOO_MANY_RESETS);
-							gameover = true;
-						}
-					}
-					if (!gameover) {
-						for (int i=0; i<consoles_count; i++) {
-							overheat_t* overheat = &console_overheat[i];
-							if (i == reset_console) {
-								// Decrease overheat level of console depending on held_ms
-								if (overheat->overheat_level > 0) {
-									debugf_uart("DECREASE overheat of RESET CONSOLE: %d\n", i);
-									decrease_overheat(i);
-									if (levels[global_state.current_level].allow_long_reset && held_ms >= LONG_RESET_THRESHOLD) {
-										debugf_uart("DECREASE AGAIN overheat of RESET CONSOLE: %d held=%d\n", i, held_ms);
-										decrease_overheat(i);
-									}
-								}
-							} else {
-								// For long presses of the reset button, apply attacks/overheat to the other consoles
-								if (levels[global_state.current_level].allow_long_reset && held_ms > LONG_RESET_GRACE_PERIOD) {
-									float replay_ms = held_ms - LONG_RESET_GRACE_PERIOD;
-									attacker_t* attacker = &console_attackers[i];
-									bool overheating = attacker->spawned && attacker->level == QUEUE_LENGTH;
-									if (overheating) {
-										debugf_uart("REPLAY OVERHEAT on console #%d: add %f s to overheat->last_overheat=%f\n", i, replay_ms / 1000.0f, overheat->last_overheat);
-										overheat->last_overheat += replay_ms / 1000.0f;
-									} else {
-										// Lower attack rate
-										float factor = 0.5f;
-										int attacks = (replay_ms / 1000.0f) * levels[global_state.current_level].attack_rate * factor;
-										debugf_uart("REPLAY ATTACKS on console #%d: %f ms -> %d attacks\n", i, replay_ms, attacks);
-										for (int j=0; j<attacks; j++) {
-											if (!attacker->spawned) {
-												spawn_attacker(i);
-											} else {
-												grow_attacker(i);
-											}
-										}
-									}
-								}
-							}
-						}
-					}
-				}
+				sim_reset(&sim, reset_console, held_ms, &global_state.rng);
+#ifdef INPUT_RECORD
+				replay_record(&(replay_record_t) { .kind = REPLAY_RESET, .console = reset_console, .held_ms = held_ms });
+#endif
 			}
 
 			reset_console = -1;
@@ -1115,15 +1312,16 @@ int main(void) {
 		} else {
 			debugf_uart("partial restoration: game over\n");
 			// TODO Game Over --> display reason?
-			clear_level();
-			wav64_play(&sfx_gameover, SFX_CHANNEL);
-			play_menu_music();
+			discard_recovered_level();
+			memset(&global_state, 0, sizeof(global_state_t));
+			memset(&global_counters, 0, sizeof(counters_t));
+			memset(&level_clock, 0, sizeof(level_clock_t));
+			rng_seed_stream(&global_state.rng, seed, RNG_STREAM_GAMEPLAY);
 			// Initial setup
 			consoles_count = 0;
 			reset_console = -1;
 			init_global_state();
-			set_game_state(GAME_OVER);
-			set_game_over(PARTIAL_RESTORATION);
+			sim_game_over(&sim, PARTIAL_RESTORATION);
 		}
 	}
 
@@ -1148,9 +1346,21 @@ int main(void) {
 	debugf_uart("NMI handler register OK\n");
 
 
+	// Sample the joypad between frames
+
+	ports_init();
+	samples_ticks = TICKS_READ();
+	new_timer(TICKS_FROM_US(1000000 / JOYPAD_SAMPLE_HZ), TF_CONTINUOUS, sample_joypad);
+
+	debugf_uart("Joypad sampling and port probing OK\n");
+
+
 	// Start gameplay
 
 	debugf_uart("Entering main loop\n");
+#ifdef INPUT_REPLAY
+	replay_start = TICKS_READ();
+#endif
 
 
 	// Main loop
@@ -1160,51 +1370,78 @@ int main(void) {
 		frametime = display_get_delta_time();
 		gtime += frametime;
 
+#ifdef DEBUG_MODE
+		perf_frame();
+#endif
+
+		PERF_BEGIN(PERF_MIXER);
 		mixer_try_play();
+		PERF_END(PERF_MIXER);
 
-		// Identify the current joypad port and make sure only one is plugged
-		int ports = 0;
-		JOYPAD_PORT_FOREACH(port) {
-			if (joypad_is_connected(port)) {
-				ports++;
-			}
-		}
-		wrong_joypads_count = ports > 1;
-		current_joypad = -1;
-		if (!wrong_joypads_count) {
-			JOYPAD_PORT_FOREACH(port) {
-				if (current_joypad == -1 && joypad_is_connected(port)) {
-					current_joypad = port;
-				}
-			}
-		}
-		joypad_poll();
+		PERF_BEGIN(PERF_INPUT);
+		poll_joypad();
+		PERF_END(PERF_INPUT);
 
 #ifdef DEBUG_MODE
-		if (current_joypad != -1) {
-			joypad_buttons_t pressed = joypad_get_buttons_pressed(current_joypad);
-			if (pressed.c_right) {
-				paused = !paused;
-			}
+		if (joypad_input.pressed & SIM_BUTTON_C_RIGHT) {
+			paused = !paused;
+		}
+		// Input to display latency: from the press sample to the end of the RDP work of its frame
+		if (latency_pending != 0 && rspq_syncpoint_check(latency_sync)) {
+			latency_last_ticks = TICKS_DISTANCE(latency_pending, TICKS_READ());
+			latency_max_ticks = MAX(latency_max_ticks, latency_last_ticks);
+			latency_pending = 0;
 		}
 #endif
 
 		// Game loop
 
 		if (!paused && !in_reset) {
+			PERF_BEGIN(PERF_UPDATE);
 			update();
+			PERF_END(PERF_UPDATE);
+			PERF_BEGIN(PERF_PERSISTENCE);
+			flush_dirty();
 			dump_game_state();
+			PERF_END(PERF_PERSISTENCE);
 		}
+		// Also while reset is held: flushed records are written before the console resets
+		PERF_BEGIN(PERF_SAVE);
+		save_step(SAVE_STEP_BUDGET);
+		PERF_END(PERF_SAVE);
 
 
 		// Render
 
+		PERF_BEGIN(PERF_OFFSCREEN);
 		render_offscreen();
-
-		rdpq_attach(display_get(), display_get_zbuf());
+		PERF_END(PERF_OFFSCREEN);
+
+		PERF_BEGIN(PERF_WAIT);
+		surface_t* fb = display_get();
+		PERF_END(PERF_WAIT);
+		rdpq_attach(fb, display_get_zbuf());
+		PERF_BEGIN(PERF_RENDER_3D);
+		PERF_RDP_BEGIN(PERF_RDP_3D);
 		render_3d();
+		PERF_RDP_END(PERF_RDP_3D);
+		PERF_END(PERF_RENDER_3D);
+		PERF_BEGIN(PERF_RENDER_2D);
+		PERF_RDP_BEGIN(PERF_RDP_2D);
 		render_2d();
+		PERF_RDP_END(PERF_RDP_2D);
+		PERF_END(PERF_RENDER_2D);
+		PERF_BEGIN(PERF_WAIT);
 		rdpq_detach_show();
+		PERF_END(PERF_WAIT);
+		crt_sampled = rspq_syncpoint_new();
+#ifdef DEBUG_MODE
+		if (latency_press != 0 && latency_pending == 0) {
+			latency_sync = rspq_syncpoint_new();
+			latency_pending = latency_press;
+			latency_press = 0;
+		}
+#endif
 	}
 	
 	debugf_uart("Out of main loop\n");
@@ -104,4 +104,13 @@ void debugf_uart(char* format, ...) {
 	pc64_uart_write((const uint8_t *)write_buf, strlen(write_buf));
 	debugf(write_buf);
 #endif
-}
\ No newline at end of file
+}
+
+// Raw bytes (e.g. binary packets between text logs)
+void uart_write(const void* data, uint32_t len) {
+#ifdef DEBUG_MODE
+	len = len < sizeof(write_buf) ? len : sizeof(write_buf);
+	memcpy(write_buf, data, len);
+	pc64_uart_write((const uint8_t *)write_buf, len);
+#endif
+}
@@ -1,3 +1,6 @@
 #pragma once
 
+#include <stdint.h>
+
 void debugf_uart(char* format, ...);
+void uart_write(const void* data, uint32_t len);
@@ -0,0 +1,213 @@
+#include <string.h>
+#include <libdragon.h>
+#include "perf.h"
+#include "pc64.h"
+
+#ifdef DEBUG_MODE
+
+#define PERF_US_PER_PIXEL (100)		// 16.7ms frame: 167 pixels
+#define PERF_ROW_HEIGHT (8)
+
+// DP command registers: counters are 24 bits, reset by writing the status register
+#define PERF_DP_REGS ((volatile uint32_t*) 0xA4100000)
+#define PERF_DP_STATUS (3)
+#define PERF_DP_CLOCK (4)
+#define PERF_DP_BUSY (5)
+#define PERF_DP_PIPE (6)
+#define PERF_DP_TMEM (7)
+#define PERF_DP_CLEAR_COUNTERS (0x40 | 0x80 | 0x100 | 0x200)	// TMEM, pipe, command buffer, clock
+
+static const char* zone_names[PERF_ZONES] = { "mix", "inp", "upd", "per", "sav", "off", "3d", "2d", "wt" };
+
+static uint32_t starts[PERF_ZONES];
+static uint32_t current[PERF_ZONES];			// Accumulated during the frame
+static uint32_t history[PERF_WINDOW][PERF_ZONES];
+static uint32_t frame_history[PERF_WINDOW];
+static perf_dp_t dp_history[PERF_WINDOW];
+static bool rdp_bound_history[PERF_WINDOW];
+static uint32_t frames;
+static uint32_t frame_start;
+#ifdef PERF_RDP
+static perf_dp_t phases[PERF_RDP_PHASES];		// Accumulated during the frame
+static uint32_t phase_history[PERF_WINDOW][PERF_RDP_PHASES];
+#endif
+
+
+void perf_begin(perf_zone_t zone) {
+	starts[zone] = TICKS_READ();
+}
+
+void perf_end(perf_zone_t zone) {
+	current[zone] += TICKS_DISTANCE(starts[zone], TICKS_READ());
+}
+
+static perf_dp_t read_dp() {
+	return (perf_dp_t) {
+		.clock = PERF_DP_REGS[PERF_DP_CLOCK] & 0xffffff,
+		.busy = PERF_DP_REGS[PERF_DP_BUSY] & 0xffffff,
+		.pipe = PERF_DP_REGS[PERF_DP_PIPE] & 0xffffff,
+		.tmem = PERF_DP_REGS[PERF_DP_TMEM] & 0xffffff
+	};
+}
+
+static void clear_dp() {
+	PERF_DP_REGS[PERF_DP_STATUS] = PERF_DP_CLEAR_COUNTERS;
+}
+
+static uint32_t rdp_to_ticks(uint32_t cycles) {
+	return (uint64_t) cycles * TICKS_PER_SECOND / PERF_RDP_HZ;
+}
+
+#ifdef PERF_RDP
+// The RDP is drained before and after the phase, so that the counters only cover its commands
+void perf_rdp_begin(perf_rdp_phase_t phase) {
+	rspq_wait();
+	clear_dp();
+}
+
+void perf_rdp_end(perf_rdp_phase_t phase) {
+	rspq_wait();
+	perf_dp_t dp = read_dp();
+	phases[phase].clock += dp.clock;
+	phases[phase].busy += dp.busy;
+	phases[phase].pipe += dp.pipe;
+	phases[phase].tmem += dp.tmem;
+}
+#endif
+
+#ifdef PERF_UART
+static uint8_t* put_u16(uint8_t* p, uint32_t v) {
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+static uint8_t* put_u32(uint8_t* p, uint32_t v) {
+	return put_u16(put_u16(p, v & 0xffff), v >> 16);
+}
+
+static uint16_t us16(uint32_t ticks) {
+	uint32_t us = TICKS_TO_US(ticks);
+	return us > 0xffff ? 0xffff : us;
+}
+#endif
+
+// Called once per frame, at the top of the main loop: closes the previous frame
+void perf_frame() {
+	uint32_t now = TICKS_READ();
+	uint32_t frame_ticks = frames > 0 ? TICKS_DISTANCE(frame_start, now) : 0;
+	frame_start = now;
+#ifdef PERF_RDP
+	// Counters are cleared at every phase: the frame is the sum of its phases
+	perf_dp_t dp = { 0 };
+	for (int i=0; i<PERF_RDP_PHASES; i++) {
+		dp.clock += phases[i].clock;
+		dp.busy += phases[i].busy;
+		dp.pipe += phases[i].pipe;
+		dp.tmem += phases[i].tmem;
+	}
+#else
+	// Whatever the RDP did since the previous frame started
+	perf_dp_t dp = read_dp();
+	clear_dp();
+#endif
+	int slot = frames % PERF_WINDOW;
+	memcpy(history[slot], current, sizeof(current));
+	frame_history[slot] = frame_ticks;
+	dp_history[slot] = dp;
+	// The CPU was busy for the frame minus its waits, the RDP for its busy cycles
+	rdp_bound_history[slot] = rdp_to_ticks(dp.busy) > frame_ticks - current[PERF_WAIT];
+#ifdef PERF_RDP
+	for (int i=0; i<PERF_RDP_PHASES; i++) {
+		phase_history[slot][i] = rdp_to_ticks(phases[i].busy);
+	}
+	memset(phases, 0, sizeof(phases));
+#endif
+#ifdef PERF_UART
+	uint8_t packet[PERF_PACKET_SIZE];
+	uint8_t* p = put_u32(put_u32(packet, PERF_MAGIC), frames);
+	p = put_u16(p, us16(frame_ticks));
+	for (int i=0; i<PERF_ZONES; i++) {
+		p = put_u16(p, us16(current[i]));
+	}
+	p = put_u32(put_u32(put_u32(put_u32(p, dp.clock), dp.busy), dp.pipe), dp.tmem);
+	for (int i=0; i<PERF_RDP_PHASES; i++) {
+#ifdef PERF_RDP
+		p = put_u16(p, us16(phase_history[slot][i]));
+#else
+		p = put_u16(p, 0);
+#endif
+	}
+	uart_write(packet, sizeof(packet));
+#endif
+	memset(current, 0, sizeof(current));
+	frames++;
+}
+
+// One row per zone: min to max as a dim bar, average as a bright one, with the frame budget marked
+void perf_draw(int x, int y) {
+	int count = frames < PERF_WINDOW ? frames : PERF_WINDOW;
+	if (count == 0) {
+		return;
+	}
+	int bar_x = x + 24;
+	rdpq_set_mode_standard();
+	rdpq_mode_blender(RDPQ_BLENDER_MULTIPLY);
+	rdpq_mode_combiner(RDPQ_COMBINER_FLAT);
+	rdpq_set_prim_color(RGBA32(0, 0, 0, 0x80));
+	rdpq_fill_rectangle(x, y, bar_x + 1000000 / 60 / PERF_US_PER_PIXEL + 2, y + PERF_ZONES * PERF_ROW_HEIGHT);
+	for (int zone=0; zone<PERF_ZONES; zone++) {
+		uint32_t min = UINT32_MAX, max = 0, sum = 0;
+		for (int i=0; i<count; i++) {
+			uint32_t ticks = history[i][zone];
+			min = MIN(min, ticks);
+			max = MAX(max, ticks);
+			sum += ticks;
+		}
+		int row = y + zone * PERF_ROW_HEIGHT;
+		rdpq_set_prim_color(RGBA32(0x40, 0x80, 0x40, 0xff));
+		rdpq_fill_rectangle(bar_x + TICKS_TO_US(min) / PERF_US_PER_PIXEL, row + 2, bar_x + TICKS_TO_US(max) / PERF_US_PER_PIXEL + 1, row + PERF_ROW_HEIGHT - 2);
+		rdpq_set_prim_color(RGBA32(0x40, 0xff, 0x40, 0xff));
+		rdpq_fill_rectangle(bar_x, row + 3, bar_x + TICKS_TO_US(sum / count) / PERF_US_PER_PIXEL + 1, row + PERF_ROW_HEIGHT - 3);
+	}
+	rdpq_set_prim_color(RGBA32(0xff, 0x40, 0x40, 0xff));
+	rdpq_fill_rectangle(bar_x + 1000000 / 60 / PERF_US_PER_PIXEL, y, bar_x + 1000000 / 60 / PERF_US_PER_PIXEL + 1, y + PERF_ZONES * PERF_ROW_HEIGHT);
+
+	rdpq_sync_pipe();
+	for (int zone=0; zone<PERF_ZONES; zone++) {
+		rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, x, y + zone * PERF_ROW_HEIGHT + 7, "%s", zone_names[zone]);
+	}
+	uint32_t frame_max = 0;
+	uint64_t clock = 0, busy = 0, pipe = 0, tmem = 0;
+	int rdp_bound = 0;
+	for (int i=0; i<count; i++) {
+		frame_max = MAX(frame_max, frame_history[i]);
+		clock += dp_history[i].clock;
+		busy += dp_history[i].busy;
+		pipe += dp_history[i].pipe;
+		tmem += dp_history[i].tmem;
+		rdp_bound += rdp_bound_history[i];
+	}
+	if (clock == 0) {
+		clock = 1;
+	}
+	y += PERF_ZONES * PERF_ROW_HEIGHT + 9;
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, x, y, "frame <%ldus, RDP bound %d/%d", TICKS_TO_US(frame_max), rdp_bound, count);
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, x, y + 10, "rdp %d%% pipe %d%% tmem %d%%",
+		(int) (busy * 100 / clock), (int) (pipe * 100 / clock), (int) (tmem * 100 / clock));
+#ifdef PERF_RDP
+	uint32_t avg[PERF_RDP_PHASES] = { 0 };
+	for (int i=0; i<count; i++) {
+		for (int phase=0; phase<PERF_RDP_PHASES; phase++) {
+			avg[phase] += phase_history[i][phase];
+		}
+	}
+	for (int phase=0; phase<PERF_RDP_PHASES; phase++) {
+		avg[phase] = TICKS_TO_US(avg[phase] / count);
+	}
+	rdpq_text_printf(NULL, FONT_BUILTIN_DEBUG_MONO, x, y + 20, "off %ld/%ld/%ld/%ld 3d %ld 2d %ld us",
+		avg[PERF_RDP_OFFSCREEN], avg[PERF_RDP_OFFSCREEN+1], avg[PERF_RDP_OFFSCREEN+2], avg[PERF_RDP_OFFSCREEN+3], avg[PERF_RDP_3D], avg[PERF_RDP_2D]);
+#endif
+}
+
+#endif
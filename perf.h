@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+// Frame profiler (DEBUG_MODE): CPU time spent in each stage of the main loop, read from the CP0
+// count register, and RDP activity from the DP counters. The overlay shows rolling min/avg/max per
+// stage and whether frames are CPU or RDP bound; with PERF_UART, every frame is also sent as a
+// small binary packet on the debug UART (see tools/perfdump.c).
+
+typedef enum {
+	PERF_MIXER = 0,
+	PERF_INPUT,
+	PERF_UPDATE,
+	PERF_PERSISTENCE,	// Replicas flush and game state dump
+	PERF_SAVE,			// Cartridge save commits
+	PERF_OFFSCREEN,
+	PERF_RENDER_3D,
+	PERF_RENDER_2D,
+	PERF_WAIT,			// Blocked on the RSP/RDP (free framebuffer, show, syncpoints)
+	PERF_ZONES
+} perf_zone_t;
+
+// RDP phases: the DP counters of each phase can only be told apart by waiting for the RDP at
+// every boundary, so they are only measured with PERF_RDP (which changes the frame timing)
+typedef enum {
+	PERF_RDP_OFFSCREEN = 0,		// One per console
+	PERF_RDP_3D = PERF_RDP_OFFSCREEN + 4,
+	PERF_RDP_2D,
+	PERF_RDP_PHASES
+} perf_rdp_phase_t;
+
+// DP counters, in RDP cycles (62.5MHz)
+typedef struct {
+	uint32_t clock;
+	uint32_t busy;		// Command buffer busy
+	uint32_t pipe;		// Pipeline busy
+	uint32_t tmem;		// TMEM loads
+} perf_dp_t;
+
+#define PERF_WINDOW (64)			// Frames in the rolling stats
+#define PERF_MAGIC (0x32465250)		// "PRF2"
+#define PERF_RDP_HZ (62500000)
+
+// Packet (little-endian): magic, frame number, the frame duration and each zone in microseconds
+// (u16, saturated), the frame's DP counters (u32), then the busy time of each RDP phase in
+// microseconds (u16, zero without PERF_RDP)
+#define PERF_PACKET_SIZE (4 + 4 + 2 * (1 + PERF_ZONES) + 4 * 4 + 2 * PERF_RDP_PHASES)
+
+#ifdef DEBUG_MODE
+void perf_begin(perf_zone_t zone);
+void perf_end(perf_zone_t zone);
+void perf_frame();
+void perf_draw(int x, int y);
+#define PERF_BEGIN(zone) perf_begin(zone)
+#define PERF_END(zone) perf_end(zone)
+#else
+#define PERF_BEGIN(zone)
+#define PERF_END(zone)
+#endif
+
+#if defined(DEBUG_MODE) && defined(PERF_RDP)
+void perf_rdp_begin(perf_rdp_phase_t phase);
+void perf_rdp_end(perf_rdp_phase_t phase);
+#define PERF_RDP_BEGIN(phase) perf_rdp_begin(phase)
+#define PERF_RDP_END(phase) perf_rdp_end(phase)
+#else
+#define PERF_RDP_BEGIN(phase)
+#define PERF_RDP_END(phase)
+#endif
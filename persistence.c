@@ -1,9 +1,11 @@
 #include <assert.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libdragon.h>
 #include "persistence.h"
+#include "decay.h"
 #include "pc64.h"
 
 
@@ -11,7 +13,52 @@
 #define CHUNKS_COUNT (((2048-4)*1024)/CHUNK_SIZE)
 #define EXPANSION_CHUNKS_COUNT (((4096-4-64)*1024)/CHUNK_SIZE)
 #define STEP (31)
-#define TOTAL_HEAPS (6)
+
+// Every chunk starts with a small header: the check byte allows rejecting garbage
+// (or stale data from another object type) before paying for a full crc16
+typedef struct {
+	uint32_t id;
+	uint8_t len;	// Payload length
+	uint8_t check;	// Inverted magic byte XOR payload length
+	uint16_t crc;	// crc16 over id and payload
+} chunk_header_t;
+
+#define EVENT_LOG_MAGIC (0x5a5a5a00)
+#define EVENT_LOG_MASK (0xffffff00)
+#define EVENT_LOG_REPLICAS (32)
+#define EVENTS_PER_CHUNK (7)
+#define EVENT_LOG_CHUNKS ((EVENT_LOG_CAPACITY + EVENTS_PER_CHUNK - 1) / EVENTS_PER_CHUNK)	// Last one partly used
+
+// Canaries are spread over each heap (first, middle and last slots) to sample decay
+#define CANARIES_PER_HEAP (3)
+#define CANARY_SLOT(heap, k) ((k) * ((heap)->len - 1) / (CANARIES_PER_HEAP - 1))
+#define DECAY_NONE_THRESHOLD (0.002f)
+#define DECAY_FULL_THRESHOLD (0.35f)
+
+// Dirty objects are written back by flush_dirty(), or by emergency_flush() after the reset NMI
+#define MAX_DIRTY (16)
+#define EMERGENCY_MAGIC (0x454d4552)
+#define EMERGENCY_REPLICAS (8)
+#define EMERGENCY_BUDGET_TICKS (TICKS_FROM_US(2000))
+
+// Replica directory: lists the slots holding each object's replicas, so that restore
+// only reads chunks that were actually allocated. Pages are stored at fixed slots in
+// the two highest retention heaps.
+#define DIRECTORY_MAGIC (0xd1d1d100)
+#define DIRECTORY_MASK (0xffffff00)
+#define DIRECTORY_PAGES (112)
+#define DIRECTORY_COPIES (2)
+#define DIRECTORY_FIRST_SLOT (1)
+#define HANDLES_PER_PAGE (25)
+
+// Replica handle: heap index and slot, plus the address alias used by the object
+#define HANDLE(heap, slot, cached) ((uint16_t) (((cached) << 15) | ((heap) << 10) | (slot)))
+#define HANDLE_HEAP(h) (((h) >> 10) & 0x1f)
+#define HANDLE_SLOT(h) ((h) & 0x3ff)
+#define HANDLE_CACHED(h) ((h) >> 15)
+
+#define HEADER_CHECK(id, len) ((uint8_t) (~((id) >> 24) ^ (len)))
+#define PAYLOAD_MAX_SIZE (CHUNK_SIZE - sizeof(chunk_header_t))
 
 typedef struct {
 	uint8_t (*heap)[CHUNK_SIZE];
@@ -65,6 +112,63 @@ static heap_t heaps[TOTAL_HEAPS] = {
 
 static int last_heap = TOTAL_HEAPS-1;
 
+// Canary patterns: both bit values, alternating bits and alternating bytes
+static const uint32_t canary_pattern[CHUNK_SIZE/sizeof(uint32_t)] = {
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+	0xaaaaaaaa, 0x55555555, 0xaaaaaaaa, 0x55555555,
+	0xff00ff00, 0x00ff00ff, 0xff00ff00, 0x00ff00ff
+};
+
+static write_mode_t write_mode = WRITE_UNCACHED;
+static int verify_period = 16;
+static uint32_t writes_count;
+static uint32_t write_failures;
+
+typedef struct {
+	replicas_t replicas;
+	const void* data;
+	const schema_t* schema;
+	uint16_t* seq;		// Optional snapshot sequence number, stamped when written
+	priority_t priority;
+} dirty_t;
+
+static dirty_t dirty[MAX_DIRTY];
+static volatile int dirty_count;
+
+// The reset NMI can fire while the main loop rewrites the dirty list or a replica: the emergency
+// flush then waits for the end of that write (the console keeps running for a while after the NMI)
+static volatile int busy;
+static volatile bool emergency_running;
+static void (*volatile emergency_deferred)(void);
+
+// Progress of the last emergency flush, kept during reset so that restore can tell
+// whether the version written to the minimal replica set is complete
+typedef struct {
+	uint32_t magic;
+	uint8_t total;
+	uint8_t completed;	// Objects fully written within the budget
+	struct {
+		uint32_t id;
+		uint16_t new_crc;
+		uint16_t old_crc;
+	} entries[MAX_DIRTY];
+} emergency_commit_t;
+
+static volatile emergency_commit_t emergency_commit __attribute__((section(".persistent")));
+
+typedef struct {
+	uint32_t id;		// Object id, 0 when the page is free
+	uint16_t count;
+	uint16_t handles[HANDLES_PER_PAGE];
+} directory_page_t;
+
+static directory_page_t directory[DIRECTORY_PAGES];
+static bool directory_valid;	// Directory read at boot passed validation
+
+static replicas_t event_log[EVENT_LOG_CHUNKS];
+static uint16_t event_seq;
+
 
 static void* alloc_heap(heap_t* heap, int size, bool cached) {
 	assert(size <= CHUNK_SIZE);
@@ -97,12 +201,66 @@ static void clear_heap(heap_t* heap) {
 		heap->allocated[i] = false;
 	}
 	memset(heap->cache, 0, heap->len * CHUNK_SIZE);
+	data_cache_hit_writeback_invalidate(heap->cache, heap->len * CHUNK_SIZE);	// No stale lines left for uncached writes
 	memset(heap->heap, 0, heap->len * CHUNK_SIZE);	// FIXME Needed ?
-	data_cache_hit_writeback(heap->cache, heap->len * CHUNK_SIZE);
-	inst_cache_hit_invalidate(heap->cache, heap->len * CHUNK_SIZE);
 	heap->used = 0;
 }
 
+static void reserve_slot(heap_t* heap, int i) {
+	assert(!heap->allocated[i]);
+	heap->allocated[i] = true;
+	heap->used++;
+}
+
+static uint16_t handle_of(int j, void* ptr) {
+	heap_t* heap = &heaps[j];
+	bool cached = (ptr >= (void*) heap->cache && ptr < (void*) &heap->cache[heap->len]);
+	int i = (uint8_t (*)[CHUNK_SIZE]) ptr - (cached ? heap->cache : heap->heap);
+	assert(i >= 0 && i < heap->len);
+	return HANDLE(j, i, cached);
+}
+
+static void* handle_address(uint16_t handle) {
+	heap_t* heap = &heaps[HANDLE_HEAP(handle)];
+	int i = HANDLE_SLOT(handle);
+	return HANDLE_CACHED(handle) ? (void*) heap->cache[i] : (void*) heap->heap[i];
+}
+
+// Replicas of an object are listed in consecutive directory pages, starting with page replicas-1
+
+static int replicas_count(replicas_t replicas) {
+	int count = 0;
+	uint32_t id = directory[replicas-1].id;
+	for (int p=replicas-1; p<DIRECTORY_PAGES && directory[p].id == id; p++) {
+		count += directory[p].count;
+	}
+	return count;
+}
+
+static void* replica_address(replicas_t replicas, int r) {
+	return handle_address(directory[replicas-1 + r/HANDLES_PER_PAGE].handles[r%HANDLES_PER_PAGE]);
+}
+
+static void write_canaries(heap_t* heap) {
+	for (int k=0; k<CANARIES_PER_HEAP; k++) {
+		int i = CANARY_SLOT(heap, k);
+		reserve_slot(heap, i);
+		memcpy(heap->heap[i], canary_pattern, CHUNK_SIZE);
+	}
+}
+
+// Proportion of canary bits that no longer match the pattern
+static float canaries_decay(heap_t* heap) {
+	int flipped = 0;
+	for (int k=0; k<CANARIES_PER_HEAP; k++) {
+		const uint32_t* canary = (const uint32_t*) heap->heap[CANARY_SLOT(heap, k)];
+		for (int w=0; w<CHUNK_SIZE/sizeof(uint32_t); w++) {
+			flipped += __builtin_popcount(canary[w] ^ canary_pattern[w]);
+		}
+	}
+	return flipped / (float) (CANARIES_PER_HEAP * CHUNK_SIZE * 8);
+}
+
 static const char zeroblock [64];
 static void dump_heap(heap_t* heap) {
 	/*
@@ -120,58 +278,413 @@ static void dump_heap(heap_t* heap) {
 }
 
 
-static uint16_t crc16(const uint8_t * data, size_t len, uint16_t init) {
-    uint8_t x;
-    uint16_t crc = init;
+// Chunk writer: the chunk is assembled once in an aligned buffer, then emitted
+// to each replica with doubleword stores
+
+typedef struct {
+	uint64_t words[CHUNK_SIZE/sizeof(uint64_t)];
+} chunk_t;
+
+static int build_chunk(chunk_t* chunk, const chunk_header_t* header, const void* data, int len) {
+	int words = (sizeof(chunk_header_t) + len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+	chunk->words[words-1] = 0;	// Zero padding after payload
+	memcpy(chunk->words, header, sizeof(chunk_header_t));
+	memcpy((uint8_t*) chunk->words + sizeof(chunk_header_t), data, len);
+	return words;
+}
+
+static void write_chunk(void* ptr, const chunk_t* chunk, int words) {
+	uint64_t* dst = (write_mode == WRITE_UNCACHED) ? UncachedAddr(ptr) : CachedAddr(ptr);
+	for (int i=0; i<words; i++) {
+		dst[i] = chunk->words[i];
+	}
+}
+
+// Sampled read-back through the uncached segment, i.e. what actually is in RDRAM
+static void verify_chunk(void* ptr, const chunk_t* chunk, int words) {
+	if (verify_period == 0 || (writes_count++ % verify_period) != 0) {
+		return;
+	}
+	const uint64_t* src = UncachedAddr(ptr);
+	for (int i=0; i<words; i++) {
+		if (src[i] != chunk->words[i]) {
+			write_failures++;
+			debugf_uart("Write failed @ %p (%ld failures)\n", ptr, write_failures);
+			return;
+		}
+	}
+}
+
+// Cached writes are only written back once all replicas have been stored
+static void writeback_chunk(void* ptr, int words) {
+	if (write_mode == WRITE_CACHED) {
+		data_cache_hit_writeback(CachedAddr(ptr), words * sizeof(uint64_t));
+	}
+}
+
+static void writeback_chunks(replicas_t replicas, int count, int words) {
+	if (write_mode != WRITE_CACHED) {
+		return;
+	}
+	for (int i=0; i<count; i++) {
+		writeback_chunk(replica_address(replicas, i), words);
+	}
+}
+
+static void verify_chunks(replicas_t replicas, int count, const chunk_t* chunk, int words) {
+	for (int i=0; i<count; i++) {
+		verify_chunk(replica_address(replicas, i), chunk, words);
+	}
+}
+
+
+// Dirty objects
+
+static void begin_write() {
+	busy++;
+}
+
+static void end_write() {
+	if (--busy == 0 && emergency_deferred != NULL) {
+		void (*commit)(void) = emergency_deferred;
+		emergency_deferred = NULL;
+		commit();
+	}
+}
+
+static int find_dirty(replicas_t replicas) {
+	for (int i=0; i<dirty_count; i++) {
+		if (dirty[i].replicas == replicas) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void clear_dirty(replicas_t replicas) {
+	int i = find_dirty(replicas);
+	if (i != -1) {
+		dirty[i] = dirty[--dirty_count];
+	}
+}
+
+// Highest priority first
+static int next_dirty(int* order, int count) {
+	int best = -1;
+	for (int i=0; i<dirty_count; i++) {
+		bool taken = false;
+		for (int k=0; k<count; k++) {
+			taken |= (order[k] == i);
+		}
+		if (!taken && (best == -1 || dirty[i].priority > dirty[best].priority)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+void mark_dirty(replicas_t replicas, const void* data, const schema_t* schema, uint16_t* seq, priority_t priority) {
+	assert(replicas != NO_REPLICAS);
+	begin_write();
+	int i = find_dirty(replicas);
+	if (i == -1) {
+		if (dirty_count == MAX_DIRTY) {
+			// Only tolerated from the emergency path: the objects already listed get written
+			assert(emergency_running);
+			end_write();
+			return;
+		}
+		i = dirty_count;
+		dirty[i] = (dirty_t) { .replicas = replicas, .data = data, .schema = schema, .seq = seq, .priority = priority };
+		dirty_count++;
+	} else if (priority > dirty[i].priority) {
+		dirty[i].priority = priority;
+	}
+	end_write();
+}
+
+void flush_dirty() {
+	begin_write();
+	while (dirty_count > 0) {
+		int i = next_dirty(NULL, 0);
+		if (dirty[i].seq != NULL) {
+			*dirty[i].seq = event_log_head();
+		}
+		update_replicas(dirty[i].replicas, dirty[i].data, dirty[i].schema, true);
+	}
+	end_write();
+}
 
-    while ( len-- )
-    {
-        x = crc >> 8 ^ *(data++);
-        x ^= x>>4;
-        crc = (
-            (crc << 8) ^ 
-            ((uint16_t)(x << 12)) ^ 
-            ((uint16_t)(x << 5)) ^ 
-            ((uint16_t)x)
-        );
-    }
+// Called from the reset NMI before marking the last objects: returns false if the main loop is
+// in the middle of a write, in which case commit() is called again as soon as that write completes
+bool emergency_begin(void (*commit)(void)) {
+	if (busy > 0) {
+		emergency_deferred = commit;
+		return false;
+	}
+	emergency_running = true;
+	return true;
+}
 
-    return crc;
+// Emergency flush buffers: not on the interrupt stack
+static int emergency_order[MAX_DIRTY];
+static chunk_t __attribute__((aligned(8))) emergency_chunks[MAX_DIRTY];
+static int emergency_words[MAX_DIRTY];
+
+// Called after emergency_begin(): write dirty objects, highest priority first, to their
+// first few replicas only, and stop when the budget is exhausted. No allocation, no logging.
+void emergency_flush() {
+	uint32_t deadline = TICKS_READ() + EMERGENCY_BUDGET_TICKS;
+	int* order = emergency_order;
+	int count = 0;
+	chunk_t* chunks = emergency_chunks;
+	int* words = emergency_words;
+
+	// Record what is about to be written before writing anything
+	emergency_commit.magic = 0;
+	emergency_commit.completed = 0;
+	while (count < dirty_count) {
+		int i = next_dirty(order, count);
+		dirty_t* entry = &dirty[i];
+		if (entry->seq != NULL) {
+			*entry->seq = event_log_head();
+		}
+		chunk_header_t header = *(chunk_header_t*) UncachedAddr(replica_address(entry->replicas, 0));
+		uint8_t payload[PAYLOAD_MAX_SIZE];
+		int len = schema_pack(entry->schema, entry->data, payload);
+		emergency_commit.entries[count].id = header.id;
+		emergency_commit.entries[count].old_crc = header.crc;
+		header.crc = calculate_crc16(header.id, payload, len);
+		emergency_commit.entries[count].new_crc = header.crc;
+		words[count] = build_chunk(&chunks[count], &header, payload, len);
+		order[count++] = i;
+	}
+	emergency_commit.total = count;
+	emergency_commit.magic = EMERGENCY_MAGIC;
+
+	for (int k=0; k<count; k++) {
+		dirty_t* entry = &dirty[order[k]];
+		// First page of the object holds more than enough replicas
+		int replicas = directory[entry->replicas-1].count < EMERGENCY_REPLICAS ? directory[entry->replicas-1].count : EMERGENCY_REPLICAS;
+		for (int r=0; r<replicas; r++) {
+			if (TICKS_BEFORE(deadline, TICKS_READ())) {
+				emergency_running = false;
+				return;
+			}
+			write_chunk(replica_address(entry->replicas, r), &chunks[k], words[k]);
+		}
+		writeback_chunks(entry->replicas, replicas, words[k]);
+		emergency_commit.completed = k + 1;
+	}
+	emergency_running = false;
 }
 
-static uint16_t calculate_crc16(const uint32_t id, const uint8_t * data, size_t len) {
-	uint16_t crc = crc16((uint8_t*) &id, sizeof(uint32_t), 0xffff);
-	return crc16(data, len, crc);
+// Replica directory
+
+static void write_directory_page(int p) {
+	uint32_t id = DIRECTORY_MAGIC | p;
+	chunk_header_t header = {
+		.id = id,
+		.len = sizeof(directory_page_t),
+		.check = HEADER_CHECK(id, sizeof(directory_page_t)),
+		.crc = calculate_crc16(id, (const uint8_t*) &directory[p], sizeof(directory_page_t))
+	};
+	chunk_t __attribute__((aligned(8))) chunk;
+	int words = build_chunk(&chunk, &header, &directory[p], sizeof(directory_page_t));
+	for (int c=0; c<DIRECTORY_COPIES; c++) {
+		void* ptr = heaps[c].heap[DIRECTORY_FIRST_SLOT + p];
+		write_chunk(ptr, &chunk, words);
+		writeback_chunk(ptr, words);
+	}
+}
+
+static void clear_directory() {
+	for (int c=0; c<DIRECTORY_COPIES; c++) {
+		for (int p=0; p<DIRECTORY_PAGES; p++) {
+			reserve_slot(&heaps[c], DIRECTORY_FIRST_SLOT + p);
+		}
+	}
+	memset(directory, 0, sizeof(directory));
+	for (int p=0; p<DIRECTORY_PAGES; p++) {
+		write_directory_page(p);
+	}
 }
 
+// Pages of an object are allocated contiguously (first fit), returns the first page
+static int directory_add(uint32_t id, const uint16_t* handles, int count) {
+	int pages = (count + HANDLES_PER_PAGE - 1) / HANDLES_PER_PAGE;
+	int first = 0;
+	for (int p=0; p<DIRECTORY_PAGES && (p - first) < pages; p++) {
+		if (directory[p].id != 0) {
+			first = p + 1;
+		}
+	}
+	assert(first + pages <= DIRECTORY_PAGES);	// Fail if directory is full
+	for (int k=0; k<pages; k++) {
+		int p = first + k;
+		int n = (count - k*HANDLES_PER_PAGE) < HANDLES_PER_PAGE ? (count - k*HANDLES_PER_PAGE) : HANDLES_PER_PAGE;
+		directory[p].id = id;
+		directory[p].count = n;
+		memcpy(directory[p].handles, &handles[k*HANDLES_PER_PAGE], n * sizeof(uint16_t));
+		write_directory_page(p);
+	}
+	return first;
+}
+
+static void directory_remove(int first) {
+	uint32_t id = directory[first].id;
+	for (int p=first; p<DIRECTORY_PAGES && directory[p].id == id; p++) {
+		memset(&directory[p], 0, sizeof(directory_page_t));
+		write_directory_page(p);
+	}
+}
+
+// Read the directory written before reset: each page must have at least one valid copy
+static bool read_directory() {
+	for (int p=0; p<DIRECTORY_PAGES; p++) {
+		uint32_t id = DIRECTORY_MAGIC | p;
+		bool found = false;
+		for (int c=0; c<DIRECTORY_COPIES && !found; c++) {
+			const uint8_t* ptr = heaps[c].heap[DIRECTORY_FIRST_SLOT + p];
+			const chunk_header_t* header = (const chunk_header_t*) ptr;
+			const directory_page_t* page = (const directory_page_t*) (ptr + sizeof(chunk_header_t));
+			if (header->id == id && header->len == sizeof(directory_page_t) && header->check == HEADER_CHECK(id, sizeof(directory_page_t))
+				&& header->crc == calculate_crc16(id, (const uint8_t*) page, sizeof(directory_page_t)) && page->count <= HANDLES_PER_PAGE) {
+				directory[p] = *page;
+				found = true;
+			}
+		}
+		if (!found) {
+			debugf_uart("Directory page %d is lost: falling back to full scans\n", p);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Slots to visit when looking for objects matching magic/mask: either the ones listed in
+// the directory, or all of them if the directory could not be read
+static int candidate_slots(uint32_t magic, uint32_t mask, uint16_t** handles) {
+	// Count first, so that both cases allocate exactly the handles they list
+	int count = 0;
+	if (directory_valid) {
+		for (int p=0; p<DIRECTORY_PAGES; p++) {
+			if (directory[p].id != 0 && (directory[p].id & mask) == magic) {
+				count += directory[p].count;
+			}
+		}
+	} else {
+		for (int j=0; j<TOTAL_HEAPS; j++) {
+			count += heaps[j].len;
+		}
+	}
+	// Callers free the list even when there is nothing to visit
+	*handles = NULL;
+	if (count == 0) {
+		return 0;
+	}
+	*handles = malloc(count * sizeof(uint16_t));
+	if (*handles == NULL) {
+		debugf_uart("Out of memory listing %d slots: nothing restored\n", count);
+		return 0;
+	}
+	count = 0;
+	if (directory_valid) {
+		for (int p=0; p<DIRECTORY_PAGES; p++) {
+			if (directory[p].id != 0 && (directory[p].id & mask) == magic) {
+				for (int k=0; k<directory[p].count; k++) {
+					uint16_t handle = directory[p].handles[k];
+					if (HANDLE_HEAP(handle) < TOTAL_HEAPS && HANDLE_SLOT(handle) < heaps[HANDLE_HEAP(handle)].len) {
+						(*handles)[count++] = handle;
+					}
+				}
+			}
+		}
+	} else {
+		for (int j=0; j<TOTAL_HEAPS; j++) {
+			for (int i=0; i<heaps[j].len; i++) {
+				(*handles)[count++] = HANDLE(j, i, false);
+			}
+		}
+	}
+	return count;
+}
+
+// Version of an object that restore should prefer, according to the last emergency flush
+static int preferred_crc(uint32_t id) {
+	if (emergency_commit.magic != EMERGENCY_MAGIC || emergency_commit.total > MAX_DIRTY || emergency_commit.completed > emergency_commit.total) {
+		return -1;
+	}
+	for (int k=0; k<emergency_commit.total; k++) {
+		if (emergency_commit.entries[k].id == id) {
+			return k < emergency_commit.completed ? emergency_commit.entries[k].new_crc : emergency_commit.entries[k].old_crc;
+		}
+	}
+	return -1;
+}
+
+void set_write_policy(write_mode_t mode, int verify) {
+	write_mode = mode;
+	verify_period = verify;
+}
+
+decay_report_t read_canaries() {
+	decay_report_t report = { 0 };
+	float off_ms = 0.0f;
+	int intact = 0;
+	int partial = 0;
+	for (int j=0; j<=last_heap; j++) {
+		float decay = canaries_decay(&heaps[j]);
+		report.heap_decay[j] = decay;
+		if (decay < DECAY_NONE_THRESHOLD) {
+			intact++;
+		} else if (decay < DECAY_FULL_THRESHOLD) {
+			off_ms += heap_off_ms(j, decay);
+			partial++;
+		}
+	}
+	// Scanning is only worth it if at least one heap kept (some of) its canaries
+	report.decay = partial > 0 ? DECAY_PARTIAL : (intact > 0 ? DECAY_NONE : DECAY_FULL);
+	if (partial > 0) {
+		report.off_ms = off_ms / partial;
+		for (int j=0; j<=last_heap; j++) {
+			report.heap_rate[j] = report.heap_decay[j] * 1000.0f / report.off_ms;
+		}
+	}
+	debugf_uart("Canaries: decay=%d off=%ldms\n", report.decay, report.off_ms);
+	for (int j=0; j<=last_heap; j++) {
+		debugf_uart("heap %d: %d/1000 bits flipped, %d/1000 per s\n", j, (int) (report.heap_decay[j] * 1000), (int) (report.heap_rate[j] * 1000));
+	}
+	return report;
+}
 
 void init_heaps(bool useExpansionPak) {
 	last_heap = useExpansionPak ? TOTAL_HEAPS-1 : TOTAL_HEAPS-3;
+	directory_valid = read_directory();
 }
 
-void replicate(persistence_level_t level, uint32_t id, void* data, int len, int replicas, bool cached, bool flush, void** addresses) {
+replicas_t replicate(persistence_level_t level, uint32_t id, const void* data, const schema_t* schema, int replicas, bool cached, bool flush) {
 	// FIXME Persistence level should also determine cached / flush behaviour
-	int min_heap = 0;
+	int min_heap = first_heap(level, last_heap);
 	int max_heap = last_heap;
-	switch (level) {
-		case HIGHEST:
-			break;
-		case LOW:
-			min_heap = 2;
-			break;
-		case LOWEST:
-			min_heap = max_heap;
-			break;
-	}
 	int heaps_count = (1 + max_heap - min_heap);
 	int replicas_per_heap = replicas / heaps_count;
 	int replicas_remainder = replicas % heaps_count;
 	debugf_uart("replicate: min=%d max=%d per_heap=%d remainder=%d\n", min_heap, max_heap, replicas_per_heap, replicas_remainder);
 	assert(replicas == replicas_per_heap * heaps_count + replicas_remainder);
 
-    int stored_len = sizeof(uint32_t) + len + sizeof(uint16_t);
-	assert(stored_len <= CHUNK_SIZE);
-	uint16_t crc16 = calculate_crc16(id, data, len);
+	assert(schema_packed_size(schema) <= PAYLOAD_MAX_SIZE);
+	uint8_t payload[PAYLOAD_MAX_SIZE];
+	int len = schema_pack(schema, data, payload);
+	chunk_header_t header = {
+		.id = id,
+		.len = len,
+		.check = HEADER_CHECK(id, len),
+		.crc = calculate_crc16(id, payload, len)
+	};
+	chunk_t __attribute__((aligned(8))) chunk;
+	int words = build_chunk(&chunk, &header, payload, len);
+	uint16_t handles[replicas];
 	int replica = 0;
 	for (int j=min_heap; j<=max_heap; j++) {
 		heap_t* heap = &heaps[j];
@@ -180,161 +693,343 @@ void replicate(persistence_level_t level, uint32_t id, void* data, int len, int
 
 		int rounds = (j == min_heap) ? replicas_per_heap + replicas_remainder : replicas_per_heap;
 		for (int i=0; i<rounds; i++) {
-			//debugf_uart("alloc_heap(%d, %d, %d);\n", j, stored_len, cached);
-			void* ptr = alloc_heap(heap, stored_len, cached);
-			memcpy(ptr, &id, sizeof(uint32_t));
-			memcpy(ptr+sizeof(uint32_t), data, len);
-			memcpy(ptr+sizeof(uint32_t)+len, &crc16, sizeof(crc16));
-			// FIXME assert
-			if (memcmp(ptr, &id, sizeof(uint32_t)) != 0 || memcmp(ptr+sizeof(uint32_t), data, len) != 0 || memcmp(ptr+sizeof(uint32_t)+len, &crc16, sizeof(uint16_t)) != 0) {
-				debugf_uart("Copy failed\n");
-			}
+			//debugf_uart("alloc_heap(%d, %d, %d);\n", j, words * sizeof(uint64_t), cached);
+			void* ptr = alloc_heap(heap, words * sizeof(uint64_t), cached);
+			write_chunk(ptr, &chunk, words);
 			//debugf_uart(">>> stored object with id 0x%08x @ %p\n", id, ptr);
-
-			// Optionally flush cache to RDRAM
-			if (cached && flush) {
-				data_cache_hit_writeback(ptr, stored_len);
-				inst_cache_hit_invalidate(ptr, stored_len);
-			}
-			addresses[replica++] = ptr;
+			handles[replica++] = handle_of(j, ptr);
 		}
 		
 		dump_heap(heap);
 	}
 	assert(replica == replicas);
+	replicas_t handle = directory_add(id, handles, replicas) + 1;
+
+	// Optionally flush cache to RDRAM
+	if (flush) {
+		writeback_chunks(handle, replicas, words);
+	}
+	verify_chunks(handle, replicas, &chunk, words);
+	return handle;
 }
 
-void update_replicas(void** addresses, void* data, int len, int replicas, bool flush) {
-    int stored_len = sizeof(uint32_t) + len + sizeof(uint16_t);
-	assert(stored_len <= CHUNK_SIZE);
-	uint32_t id = *(uint32_t*) addresses[0];	// TODO ??
-	uint16_t crc16 = calculate_crc16(id, data, len);
-	for (int i=0; i<replicas; i++) {
-		uint8_t* ptr = addresses[i];
-		assert(ptr != NULL);
-		memcpy(ptr+sizeof(uint32_t), data, len);
-		memcpy(ptr+sizeof(uint32_t)+len, &crc16, sizeof(crc16));
-		// FIXME assert
-		if (memcmp(ptr+sizeof(uint32_t), data, len) != 0 || memcmp(ptr+sizeof(uint32_t)+len, &crc16, sizeof(uint16_t)) != 0) {
-			debugf_uart("Update failed\n");
-		}
-		// Optionally flush cache to RDRAM
-		if (((uintptr_t) ptr & 0xa0000000) == 0x80000000 && flush) {
-			data_cache_hit_writeback(ptr, stored_len);
-			inst_cache_hit_invalidate(ptr, stored_len);
-		}
-	}
-}
-
-void erase_and_free_replicas(void** addresses, int replicas) {
-    for (int i=0; i<replicas; i++) {
-		uint8_t* ptr = addresses[i];
-		if (ptr != NULL) {
-			memset(ptr, 0, CHUNK_SIZE);
-			// Flush cache to RDRAM
-			if (((uintptr_t) ptr & 0xa0000000) == 0x80000000) {
-				data_cache_hit_writeback(ptr, CHUNK_SIZE);
-				inst_cache_hit_invalidate(ptr, CHUNK_SIZE);
-				memset((ptr + 0x20000000), 0, CHUNK_SIZE);
-			}
-			// Determine heap from ptr
-			bool cleared = false;
-			for (int j=0; j<TOTAL_HEAPS; j++) {
-				heap_t* heap = &heaps[j];
-				void* uncached_ptr = (void*) ((uintptr_t) ptr | 0x20000000);
-				//debugf_uart("%p %p %p\n", uncached_ptr, (void*) heap->heap, (void*) &heap->heap[heap->len]);
-				if (uncached_ptr >= (void*) heap->heap && uncached_ptr < (void*) &heap->heap[heap->len]) {
-					//debugf_uart("address %p / %p in heap %d [%p-%p]\n", ptr, uncached_ptr, j, heap->heap, &heap->heap[heap->len]);
-					free_heap(heap, ptr);
-					cleared = true;
-					break;
-				}
-			}
-			if (!cleared) {
-				debugf_uart("no match in heaps for ptr: %p\n", ptr);
-			}
-			assert(cleared);
+// Returns the mask of fields that actually changed (nothing is written if none did)
+uint32_t update_replicas(replicas_t replicas, const void* data, const schema_t* schema, bool flush) {
+	assert(replicas != NO_REPLICAS);
+	const uint8_t* current = UncachedAddr(replica_address(replicas, 0));
+	chunk_header_t header = *(const chunk_header_t*) current;
+	assert(header.len == schema_packed_size(schema));
+	uint8_t payload[PAYLOAD_MAX_SIZE];
+	int len = schema_pack(schema, data, payload);
+	uint32_t changed = schema_diff(schema, payload, current + sizeof(chunk_header_t));
+	begin_write();
+	if (changed == 0) {
+		clear_dirty(replicas);
+		end_write();
+		return 0;
+	}
+	header.crc = calculate_crc16(header.id, payload, len);
+	chunk_t __attribute__((aligned(8))) chunk;
+	int words = build_chunk(&chunk, &header, payload, len);
+	int count = replicas_count(replicas);
+	for (int i=0; i<count; i++) {
+		write_chunk(replica_address(replicas, i), &chunk, words);
+	}
+	// Optionally flush cache to RDRAM
+	if (flush) {
+		writeback_chunks(replicas, count, words);
+	}
+	verify_chunks(replicas, count, &chunk, words);
+	clear_dirty(replicas);
+	end_write();
+	return changed;
+}
+
+void erase_and_free_replicas(replicas_t* replicas) {
+	if (*replicas == NO_REPLICAS) {
+		return;
+	}
+	begin_write();
+	clear_dirty(*replicas);
+	int count = replicas_count(*replicas);
+	for (int r=0; r<count; r++) {
+		uint16_t handle = directory[*replicas-1 + r/HANDLES_PER_PAGE].handles[r%HANDLES_PER_PAGE];
+		heap_t* heap = &heaps[HANDLE_HEAP(handle)];
+		int i = HANDLE_SLOT(handle);
+		// Flush cache to RDRAM
+		if (HANDLE_CACHED(handle)) {
+			memset(heap->cache[i], 0, CHUNK_SIZE);
+			data_cache_hit_writeback_invalidate(heap->cache[i], CHUNK_SIZE);
 		}
+		memset(heap->heap[i], 0, CHUNK_SIZE);
+		free_heap(heap, heap->heap[i]);
 	}
+	directory_remove(*replicas-1);
+	*replicas = NO_REPLICAS;
+	end_write();
 }
 
-bool contains_id(uint32_t* ids, int len, uint32_t id) {
-    for (int i=0; i<len; i++) {
-        if (ids[i] == id) {
-            return true;
-        }
-    }
-    return false;
+typedef struct {
+	uint32_t id;
+	const uint32_t* chunk;	// First valid copy, used as reference for byte-identical replicas
+	int preferred_crc;		// Version to prefer if different copies are found (or -1)
+} accepted_t;
+
+static accepted_t* find_accepted(accepted_t* accepted, int count, uint32_t id) {
+	for (int i=0; i<count; i++) {
+		if (accepted[i].id == id) {
+			return &accepted[i];
+		}
+	}
+	return NULL;
 }
 
-int restore(void* dest, int* counts, int len, int stride, int max, uint32_t magic, uint32_t mask, bool count_uncached_only) {
-	// Restore from ALL HEAPS
-    int restored = 0;
-    uint32_t* ids = malloc(max * sizeof(uint32_t));
-	for (int j=0; j<TOTAL_HEAPS; j++) {
-		heap_t* heap = &heaps[j];
-		for (int i=0; i<heap->len; i++) {
-			// Cached
-			uint8_t* ptr = (uint8_t*) &(heap->cache[i]);
-			uint32_t id = *(uint32_t*) ptr;
-			bool found = contains_id(ids, max, id);
-			if ((id & mask) == magic) {
-				uint16_t crc16 = calculate_crc16(id, ptr+sizeof(uint32_t), len);
-				if (memcmp(ptr+sizeof(uint32_t)+len, &crc16, 2) == 0) {
-					// FIXME heap->allocated[i] = true;
-					uint32_t index = *((uint32_t*) (ptr+sizeof(uint32_t)));
-					assert(index < max);
-					if (!count_uncached_only) {
-						counts[index]++;
-					}
-					if (!found) {
-						//debugf_uart("<<< restored object with id 0x%08x @ %p\n", id, ptr);
-						memcpy(dest+restored*stride, ptr+sizeof(uint32_t), len);
-						ids[restored] = id;
-						restored++;
-						found = true;
-					}
-				}
-			}
-			// Uncached
-			ptr = (uint8_t*) &(heap->heap[i]);
-			id = *(uint32_t*) ptr;
-			if ((id & mask) == magic) {
-				uint16_t crc16 = calculate_crc16(id, ptr+sizeof(uint32_t), len);
-				if (memcmp(ptr+sizeof(uint32_t)+len, &crc16, 2) == 0) {
-					// FIXME heap->allocated[i] = true;
-					uint32_t index = *((uint32_t*) (ptr+sizeof(uint32_t)));
-					assert(index < max);
-					counts[index]++;
-					if (!found) {
-						//debugf_uart("<<< restored object with id 0x%08x @ %p\n", id, ptr);
-						memcpy(dest+restored*stride, ptr+sizeof(uint32_t), len);
-						ids[restored] = id;
-						restored++;
-						found = true;
-					}
-				}
-			}
+static bool same_chunk(const uint32_t* a, const uint32_t* b, int words) {
+	for (int i=0; i<words; i++) {
+		if (a[i] != b[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Validate a single chunk and accept it as the restored copy if its id was not seen yet.
+// Returns true if the chunk is a valid replica.
+static bool restore_chunk(const uint8_t* ptr, void* dest, int* counts, const schema_t* schema, int len, int stride, int max, uint32_t magic, uint32_t mask, bool count, accepted_t* accepted, int* restored) {
+	const chunk_header_t* header = (const chunk_header_t*) ptr;
+	// Cheap prefilter: wrong type, wrong length or inconsistent check byte
+	if ((header->id & mask) != magic || header->len != len || header->check != HEADER_CHECK(header->id, len)) {
+		return false;
+	}
+	accepted_t* reference = find_accepted(accepted, *restored, header->id);
+	int words = (sizeof(chunk_header_t) + len + 3) / 4;
+	// Fast path: identical to the copy we already accepted, no need to compute crc
+	if (reference == NULL || !same_chunk((const uint32_t*) ptr, reference->chunk, words)) {
+		if (header->crc != calculate_crc16(header->id, ptr+sizeof(chunk_header_t), len)) {
+			return false;
 		}
-		debugf_uart("restored replicas with index 0 in heap %d: %d\n", j, counts[0]);
 	}
-    // TODO Need to keep references to valid replicas in the struct itself ?
-	debugf_uart("Found %d instances\n", restored);
+	// FIXME heap->allocated[i] = true;
+	// Index of the object is carried by the low bits of its id, payload layout is up to the caller
+	uint32_t index = header->id & ~mask;
+	if (index >= max) {
+		return false;
+	}
+	if (count) {
+		counts[index]++;
+	}
+	if (reference == NULL) {
+		//debugf_uart("<<< restored object with id 0x%08x @ %p\n", header->id, ptr);
+		schema_unpack(schema, ptr+sizeof(chunk_header_t), dest+index*stride);
+		accepted[*restored].id = header->id;
+		accepted[*restored].chunk = (const uint32_t*) ptr;
+		accepted[*restored].preferred_crc = preferred_crc(header->id);
+		(*restored)++;
+	} else if (header->crc == reference->preferred_crc && ((const chunk_header_t*) reference->chunk)->crc != header->crc) {
+		// Version completed by the emergency flush replaces the one accepted so far
+		debugf_uart("<<< preferring emergency version of object with id 0x%08x @ %p\n", header->id, ptr);
+		schema_unpack(schema, ptr+sizeof(chunk_header_t), dest+index*stride);
+		reference->chunk = (const uint32_t*) ptr;
+	}
+	return true;
+}
+
+uint32_t restore(void* dest, int* counts, const schema_t* schema, int stride, int max, uint32_t magic, uint32_t mask, bool count_uncached_only) {
+	assert(max <= 32);
+	int len = schema_packed_size(schema);
+	// Restore from ALL HEAPS (only allocated slots if the directory is valid)
+	int restored = 0;
+	accepted_t* accepted = malloc(max * sizeof(accepted_t));
+	uint16_t* handles;
+	int slots = candidate_slots(magic, mask, &handles);
+	for (int k=0; k<slots; k++) {
+		heap_t* heap = &heaps[HANDLE_HEAP(handles[k])];
+		int i = HANDLE_SLOT(handles[k]);
+		// Cached
+		restore_chunk((uint8_t*) &(heap->cache[i]), dest, counts, schema, len, stride, max, magic, mask, !count_uncached_only, accepted, &restored);
+		// Uncached
+		restore_chunk((uint8_t*) &(heap->heap[i]), dest, counts, schema, len, stride, max, magic, mask, true, accepted, &restored);
+	}
+	free(handles);
+	// TODO Need to keep references to valid replicas in the struct itself ?
+	debugf_uart("Found %d instances in %d slots\n", restored, slots);
+	uint32_t found = 0;
 	for (int i=0; i<restored; i++) {
-		debugf_uart("id=0x%08x ", ids[i]);
+		debugf_uart("id=0x%08x ", accepted[i].id);
+		found |= 1 << (accepted[i].id & ~mask);
 	}
 	debugf_uart("\n");
-    free(ids);
-	return restored;
+	free(accepted);
+	return found;
+}
+
+// Event log: a ring of compact event records, replicated like any other object.
+// Each event is written in place (a single doubleword per replica) so the chunk crc
+// is meaningless, instead every event carries its own crc.
+
+static uint16_t calculate_event_crc(const event_t* event) {
+	return calculate_crc16(EVENT_LOG_MAGIC, (const uint8_t*) event, offsetof(event_t, crc));
+}
+
+// Serial number arithmetic, so that the sequence can wrap around
+static int seq_diff(uint16_t a, uint16_t b) {
+	return (int16_t) (a - b);
+}
+
+void init_event_log() {
+	_Static_assert(EVENTS_PER_CHUNK * sizeof(event_t) <= PAYLOAD_MAX_SIZE, "event log chunk too large");
+	_Static_assert(65536 % EVENT_LOG_CAPACITY == 0, "event log capacity must divide the sequence number range");
+	static const field_t fields[] = { RAW_FIELD(EVENTS_PER_CHUNK * sizeof(event_t)) };
+	static const schema_t schema = SCHEMA(fields);
+	uint8_t empty[EVENTS_PER_CHUNK * sizeof(event_t)] = { 0 };
+	for (int c=0; c<EVENT_LOG_CHUNKS; c++) {
+		event_log[c] = replicate(HIGHEST, EVENT_LOG_MAGIC | c, empty, &schema, EVENT_LOG_REPLICAS, true, true);
+	}
+}
+
+uint16_t append_event(uint8_t type, uint8_t target, int16_t arg) {
+	assert(event_log[0] != NO_REPLICAS);
+	union {
+		event_t event;
+		uint64_t doubleword;
+	} record = { .event = { .seq = event_seq, .type = type, .target = target, .arg = arg } };
+	record.event.crc = calculate_event_crc(&record.event);
+	int position = event_seq % EVENT_LOG_CAPACITY;
+	int offset = sizeof(chunk_header_t) + (position % EVENTS_PER_CHUNK) * sizeof(event_t);
+	replicas_t chunk = event_log[position / EVENTS_PER_CHUNK];
+	for (int i=0; i<EVENT_LOG_REPLICAS; i++) {
+		uint64_t* dst = replica_address(chunk, i) + offset;
+		if (write_mode == WRITE_UNCACHED) {
+			*(uint64_t*) UncachedAddr(dst) = record.doubleword;
+		} else {
+			*(uint64_t*) CachedAddr(dst) = record.doubleword;
+			data_cache_hit_writeback(CachedAddr(dst), sizeof(uint64_t));
+		}
+	}
+	return event_seq++;
+}
+
+uint16_t event_log_head() {
+	return event_seq;
+}
+
+// Collect valid events from all replicas of the log, sorted by sequence number.
+// Only the most recent contiguous run of events is returned, so that a decayed
+// event in the middle of the log never gets skipped silently.
+int restore_events(event_t* events, int max) {
+	event_t ring[EVENT_LOG_CAPACITY];
+	bool valid[EVENT_LOG_CAPACITY] = { false };
+	uint16_t* handles;
+	int slots = candidate_slots(EVENT_LOG_MAGIC, EVENT_LOG_MASK, &handles);
+	for (int s=0; s<slots; s++) {
+		const uint8_t* ptr = heaps[HANDLE_HEAP(handles[s])].heap[HANDLE_SLOT(handles[s])];
+		const chunk_header_t* header = (const chunk_header_t*) ptr;
+		int len = EVENTS_PER_CHUNK * sizeof(event_t);
+		if ((header->id & EVENT_LOG_MASK) != EVENT_LOG_MAGIC || header->len != len || header->check != HEADER_CHECK(header->id, len)) {
+			continue;
+		}
+		int c = header->id & ~EVENT_LOG_MASK;
+		if (c >= EVENT_LOG_CHUNKS) {
+			continue;
+		}
+		const event_t* chunk_events = (const event_t*) (ptr + sizeof(chunk_header_t));
+		for (int k=0; k<EVENTS_PER_CHUNK; k++) {
+			const event_t* event = &chunk_events[k];
+			int position = c * EVENTS_PER_CHUNK + k;
+			if (position >= EVENT_LOG_CAPACITY) {
+				break;
+			}
+			if (event->crc != calculate_event_crc(event) || (event->seq % EVENT_LOG_CAPACITY) != position) {
+				continue;
+			}
+			// Keep the most recent lap of the ring
+			if (!valid[position] || seq_diff(event->seq, ring[position].seq) > 0) {
+				ring[position] = *event;
+				valid[position] = true;
+			}
+		}
+	}
+	free(handles);
+
+	// Find the newest event, then walk back until the first gap
+	int newest = -1;
+	for (int p=0; p<EVENT_LOG_CAPACITY; p++) {
+		if (valid[p] && (newest == -1 || seq_diff(ring[p].seq, ring[newest].seq) > 0)) {
+			newest = p;
+		}
+	}
+	if (newest == -1) {
+		debugf_uart("Found no events\n");
+		return 0;
+	}
+	int count = 1;
+	while (count < EVENT_LOG_CAPACITY && count < max) {
+		int p = (newest - count + EVENT_LOG_CAPACITY) % EVENT_LOG_CAPACITY;
+		if (!valid[p] || ring[p].seq != (uint16_t) (ring[newest].seq - count)) {
+			break;
+		}
+		count++;
+	}
+	for (int i=0; i<count; i++) {
+		events[i] = ring[(newest - count + 1 + i + EVENT_LOG_CAPACITY) % EVENT_LOG_CAPACITY];
+	}
+	// Keep numbering events after the restored ones
+	event_seq = ring[newest].seq + 1;
+	debugf_uart("Found %d events (%d-%d)\n", count, events[0].seq, events[count-1].seq);
+	return count;
 }
 
 void clear_heaps() {
+	// Emergency flush has been taken into account by restore
+	emergency_commit.magic = 0;
+	begin_write();
+	dirty_count = 0;
 	// For each heap, clear and free allocated chunks
 	for (int j=0; j<TOTAL_HEAPS; j++) {
 		heap_t* heap = &heaps[j];
 		clear_heap(heap);
+		if (j <= last_heap) {
+			write_canaries(heap);
+		}
+	}
+	clear_directory();
+	end_write();
+}
+
+#ifdef PERSISTENCE_BENCHMARK
+void benchmark_write_policies() {
+	// Time replicate + updates of a scratch object with each write policy
+	replicas_t replicas;
+	uint8_t payload[48] = { 0 };
+	static const field_t fields[] = { RAW_FIELD(sizeof(payload)) };
+	static const schema_t schema = SCHEMA(fields);
+	const struct { write_mode_t mode; int verify; const char* name; } policies[] = {
+		{ WRITE_UNCACHED,	0,	"uncached" },
+		{ WRITE_UNCACHED,	16,	"uncached+verify/16" },
+		{ WRITE_UNCACHED,	1,	"uncached+verify" },
+		{ WRITE_CACHED,		0,	"cached" },
+		{ WRITE_CACHED,		16,	"cached+verify/16" },
+		{ WRITE_CACHED,		1,	"cached+verify" },
+	};
+	write_mode_t previous_mode = write_mode;
+	int previous_verify = verify_period;
+	for (int p=0; p<sizeof(policies)/sizeof(policies[0]); p++) {
+		set_write_policy(policies[p].mode, policies[p].verify);
+		uint32_t start = TICKS_READ();
+		replicas = replicate(HIGHEST, 0xdeadbe00, payload, &schema, 100, true, true);
+		uint32_t replicated = TICKS_READ();
+		for (int i=0; i<10; i++) {
+			payload[0] = i;
+			update_replicas(replicas, payload, &schema, true);
+		}
+		uint32_t updated = TICKS_READ();
+		erase_and_free_replicas(&replicas);
+		debugf_uart("write policy %s: replicate=%dus update=%dus (100 replicas)\n", policies[p].name,
+			(int) TICKS_TO_US(TICKS_DISTANCE(start, replicated)), (int) TICKS_TO_US(TICKS_DISTANCE(replicated, updated)) / 10);
 	}
+	set_write_policy(previous_mode, previous_verify);
 }
+#endif
 
 void heaps_stats(char* buffer, int len) {
 	snprintf(buffer, len, "%d %d %d %d %d %d",
@@ -1,18 +1,75 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "schema.h"
+
+#define TOTAL_HEAPS (6)
+
 typedef enum {
 	HIGHEST = 0,
 	LOW,
 	LOWEST
 } persistence_level_t;
 
+typedef enum {
+	WRITE_UNCACHED = 0,	// Doubleword stores through the uncached segment
+	WRITE_CACHED		// Doubleword cached stores, written back once per replicate/update
+} write_mode_t;
+
+// Handle to the replicas of an object, tracked by persistence (NO_REPLICAS until replicated)
+typedef uint8_t replicas_t;
+#define NO_REPLICAS (0)
+
+// Compact record of a gameplay change, appended to the replicated event log
+typedef struct {
+	uint16_t seq;
+	uint8_t type;
+	uint8_t target;
+	int16_t arg;
+	uint16_t crc;
+} event_t;
+
+typedef enum {
+	PRIORITY_LOW = 0,
+	PRIORITY_NORMAL,
+	PRIORITY_HIGH
+} priority_t;
+
+#define EVENT_LOG_CAPACITY (64)	// Divides 65536, so ring positions stay in step when seq wraps
+
+typedef enum {
+	DECAY_NONE = 0,		// Canaries intact: warm boot or very short power off
+	DECAY_PARTIAL,		// Some bits flipped: data may have survived
+	DECAY_FULL			// Nothing left to restore (or canaries were never written)
+} decay_t;
+
+typedef struct {
+	decay_t decay;
+	float heap_decay[TOTAL_HEAPS];	// Proportion of canary bits that flipped in each heap
+	float heap_rate[TOTAL_HEAPS];	// Proportion of bits flipped per second of estimated off time
+	uint32_t off_ms;				// Estimated power off duration
+} decay_report_t;
+
 void init_heaps(bool useExpansionPak);
-void replicate(persistence_level_t level, uint32_t id, void* data, int len, int replicas, bool cached, bool flush, void** addresses);
-void update_replicas(void** addresses, void* data, int len, int replicas, bool flush);
-void erase_and_free_replicas(void** addresses, int replicas);
-int restore(void* dest, int* counts, int len, int stride, int max, uint32_t magic, uint32_t mask, bool count_uncached_only);
+replicas_t replicate(persistence_level_t level, uint32_t id, const void* data, const schema_t* schema, int replicas, bool cached, bool flush);
+uint32_t update_replicas(replicas_t replicas, const void* data, const schema_t* schema, bool flush);
+void erase_and_free_replicas(replicas_t* replicas);
+void mark_dirty(replicas_t replicas, const void* data, const schema_t* schema, uint16_t* seq, priority_t priority);
+void flush_dirty();
+bool emergency_begin(void (*commit)(void));
+void emergency_flush();
+uint32_t restore(void* dest, int* counts, const schema_t* schema, int stride, int max, uint32_t magic, uint32_t mask, bool count_uncached_only);
 void clear_heaps();
 void heaps_stats(char* buffer, int len);
+decay_report_t read_canaries();
+void init_event_log();
+uint16_t append_event(uint8_t type, uint8_t target, int16_t arg);
+uint16_t event_log_head();
+int restore_events(event_t* events, int max);
+void set_write_policy(write_mode_t mode, int verify_period);
+#ifdef PERSISTENCE_BENCHMARK
+void benchmark_write_policies();
+#endif
@@ -0,0 +1,196 @@
+#include "ports.h"
+#include "pc64.h"
+
+
+// A probe is a single joybus transfer reading the buttons of the selected ports (an empty port
+// reports no device). It also gives the buttons of a controller libdragon has not identified yet.
+
+#define PORTS_COUNT (4)
+#define JOYBUS_CMD_READ (0x01)
+#define JOYBUS_SKIP (0x00)
+#define JOYBUS_END (0xfe)
+#define JOYBUS_NO_DEVICE (0x80)		// Error flag in the receive length
+#define READ_SIZE (7)				// Transmit length, receive length, command, 4 reply bytes
+
+static uint64_t probe_block[JOYBUS_BLOCK_SIZE / sizeof(uint64_t)];
+static uint8_t probe_mask;
+static volatile bool probe_pending;
+
+static volatile uint8_t connected;
+static volatile uint16_t raw_buttons[PORTS_COUNT];
+static uint32_t next_occupied;
+static uint32_t next_empty;
+static uint32_t empty_interval;
+static uint32_t search_until;
+static ports_stats_t stats;
+#ifdef PORTS_LATENCY
+static uint32_t last_seen[PORTS_COUNT];
+static uint32_t unplugged_seen;		// Last probe that saw the unplugged controller
+#endif
+
+
+static void start_search(uint32_t now) {
+	empty_interval = TICKS_FROM_MS(PORTS_FAST_MS);
+	next_empty = now;
+	search_until = now + TICKS_FROM_MS(PORTS_SEARCH_MS);
+}
+
+static void probed(uint64_t* output, void* ctx) {
+	uint8_t* out = (uint8_t*) output;
+	uint32_t now = TICKS_READ();
+	uint8_t previous = connected;
+	uint8_t found = 0;
+	int i = 0;
+	for (int port=0; port<PORTS_COUNT; port++) {
+		if (!(probe_mask & (1 << port))) {
+			i++;
+			continue;
+		}
+		if (!(out[i+1] & JOYBUS_NO_DEVICE)) {
+			found |= 1 << port;
+			raw_buttons[port] = (out[i+3] << 8) | out[i+4];
+#ifdef PORTS_LATENCY
+			last_seen[port] = now;
+#endif
+		}
+		i += READ_SIZE;
+	}
+	uint8_t now_connected = (previous & ~probe_mask) | found;
+	uint8_t unplugged = previous & ~now_connected;
+	uint8_t plugged = now_connected & ~previous;
+	connected = now_connected;
+	probe_pending = false;
+
+	if (unplugged) {
+		stats.unplugs++;
+		start_search(now);
+#ifdef PORTS_LATENCY
+		for (int port=0; port<PORTS_COUNT; port++) {
+			if (unplugged & (1 << port)) {
+				unplugged_seen = last_seen[port];
+				stats.detect_ticks = TICKS_DISTANCE(unplugged_seen, now);
+			}
+		}
+#endif
+	}
+	if (plugged && search_until != 0) {
+		// Found again: back off from the fast rate
+		stats.switches++;
+		search_until = 0;
+#ifdef PORTS_LATENCY
+		if (unplugged_seen == 0) {
+			return;		// No controller at boot
+		}
+		stats.last_ticks = TICKS_DISTANCE(unplugged_seen, now);
+		stats.max_ticks = MAX(stats.max_ticks, stats.last_ticks);
+		debugf_uart("Ports: %02x -> %02x in %ldms (unplug detected within %ldms, %ld probes)\n",
+			previous, now_connected, TICKS_TO_MS(stats.last_ticks), TICKS_TO_MS(stats.detect_ticks), stats.probes);
+#endif
+	}
+}
+
+static void probe(uint8_t mask) {
+	uint8_t* block = (uint8_t*) probe_block;
+	int i = 0;
+	for (int port=0; port<PORTS_COUNT; port++) {
+		if (!(mask & (1 << port))) {
+			block[i++] = JOYBUS_SKIP;
+			continue;
+		}
+		block[i++] = 1;
+		block[i++] = 4;
+		block[i++] = JOYBUS_CMD_READ;
+		for (int j=0; j<4; j++) {
+			block[i++] = 0xff;
+		}
+	}
+	block[i++] = JOYBUS_END;
+	while (i < JOYBUS_BLOCK_SIZE - 1) {
+		block[i++] = 0;
+	}
+	block[JOYBUS_BLOCK_SIZE - 1] = 0x01;	// Run the commands
+	probe_mask = mask;
+	probe_pending = true;
+	stats.probes++;
+	joybus_exec_async(block, probed, NULL);
+}
+
+
+void ports_init() {
+	uint32_t now = TICKS_READ();
+	uint8_t mask = 0;
+	for (int port=0; port<PORTS_COUNT; port++) {
+		if (joypad_is_connected(port)) {
+			mask |= 1 << port;
+		}
+	}
+	connected = mask;
+	next_occupied = now;
+	if (mask == 0) {
+		start_search(now);
+	} else {
+		empty_interval = TICKS_FROM_MS(PORTS_SLOW_MS);
+		next_empty = now + empty_interval;
+	}
+}
+
+// Called from the joypad sampling timer: issues at most one probe at a time
+void ports_poll(uint32_t now) {
+	if (probe_pending) {
+		return;
+	}
+	uint8_t occupied = connected;
+	uint8_t mask = 0;
+	if (!TICKS_BEFORE(now, next_occupied)) {
+		mask |= occupied;
+		next_occupied = now + TICKS_FROM_MS(PORTS_OCCUPIED_MS);
+	}
+	// Controllers libdragon does not read yet are read at every poll
+	for (int port=0; port<PORTS_COUNT; port++) {
+		if ((occupied & (1 << port)) && !joypad_is_connected(port)) {
+			mask |= 1 << port;
+		}
+	}
+	if (!TICKS_BEFORE(now, next_empty)) {
+		mask |= ~occupied & ((1 << PORTS_COUNT) - 1);
+		if (search_until == 0 || !TICKS_BEFORE(now, search_until)) {
+			empty_interval = MIN(empty_interval * 2, TICKS_FROM_MS(PORTS_SLOW_MS));
+		}
+		next_empty = now + empty_interval;
+	}
+	if (mask != 0) {
+		probe(mask);
+	}
+}
+
+uint8_t ports_connected() {
+	return connected;
+}
+
+// From libdragon once it identified the controller, from the probes until then
+joypad_buttons_t ports_buttons(int port) {
+	if (joypad_is_connected(port)) {
+		return joypad_get_buttons(port);
+	}
+	uint16_t raw = raw_buttons[port];
+	return (joypad_buttons_t) {
+		.a = (raw >> 15) & 1,
+		.b = (raw >> 14) & 1,
+		.z = (raw >> 13) & 1,
+		.start = (raw >> 12) & 1,
+		.d_up = (raw >> 11) & 1,
+		.d_down = (raw >> 10) & 1,
+		.d_left = (raw >> 9) & 1,
+		.d_right = (raw >> 8) & 1,
+		.l = (raw >> 5) & 1,
+		.r = (raw >> 4) & 1,
+		.c_up = (raw >> 3) & 1,
+		.c_down = (raw >> 2) & 1,
+		.c_left = (raw >> 1) & 1,
+		.c_right = raw & 1
+	};
+}
+
+ports_stats_t ports_stats() {
+	return stats;
+}
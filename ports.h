@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libdragon.h>
+
+// Controller ports: which ports hold a controller, probed by the game instead of relying on
+// libdragon's periodic identify. Occupied ports are checked often (to notice an unplug), empty
+// ports are probed at a high rate right after a controller disappeared, then less and less often.
+
+#define PORTS_OCCUPIED_MS (32)		// Probe interval of occupied ports
+#define PORTS_FAST_MS (8)			// Probe interval of empty ports right after an unplug...
+#define PORTS_SLOW_MS (1000)		// ...backing off (doubling) up to this one
+#define PORTS_SEARCH_MS (2000)		// Fast probing lasts this long after an unplug
+
+typedef struct {
+	uint32_t probes;		// Joybus transfers
+	uint32_t unplugs;
+	uint32_t switches;		// Controller found on another port after an unplug
+	// PORTS_LATENCY only
+	uint32_t last_ticks;	// Latest unplug to switch, from the last probe that saw the controller
+	uint32_t max_ticks;
+	uint32_t detect_ticks;	// Latest unplug detection delay (upper bound)
+} ports_stats_t;
+
+void ports_init();
+void ports_poll(uint32_t now);
+uint8_t ports_connected();
+joypad_buttons_t ports_buttons(int port);
+ports_stats_t ports_stats();
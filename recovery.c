@@ -1,71 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
 #include "recovery.h"
 #include "persistence.h"
 #include "pc64.h"
 
 
-global_state_t restored_global_state;
+// Restored objects are written straight into the live game state, masks tell which ones were found
+
 int restored_global_state_count;
 int restored_global_state_counts;
+int restored_counters_count;
+int restored_counters_counts;
+int restored_level_clock_count;
+int restored_level_clock_counts;
 
-console_t restored_consoles[MAX_CONSOLES];
+uint32_t restored_consoles_mask;
 int restored_consoles_count;
 int restored_consoles_counts[MAX_CONSOLES];
 
-attacker_t restored_attackers[MAX_CONSOLES];
+uint32_t restored_attackers_mask;
 int restored_attackers_count;
 int restored_attackers_counts[MAX_CONSOLES];
 int restored_attackers_minimas[MAX_CONSOLES];
 int restored_attackers_ignored;
 
-overheat_t restored_overheat[MAX_CONSOLES];
+uint32_t restored_overheat_mask;
 int restored_overheat_count;
 int restored_overheat_counts[MAX_CONSOLES];
 int restored_overheat_minimas[MAX_CONSOLES];
 int restored_overheat_ignored;
 
+int restored_events_count;
+
+decay_report_t restored_decay;
+
+
+// Replay events logged after each restored snapshot
+
+static attacker_t* find_restored_attacker(uint32_t id) {
+    return (id < MAX_CONSOLES && (restored_attackers_mask & (1 << id))) ? &console_attackers[id] : NULL;
+}
+
+static overheat_t* find_restored_overheat(uint32_t id) {
+    return (id < MAX_CONSOLES && (restored_overheat_mask & (1 << id))) ? &console_overheat[id] : NULL;
+}
+
+// An event applies to a snapshot if it was logged after it, and only if no event
+// between the snapshot and the oldest restored event is missing
+static bool applies_to(const event_t* event, uint16_t snapshot_seq, uint16_t first_seq) {
+    return (int16_t) (event->seq - snapshot_seq) >= 0 && (int16_t) (snapshot_seq - first_seq) >= 0;
+}
+
+static void replay_event(const event_t* event, uint16_t first_seq) {
+    int idx = event->target & 0x0f;
+    float t = EVENT_TIME_TO_FLOAT(event->arg);
+    switch (event->type) {
+        case EVENT_GROW_ATTACKER: {
+            attacker_t* attacker = find_restored_attacker(idx);
+            if (attacker != NULL && applies_to(event, attacker->seq, first_seq) && attacker->level < QUEUE_LENGTH) {
+                if (attacker->level == 0) {
+                    attacker->rival_type = (event->target >> 6) & 0x1;
+                }
+                attacker->level++;
+                attacker->queue.buttons[attacker->queue.end] = (event->target >> 4) & 0x3;
+                attacker->queue.end = (attacker->queue.end + 1) % QUEUE_LENGTH;
+                attacker->last_attack = t;
+            }
+            break;
+        }
+        case EVENT_SHRINK_ATTACKER: {
+            attacker_t* attacker = find_restored_attacker(idx);
+            if (attacker != NULL && applies_to(event, attacker->seq, first_seq) && attacker->level > 0) {
+                if (attacker->level == QUEUE_LENGTH) {
+                    attacker->last_attack = t;
+                }
+                attacker->level--;
+                attacker->queue.start = (attacker->queue.start + 1) % QUEUE_LENGTH;
+            }
+            break;
+        }
+        case EVENT_SET_OVERHEAT: {
+            overheat_t* overheat = find_restored_overheat(idx);
+            if (overheat != NULL && applies_to(event, overheat->seq, first_seq)) {
+                overheat->overheat_level = event->target >> 4;
+                overheat->last_overheat = t;
+            }
+            break;
+        }
+        case EVENT_INC_RESET_COUNT:
+            if (restored_counters_count > 0 && applies_to(event, global_counters.seq, first_seq)) {
+                global_counters.reset_count++;
+            }
+            break;
+        case EVENT_INC_POWER_CYCLE_COUNT:
+            if (restored_counters_count > 0 && applies_to(event, global_counters.seq, first_seq)) {
+                global_counters.power_cycle_count++;
+            }
+            break;
+        case EVENT_INC_LEVEL_RESET_COUNT:
+            if (restored_global_state_count > 0 && applies_to(event, global_state.seq, first_seq) && idx < MAX_CONSOLES) {
+                global_state.level_reset_count_per_console[idx]++;
+            }
+            break;
+        case EVENT_INC_LEVEL_POWER_CYCLE_COUNT:
+            if (restored_global_state_count > 0 && applies_to(event, global_state.seq, first_seq)) {
+                global_state.level_power_cycle_count++;
+            }
+            break;
+        default:
+            debugf_uart("unknown event type %d (seq=%d)\n", event->type, event->seq);
+            break;
+    }
+}
+
+static void replay_events() {
+    event_t* events = malloc(EVENT_LOG_CAPACITY * sizeof(event_t));
+    restored_events_count = restore_events(events, EVENT_LOG_CAPACITY);
+    for (int i=0; i<restored_events_count; i++) {
+        replay_event(&events[i], events[0].seq);
+    }
+    free(events);
+}
+
 
 bool try_recover() {
+    // Canaries tell right away whether anything may have survived
+    restored_decay = read_canaries();
+    if (restored_decay.decay == DECAY_FULL) {
+        debugf_uart("Memory fully decayed: skipping restoration\n");
+        return false;
+    }
+
     // Restore game data from heap replicas
-    restored_global_state_count = restore(&restored_global_state, &restored_global_state_counts, GLOBAL_STATE_PAYLOAD_SIZE, sizeof(global_state_t), 1, GLOBAL_STATE_MAGIC, GLOBAL_STATE_MASK, false);
-    restored_consoles_count = restore(restored_consoles, restored_consoles_counts, CONSOLE_PAYLOAD_SIZE, sizeof(console_t), MAX_CONSOLES, CONSOLE_MAGIC, CONSOLE_MASK, false);
-    restored_attackers_count = restore(restored_attackers, restored_attackers_counts, ATTACKER_PAYLOAD_SIZE, sizeof(attacker_t), MAX_CONSOLES, ATTACKER_MAGIC, ATTACKER_MASK, true);
-    restored_overheat_count = restore(restored_overheat, restored_overheat_counts, OVERHEAT_PAYLOAD_SIZE, sizeof(overheat_t), MAX_CONSOLES, OVERHEAT_MAGIC, OVERHEAT_MASK, true);
+    restored_global_state_count = __builtin_popcount(restore(&global_state, &restored_global_state_counts, &global_state_schema, sizeof(global_state_t), 1, GLOBAL_STATE_MAGIC, GLOBAL_STATE_MASK, false));
+    restored_counters_count = __builtin_popcount(restore(&global_counters, &restored_counters_counts, &counters_schema, sizeof(counters_t), 1, COUNTERS_MAGIC, COUNTERS_MASK, false));
+    restored_level_clock_count = __builtin_popcount(restore(&level_clock, &restored_level_clock_counts, &level_clock_schema, sizeof(level_clock_t), 1, LEVEL_CLOCK_MAGIC, LEVEL_CLOCK_MASK, false));
+    restored_consoles_mask = restore(consoles, restored_consoles_counts, &console_schema, sizeof(console_t), MAX_CONSOLES, CONSOLE_MAGIC, CONSOLE_MASK, false);
+    restored_attackers_mask = restore(console_attackers, restored_attackers_counts, &attacker_schema, sizeof(attacker_t), MAX_CONSOLES, ATTACKER_MAGIC, ATTACKER_MASK, true);
+    restored_overheat_mask = restore(console_overheat, restored_overheat_counts, &overheat_schema, sizeof(overheat_t), MAX_CONSOLES, OVERHEAT_MAGIC, OVERHEAT_MASK, true);
+    restored_consoles_count = __builtin_popcount(restored_consoles_mask);
+    restored_attackers_count = __builtin_popcount(restored_attackers_mask);
+    restored_overheat_count = __builtin_popcount(restored_overheat_mask);
+
+    // Bring snapshots up to date
+    replay_events();
+
+    // Hot state has fewer replicas: restart the level clock if it did not survive
+    if (restored_global_state_count > 0 && restored_level_clock_count == 0 && global_state.current_level < TOTAL_LEVELS) {
+        debugf_uart("Level clock lost: restarting level timer\n");
+        level_clock.timer = levels[global_state.current_level].duration;
+    }
 
     // Keep track of required replicas
-    for (int i=0; i<restored_attackers_count; i++) {
-        uint32_t id = restored_attackers[i].id;
-        restored_attackers_minimas[id] = restored_attackers[i].min_replicas;
+    for (int id=0; id<MAX_CONSOLES; id++) {
+        if (restored_attackers_mask & (1 << id)) {
+            restored_attackers_minimas[id] = console_attackers[id].min_replicas;
+        }
+        if (restored_overheat_mask & (1 << id)) {
+            restored_overheat_minimas[id] = console_overheat[id].min_replicas;
+        }
     }
-    for (int i=0; i<restored_overheat_count; i++) {
-        uint32_t id = restored_overheat[i].id;
-        restored_overheat_minimas[id] = restored_overheat[i].min_replicas;
-    }    
 
 #ifdef DEBUG_MODE
     if (restored_global_state_count > 0) {
         debugf_uart("global_state: %d/%d\n", restored_global_state_counts, GLOBAL_STATE_REPLICAS);
     }
+    debugf_uart("counters: %d/%d level clock: %d/%d\n", restored_counters_counts, COUNTERS_REPLICAS, restored_level_clock_counts, LEVEL_CLOCK_REPLICAS);
     if (restored_consoles_count > 0) {
         debugf_uart("consoles: ");
-        for (int i=0; i<restored_consoles_count; i++) {
-            uint32_t id = restored_consoles[i].id;
-            debugf_uart("%d/%d ", restored_consoles_counts[id], CONSOLE_REPLICAS);
+        for (int id=0; id<MAX_CONSOLES; id++) {
+            if (restored_consoles_mask & (1 << id)) {
+                debugf_uart("%d/%d ", restored_consoles_counts[id], CONSOLE_REPLICAS);
+            }
         }
         debugf_uart("\n");
     }
     if (restored_attackers_count > 0) {
         debugf_uart("attackers: ");
-        for (int i=0; i<restored_attackers_count; i++) {
-            uint32_t id = restored_attackers[i].id;
-            debugf_uart("%d of %d/%d ", restored_attackers_counts[id], restored_attackers[i].min_replicas, ATTACKER_REPLICAS);
+        for (int id=0; id<MAX_CONSOLES; id++) {
+            if (restored_attackers_mask & (1 << id)) {
+                debugf_uart("%d of %d/%d ", restored_attackers_counts[id], restored_attackers_minimas[id], ATTACKER_REPLICAS);
+            }
         }
         debugf_uart("\n");
     }
     if (restored_overheat_count > 0) {
         debugf_uart("overheat: ");
-        for (int i=0; i<restored_overheat_count; i++) {
-            uint32_t id = restored_overheat[i].id;
-            debugf_uart("%d of %d/%d", restored_overheat_counts[id], restored_overheat[i].min_replicas, OVERHEAT_REPLICAS);
+        for (int id=0; id<MAX_CONSOLES; id++) {
+            if (restored_overheat_mask & (1 << id)) {
+                debugf_uart("%d of %d/%d ", restored_overheat_counts[id], restored_overheat_minimas[id], OVERHEAT_REPLICAS);
+            }
         }
         debugf_uart("\n");
     }
@@ -78,15 +202,27 @@ bool try_recover() {
 
 
 bool validate_recovered() {
-    debugf_uart("Restored level %d\n", restored_global_state.current_level);
+    debugf_uart("Restored level %d\n", global_state.current_level);
+    if (restored_decay.decay == DECAY_PARTIAL) {
+        debugf_uart("Power was off for about %ldms\n", restored_decay.off_ms);
+    }
     bool broken_level = false;
-    if (restored_global_state.game_state == IN_GAME && restored_global_state.current_level >= 0 && restored_global_state.current_level < TOTAL_LEVELS) {
-        const level_t* level = &levels[restored_global_state.current_level];
-        if (restored_consoles_count != level->consoles_count) {
-            debugf_uart("FAILED TO RESTORE ALL CONSOLES !!! %d != %d\n", restored_consoles_count, level->consoles_count);
+    if (global_state.game_state == IN_GAME && global_state.current_level >= 0 && global_state.current_level < TOTAL_LEVELS) {
+        const level_t* level = &levels[global_state.current_level];
+        // Consoles are set up by id, 0 to consoles_count-1: any missing or extra id breaks the level
+        if (restored_consoles_mask != (1u << level->consoles_count) - 1) {
+            debugf_uart("FAILED TO RESTORE ALL CONSOLES !!! %d != %d (mask 0x%lx)\n", restored_consoles_count, level->consoles_count, restored_consoles_mask);
             //debugf_uart("BROKEN: fallback to initial boot sequence\n");
             broken_level = true;
         }
     }
     return !broken_level;
 }
+
+
+// Restored level objects that end up not being used must not leak into the next level
+void discard_recovered_level() {
+    memset(consoles, 0, sizeof(consoles));
+    memset(console_attackers, 0, sizeof(console_attackers));
+    memset(console_overheat, 0, sizeof(console_overheat));
+}
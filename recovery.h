@@ -1,28 +1,37 @@
 #pragma once
 
 #include "game_state.h"
+#include "persistence.h"
 
 
-extern global_state_t restored_global_state;
 extern int restored_global_state_count;
 extern int restored_global_state_counts;
+extern int restored_counters_count;
+extern int restored_counters_counts;
+extern int restored_level_clock_count;
+extern int restored_level_clock_counts;
 
-extern console_t restored_consoles[MAX_CONSOLES];
+extern uint32_t restored_consoles_mask;
 extern int restored_consoles_count;
 extern int restored_consoles_counts[MAX_CONSOLES];
 
-extern attacker_t restored_attackers[MAX_CONSOLES];
+extern uint32_t restored_attackers_mask;
 extern int restored_attackers_count;
 extern int restored_attackers_counts[MAX_CONSOLES];
 extern int restored_attackers_minimas[MAX_CONSOLES];
 extern int restored_attackers_ignored;
 
-extern overheat_t restored_overheat[MAX_CONSOLES];
+extern uint32_t restored_overheat_mask;
 extern int restored_overheat_count;
 extern int restored_overheat_counts[MAX_CONSOLES];
 extern int restored_overheat_minimas[MAX_CONSOLES];
 extern int restored_overheat_ignored;
 
+extern int restored_events_count;
+
+extern decay_report_t restored_decay;
+
 
 bool try_recover();
 bool validate_recovered();
+void discard_recovered_level();
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <string.h>
+#include "replay.h"
+#include "pc64.h"
+
+
+// Stream layout (little-endian): magic, version, seed, then one record after another.
+// A frame starts with a tag byte: connected ports in bits 0-3, then optional fields flagged by
+// bits 4-6 (held buttons, pressed buttons, frame duration), only present when they change
+// (pressed: when non-zero). Bit 7 marks other records, with their kind in bits 0-6: resets,
+// power cycles, and samples (time, ports, held and pressed buttons, all stored in full).
+// Frame durations are stored as raw floats, so that the replay integrates exactly the same steps.
+// A typical frame with a steady frame rate and no button change is a single byte.
+// Every frame is flushed as soon as it is recorded: the frames right before a reset or a power
+// off are the ones a replay must not lose (and the NMI cannot safely flush stdio).
+
+#define TAG_HELD (1 << 4)
+#define TAG_PRESSED (1 << 5)
+#define TAG_DT (1 << 6)
+#define TAG_EVENT (1 << 7)
+
+typedef struct {
+	FILE* file;
+	bool known;				// Whether held and dt below were written/read since the stream was opened
+	uint16_t held;
+	uint32_t dt;			// Bits of the float
+	uint32_t frames;
+} stream_t;
+
+static stream_t recording;
+static stream_t playback;
+
+
+// Little-endian fields, so that recordings move between the console and the host
+
+static void put_u16(FILE* file, uint16_t v) {
+	fputc(v & 0xff, file);
+	fputc(v >> 8, file);
+}
+
+static void put_u32(FILE* file, uint32_t v) {
+	put_u16(file, v & 0xffff);
+	put_u16(file, v >> 16);
+}
+
+static bool get_u8(FILE* file, uint8_t* v) {
+	int c = fgetc(file);
+	*v = c;
+	return c != EOF;
+}
+
+static bool get_u16(FILE* file, uint16_t* v) {
+	uint8_t lo = 0, hi = 0;
+	bool ok = get_u8(file, &lo) && get_u8(file, &hi);
+	*v = lo | (hi << 8);
+	return ok;
+}
+
+static bool get_u32(FILE* file, uint32_t* v) {
+	uint16_t lo = 0, hi = 0;
+	bool ok = get_u16(file, &lo) && get_u16(file, &hi);
+	*v = lo | ((uint32_t) hi << 16);
+	return ok;
+}
+
+
+// Recording
+
+// Appending carries on a recording across a reset or power cycle (the header is only written once)
+bool replay_record_open(const char* path, uint32_t seed, bool append) {
+	recording = (stream_t) { 0 };
+	recording.file = fopen(path, append ? "ab" : "wb");
+	if (recording.file == NULL) {
+		debugf_uart("Replay: cannot record to %s\n", path);
+		return false;
+	}
+	if (!append || ftell(recording.file) == 0) {
+		put_u32(recording.file, REPLAY_MAGIC);
+		put_u32(recording.file, REPLAY_VERSION);
+		put_u32(recording.file, seed);
+		fflush(recording.file);
+	}
+	debugf_uart("Replay: recording to %s\n", path);
+	return true;
+}
+
+void replay_record(const replay_record_t* record) {
+	FILE* file = recording.file;
+	if (file == NULL) {
+		return;
+	}
+	if (record->kind != REPLAY_FRAME) {
+		fputc(TAG_EVENT | record->kind, file);
+		if (record->kind == REPLAY_RESET) {
+			fputc((uint8_t) record->console, file);
+			put_u32(file, record->held_ms);
+			fflush(file);
+		} else if (record->kind == REPLAY_SAMPLE) {
+			uint32_t time;
+			memcpy(&time, &record->time, sizeof(time));
+			put_u32(file, time);
+			fputc(record->ports, file);
+			put_u16(file, record->held);
+			put_u16(file, record->pressed);
+		} else {
+			fflush(file);
+		}
+		return;
+	}
+	uint32_t dt;
+	memcpy(&dt, &record->dt, sizeof(dt));
+	uint8_t tag = record->ports & 0xf;
+	if (!recording.known || record->held != recording.held) {
+		tag |= TAG_HELD;
+	}
+	if (record->pressed != 0) {
+		tag |= TAG_PRESSED;
+	}
+	if (!recording.known || dt != recording.dt) {
+		tag |= TAG_DT;
+	}
+	fputc(tag, file);
+	if (tag & TAG_HELD) {
+		put_u16(file, record->held);
+	}
+	if (tag & TAG_PRESSED) {
+		put_u16(file, record->pressed);
+	}
+	if (tag & TAG_DT) {
+		put_u32(file, dt);
+	}
+	recording.known = true;
+	recording.held = record->held;
+	recording.dt = dt;
+	recording.frames++;
+	fflush(file);
+}
+
+void replay_record_close() {
+	if (recording.file != NULL) {
+		fclose(recording.file);
+		recording.file = NULL;
+	}
+}
+
+
+// Playback
+
+bool replay_open(const char* path, uint32_t* seed) {
+	playback = (stream_t) { 0 };
+	playback.file = fopen(path, "rb");
+	if (playback.file == NULL) {
+		debugf_uart("Replay: cannot open %s\n", path);
+		return false;
+	}
+	uint32_t magic, version;
+	if (!get_u32(playback.file, &magic) || !get_u32(playback.file, &version) || !get_u32(playback.file, seed)
+			|| magic != REPLAY_MAGIC || version != REPLAY_VERSION) {
+		debugf_uart("Replay: %s is not a recording\n", path);
+		replay_close();
+		return false;
+	}
+	debugf_uart("Replay: playing %s (seed %08lx)\n", path, *seed);
+	return true;
+}
+
+// Returns false at the end of the recording (or if it was truncated)
+bool replay_next(replay_record_t* record) {
+	FILE* file = playback.file;
+	uint8_t tag;
+	if (file == NULL || !get_u8(file, &tag)) {
+		return false;
+	}
+	*record = (replay_record_t) { .console = -1 };
+	if (tag & TAG_EVENT) {
+		record->kind = tag & ~TAG_EVENT;
+		if (record->kind == REPLAY_RESET) {
+			uint8_t console;
+			if (!get_u8(file, &console) || !get_u32(file, &record->held_ms)) {
+				return false;
+			}
+			record->console = (int8_t) console;
+		} else if (record->kind == REPLAY_SAMPLE) {
+			uint32_t time;
+			if (!get_u32(file, &time) || !get_u8(file, &record->ports) || !get_u16(file, &record->held) || !get_u16(file, &record->pressed)) {
+				return false;
+			}
+			memcpy(&record->time, &time, sizeof(record->time));
+		}
+		return record->kind == REPLAY_RESET || record->kind == REPLAY_POWER_CYCLE || record->kind == REPLAY_SAMPLE;
+	}
+	record->kind = REPLAY_FRAME;
+	record->ports = tag & 0xf;
+	if ((tag & TAG_HELD) && !get_u16(file, &playback.held)) {
+		return false;
+	}
+	if ((tag & TAG_PRESSED) && !get_u16(file, &record->pressed)) {
+		return false;
+	}
+	if ((tag & TAG_DT) && !get_u32(file, &playback.dt)) {
+		return false;
+	}
+	record->held = playback.held;
+	memcpy(&record->dt, &playback.dt, sizeof(record->dt));
+	playback.frames++;
+	return true;
+}
+
+void replay_close() {
+	if (playback.file != NULL) {
+		fclose(playback.file);
+		playback.file = NULL;
+	}
+}
+
+
+// Same rules as the main loop: input only counts when exactly one controller is plugged (frames and samples)
+void replay_sim_input(const replay_record_t* frame, sim_input_t* input) {
+	input->port = -1;
+	for (int port=0; port<MAX_CONSOLES; port++) {
+		if (frame->ports & (1 << port)) {
+			if (input->port != -1) {
+				input->port = -1;
+				break;
+			}
+			input->port = port;
+		}
+	}
+	input->held = input->port != -1 ? frame->held : 0;
+	input->pressed = input->port != -1 ? frame->pressed : 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sim.h"
+
+// Input recordings: per-frame port occupancy, buttons and frame duration, the timestamped samples
+// taken during each frame, plus the resets and power cycles between frames. Fed back in place of
+// the joypad, a recording replays the same session (same seed, same inputs) on the console or on
+// the host (see tools/playback.c).
+
+#define REPLAY_MAGIC (0x43434952)	// "CCIR"
+#define REPLAY_VERSION (1)
+
+typedef enum {
+	REPLAY_FRAME = 0,
+	REPLAY_RESET,
+	REPLAY_POWER_CYCLE,
+	REPLAY_SAMPLE		// Input change during the next frame (see sim_advance_samples)
+} replay_kind_t;
+
+typedef struct {
+	replay_kind_t kind;
+	// Frames and samples
+	uint8_t ports;		// Connected ports, one bit per port
+	uint16_t held;		// Buttons of the single connected port (sim_button_t)
+	uint16_t pressed;
+	float dt;			// Frame duration, in seconds
+	float time;			// Sample time, in seconds since the previous frame
+	// Resets
+	int8_t console;		// Console the controller was plugged into (-1 if none)
+	uint32_t held_ms;	// Time the reset button was held
+} replay_record_t;
+
+bool replay_record_open(const char* path, uint32_t seed, bool append);
+void replay_record(const replay_record_t* record);
+void replay_record_close();
+
+bool replay_open(const char* path, uint32_t* seed);
+bool replay_next(replay_record_t* record);
+void replay_close();
+
+void replay_sim_input(const replay_record_t* frame, sim_input_t* input);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+// Small xorshift generator: gameplay draws from an explicit state instead of libc rand(),
+// so that a run can be reproduced from its seed (rand() is also advanced by the VI interrupt).
+// Independent streams are derived from one seed, so that e.g. particles never shift gameplay.
+
+typedef struct {
+	uint32_t state;
+} rng_t;
+
+typedef enum {
+	RNG_STREAM_GAMEPLAY = 0,	// Game rules (persisted with the global state)
+	RNG_STREAM_REPLICAS,		// Replica placement and restoration thresholds
+	RNG_STREAM_VFX				// Particles
+} rng_stream_t;
+
+static inline void rng_seed(rng_t* rng, uint32_t seed) {
+	rng->state = seed != 0 ? seed : 0x9e3779b9;	// All-zero state would stay stuck at zero
+}
+
+static inline uint32_t rng_next(rng_t* rng) {
+	uint32_t x = rng->state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	rng->state = x;
+	return x;
+}
+
+// Well-spread state for stream number `stream` of a seed (murmur3 finalizer)
+static inline void rng_seed_stream(rng_t* rng, uint32_t seed, uint32_t stream) {
+	uint32_t x = seed + (stream + 1) * 0x9e3779b9;
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	rng_seed(rng, x);
+}
+
+// Child stream seeded from the parent's next output
+static inline void rng_split(rng_t* parent, rng_t* child, uint32_t stream) {
+	rng_seed_stream(child, rng_next(parent), stream);
+}
+
+// Uniform in [0, 1)
+static inline float rng_float(rng_t* rng) {
+	return (rng_next(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Uniform in [0, n)
+static inline uint32_t rng_below(rng_t* rng, uint32_t n) {
+	return rng_next(rng) % n;
+}
@@ -0,0 +1,235 @@
+#include <assert.h>
+#include <string.h>
+#include <libdragon.h>
+#include "save.h"
+#include "pc64.h"
+
+
+// Each record has two copies, written alternately: a commit interrupted by a power off
+// can only damage the older copy, the newest valid sequence wins when loading.
+// A commit is written one backend block per step, so it spans several frames.
+#define SAVE_MAGIC (0x5a5e0000)
+
+typedef struct {
+	uint8_t record;
+	uint8_t seq;
+	uint16_t crc;	// crc16 over magic, record, seq and payload
+	uint8_t payload[SAVE_PAYLOAD_SIZE];
+} save_slot_t;
+
+typedef struct {
+	void* data;
+	const schema_t* schema;
+	uint8_t seq;			// Sequence of the latest committed copy
+	bool stored;			// A valid copy exists on the backend
+	bool pending;
+	uint32_t marked;		// Latest update
+	uint32_t first_marked;	// Oldest update not committed yet
+	uint8_t committed[SAVE_PAYLOAD_SIZE];
+} record_t;
+
+static const save_backend_t* backend = NULL;
+static record_t records[SAVE_RECORDS];
+static int next_record = 0;
+static save_stats_t stats;
+static volatile bool flushing;	// Commit pending records without waiting for them to settle
+
+// Commit in progress
+static save_slot_t writing;
+static int writing_record = -1;
+static int written;				// Bytes of the slot already written
+static uint32_t writing_start;
+
+
+static int slot_offset(int record, int copy) {
+	return (record * 2 + copy) * sizeof(save_slot_t);
+}
+
+static uint16_t slot_crc(const save_slot_t* slot, int len) {
+	return calculate_crc16(SAVE_MAGIC | (slot->record << 8) | slot->seq, slot->payload, len);
+}
+
+static bool read_slot(int record, int copy, int len, save_slot_t* slot) {
+	return backend->read(slot_offset(record, copy), slot, sizeof(save_slot_t))
+		&& slot->record == record
+		&& slot->crc == slot_crc(slot, len);
+}
+
+
+bool save_init(const save_backend_t* b) {
+	memset(records, 0, sizeof(records));
+	memset(&stats, 0, sizeof(stats));
+	next_record = 0;
+	writing_record = -1;
+	flushing = false;
+	assert(sizeof(save_slot_t) % b->block == 0);
+	int capacity = b->open();
+	if (capacity < slot_offset(SAVE_RECORDS, 0)) {
+		debugf_uart("Save: %s unavailable (%d bytes)\n", b->name, capacity);
+		backend = NULL;
+		return false;
+	}
+	debugf_uart("Save: %s (%d bytes)\n", b->name, capacity);
+	backend = b;
+	return true;
+}
+
+// Attach live data to a record and load its newest valid copy, if any
+bool save_register(int record, void* data, const schema_t* schema) {
+	assert(record >= 0 && record < SAVE_RECORDS);
+	assert(schema_packed_size(schema) <= SAVE_PAYLOAD_SIZE);
+	record_t* r = &records[record];
+	memset(r, 0, sizeof(record_t));
+	r->data = data;
+	r->schema = schema;
+	if (backend == NULL) {
+		return false;
+	}
+	int len = schema_packed_size(schema);
+	save_slot_t copies[2];
+	bool valid[2] = { read_slot(record, 0, len, &copies[0]), read_slot(record, 1, len, &copies[1]) };
+	int newest = -1;
+	if (valid[0] && valid[1]) {
+		newest = (int8_t) (copies[1].seq - copies[0].seq) > 0 ? 1 : 0;
+	} else if (valid[0] || valid[1]) {
+		newest = valid[0] ? 0 : 1;
+	}
+	if (newest < 0) {
+		debugf_uart("Save: no valid copy of record %d\n", record);
+		return false;
+	}
+	schema_unpack(schema, copies[newest].payload, data);
+	memcpy(r->committed, copies[newest].payload, SAVE_PAYLOAD_SIZE);
+	r->seq = copies[newest].seq;
+	r->stored = true;
+	return true;
+}
+
+// Updates are only recorded here: the actual write happens later, in save_step
+void save_mark(int record) {
+	assert(record >= 0 && record < SAVE_RECORDS);
+	record_t* r = &records[record];
+	uint32_t now = TICKS_READ();
+	if (r->pending) {
+		stats.coalesced++;
+	} else {
+		r->pending = true;
+		r->first_marked = now;
+	}
+	r->marked = now;
+}
+
+// Packs the record into the slot to write: returns false if there is nothing new to commit
+static bool begin_commit(int record) {
+	record_t* r = &records[record];
+	r->pending = false;
+	memset(&writing, 0, sizeof(writing));
+	int len = schema_pack(r->schema, r->data, writing.payload);
+	if (r->stored && memcmp(writing.payload, r->committed, SAVE_PAYLOAD_SIZE) == 0) {
+		// Successive updates cancelled each other
+		stats.skipped++;
+		return false;
+	}
+	writing.record = record;
+	writing.seq = r->seq + 1;
+	writing.crc = slot_crc(&writing, len);
+	writing_record = record;
+	written = 0;
+	writing_start = TICKS_READ();
+	return true;
+}
+
+static void end_commit(bool ok) {
+	record_t* r = &records[writing_record];
+	writing_record = -1;
+	if (!ok) {
+		// Retry once the record has been quiet again
+		debugf_uart("Save: failed to commit record %d\n", writing.record);
+		r->pending = true;
+		r->first_marked = r->marked = TICKS_READ();
+		return;
+	}
+	stats.commits++;
+	stats.commit_ticks = TICKS_SINCE(writing_start);
+	memcpy(r->committed, writing.payload, SAVE_PAYLOAD_SIZE);
+	r->seq = writing.seq;
+	r->stored = true;
+}
+
+// Next record to commit: left untouched long enough, pending for too long, or flushed
+static int next_due(bool* overdue) {
+	for (int i=0; i<SAVE_RECORDS; i++) {
+		int record = (next_record + i) % SAVE_RECORDS;
+		record_t* r = &records[record];
+		if (!r->pending) {
+			continue;
+		}
+		*overdue = flushing || TICKS_SINCE(r->first_marked) >= TICKS_FROM_MS(SAVE_MAX_DELAY_MS);
+		if (*overdue || TICKS_SINCE(r->marked) >= TICKS_FROM_MS(SAVE_COALESCE_MS)) {
+			next_record = (record + 1) % SAVE_RECORDS;
+			return record;
+		}
+	}
+	return -1;
+}
+
+// Called once per frame: writes at most one block, if the backend is done with the previous
+// one and the expected cost fits the budget
+void save_step(uint32_t budget_ticks) {
+	if (backend == NULL || (backend->ready != NULL && !backend->ready())) {
+		return;
+	}
+	bool overdue = flushing;
+	if (writing_record < 0) {
+		int record = next_due(&overdue);
+		if (record < 0) {
+			flushing = false;
+			return;
+		}
+		if (!begin_commit(record)) {
+			return;
+		}
+	}
+	if (!overdue && stats.avg_ticks > budget_ticks) {
+		stats.deferred++;
+		return;
+	}
+
+	uint32_t start = TICKS_READ();
+	bool ok = backend->write(slot_offset(writing_record, writing.seq & 1) + written, (const uint8_t*) &writing + written);
+	uint32_t ticks = TICKS_DISTANCE(start, TICKS_READ());
+
+	stats.last_ticks = ticks;
+	if (ticks > stats.max_ticks) {
+		stats.max_ticks = ticks;
+	}
+	stats.avg_ticks += ((int32_t) ticks - (int32_t) stats.avg_ticks) / 8;
+
+	written += backend->block;
+	if (!ok || written == sizeof(save_slot_t)) {
+		end_commit(ok);
+	}
+}
+
+// Commits every pending record as soon as possible, e.g. when the console is about to reset
+// (safe from an interrupt: save_step does the writing)
+void save_flush() {
+	flushing = true;
+}
+
+// A record is waiting to be committed, or being written
+bool save_pending() {
+	if (writing_record >= 0) {
+		return true;
+	}
+	for (int record=0; record<SAVE_RECORDS; record++) {
+		if (records[record].pending) {
+			return true;
+		}
+	}
+	return false;
+}
+
+save_stats_t save_stats() {
+	return stats;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "schema.h"
+
+// Cartridge save: state that must survive long power offs (RDRAM replicas only last seconds).
+// Records are schema-packed like replicas, kept in RAM and written behind gameplay, one block
+// per frame: the main loop never waits for the save chip.
+
+// Storage behind the records, either the cartridge save chip or a file standing in on the host
+typedef struct {
+	const char* name;
+	int block;			// Bytes per write
+	int (*open)(void);	// Capacity in bytes (0 if unavailable)
+	bool (*read)(int offset, void* dst, int len);
+	bool (*write)(int offset, const void* src);	// One block, may complete in the background...
+	bool (*ready)(void);						// ...until this returns true (NULL: writes are synchronous)
+} save_backend_t;
+
+extern const save_backend_t eeprom_backend;
+extern const save_backend_t file_backend;
+
+#define SAVE_RECORDS (8)
+#define SAVE_PAYLOAD_SIZE (12)
+#define SAVE_COALESCE_MS (500)	// A record is committed once left untouched for this long...
+#define SAVE_MAX_DELAY_MS (5000)	// ...or when it has been pending for this long, whatever the cost
+
+typedef struct {
+	uint32_t commits;
+	uint32_t coalesced;		// Updates merged into an already pending commit
+	uint32_t skipped;		// Commits dropped because the packed payload did not change
+	uint32_t deferred;		// Steps that did not write because the budget was too small
+	uint32_t last_ticks;	// Cost of the latest step that wrote a block (time taken from the frame)
+	uint32_t max_ticks;
+	uint32_t avg_ticks;
+	uint32_t commit_ticks;	// Latest commit, from its first block to its last
+} save_stats_t;
+
+bool save_init(const save_backend_t* backend);
+bool save_register(int record, void* data, const schema_t* schema);
+void save_mark(int record);
+void save_step(uint32_t budget_ticks);
+void save_flush();
+bool save_pending();
+save_stats_t save_stats();
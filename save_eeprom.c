@@ -0,0 +1,77 @@
+#include <string.h>
+#include <libdragon.h>
+#include "save.h"
+
+
+// Cartridge EEPROM (4Kbit or 16Kbit), declared as the ROM save type in the Makefile.
+// Writes are sent to the joybus without waiting: the EEPROM then takes up to 15ms to program
+// the block, and must not be written again in the meantime.
+
+#define EEPROM_CHANNEL (4)			// After the 4 controller ports
+#define EEPROM_CMD_WRITE (0x05)
+#define EEPROM_BLOCK_SIZE (8)
+#define EEPROM_WRITE_MS (15)
+#define JOYBUS_SKIP (0x00)
+#define JOYBUS_END (0xfe)
+
+static uint64_t write_block[JOYBUS_BLOCK_SIZE / sizeof(uint64_t)];
+static volatile bool write_pending;
+static volatile uint32_t write_sent;
+
+static int eeprom_backend_open(void) {
+	switch (eeprom_present()) {
+		case EEPROM_4K:
+			return 512;
+		case EEPROM_16K:
+			return 2048;
+		default:
+			return 0;
+	}
+}
+
+// Only used when registering records, at boot: blocking is fine
+static bool eeprom_backend_read(int offset, void* dst, int len) {
+	eeprom_read_bytes(dst, offset, len);
+	return true;
+}
+
+static void written(uint64_t* output, void* ctx) {
+	write_pending = false;
+}
+
+static bool eeprom_backend_write(int offset, const void* src) {
+	uint8_t* block = (uint8_t*) write_block;
+	int i = 0;
+	while (i < EEPROM_CHANNEL) {
+		block[i++] = JOYBUS_SKIP;
+	}
+	block[i++] = 2 + EEPROM_BLOCK_SIZE;		// Transmit length: command, block number, data
+	block[i++] = 1;							// Receive length: status
+	block[i++] = EEPROM_CMD_WRITE;
+	block[i++] = offset / EEPROM_BLOCK_SIZE;
+	memcpy(&block[i], src, EEPROM_BLOCK_SIZE);
+	i += EEPROM_BLOCK_SIZE;
+	block[i++] = 0xff;
+	block[i++] = JOYBUS_END;
+	while (i < JOYBUS_BLOCK_SIZE - 1) {
+		block[i++] = 0;
+	}
+	block[JOYBUS_BLOCK_SIZE - 1] = 0x01;	// Run the commands
+	write_pending = true;
+	write_sent = TICKS_READ();
+	joybus_exec_async(block, written, NULL);
+	return true;
+}
+
+static bool eeprom_backend_ready(void) {
+	return !write_pending && TICKS_SINCE(write_sent) >= TICKS_FROM_MS(EEPROM_WRITE_MS);
+}
+
+const save_backend_t eeprom_backend = {
+	.name = "eeprom",
+	.block = EEPROM_BLOCK_SIZE,
+	.open = eeprom_backend_open,
+	.read = eeprom_backend_read,
+	.write = eeprom_backend_write,
+	.ready = eeprom_backend_ready
+};
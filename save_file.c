@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <string.h>
+#include "save.h"
+
+
+// Plain file standing in for the save chip in host builds, with the capacity and the block size
+// of a 4Kbit EEPROM (see tools/savetest.c)
+
+#ifndef SAVE_FILE_PATH
+#define SAVE_FILE_PATH "save.bin"
+#endif
+#define SAVE_FILE_SIZE (512)
+#define SAVE_FILE_BLOCK (8)
+
+static FILE* file = NULL;
+
+static int file_backend_open(void) {
+	if (file == NULL) {
+		file = fopen(SAVE_FILE_PATH, "r+b");
+	}
+	if (file == NULL) {
+		file = fopen(SAVE_FILE_PATH, "w+b");
+		if (file == NULL) {
+			return 0;
+		}
+		uint8_t blank[SAVE_FILE_SIZE];
+		memset(blank, 0, sizeof(blank));
+		if (fwrite(blank, sizeof(blank), 1, file) != 1) {
+			return 0;
+		}
+		fflush(file);
+	}
+	return SAVE_FILE_SIZE;
+}
+
+static bool file_backend_read(int offset, void* dst, int len) {
+	return fseek(file, offset, SEEK_SET) == 0 && fread(dst, len, 1, file) == 1;
+}
+
+static bool file_backend_write(int offset, const void* src) {
+	return fseek(file, offset, SEEK_SET) == 0 && fwrite(src, SAVE_FILE_BLOCK, 1, file) == 1 && fflush(file) == 0;
+}
+
+const save_backend_t file_backend = {
+	.name = "file",
+	.block = SAVE_FILE_BLOCK,
+	.open = file_backend_open,
+	.read = file_backend_read,
+	.write = file_backend_write
+};
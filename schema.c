@@ -0,0 +1,251 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "schema.h"
+#include "pc64.h"
+
+
+// Bit stream, least significant bits first
+
+static void put_bits(uint8_t* dst, int* pos, uint32_t value, int bits) {
+	while (bits > 0) {
+		int shift = *pos & 7;
+		int n = (8 - shift) < bits ? (8 - shift) : bits;
+		uint8_t mask = ((1 << n) - 1) << shift;
+		dst[*pos >> 3] = (dst[*pos >> 3] & ~mask) | ((value << shift) & mask);
+		value >>= n;
+		bits -= n;
+		*pos += n;
+	}
+}
+
+static uint32_t get_bits(const uint8_t* src, int* pos, int bits) {
+	uint32_t value = 0;
+	int done = 0;
+	while (done < bits) {
+		int shift = *pos & 7;
+		int n = (8 - shift) < (bits - done) ? (8 - shift) : (bits - done);
+		value |= (uint32_t) ((src[*pos >> 3] >> shift) & ((1 << n) - 1)) << done;
+		done += n;
+		*pos += n;
+	}
+	return value;
+}
+
+static int field_bits(const field_t* field) {
+	return field->type == FIELD_BYTES ? field->size * 8 : field->bits;
+}
+
+
+// Struct fields
+
+static uint32_t read_field(const field_t* field, const uint8_t* src) {
+	const uint8_t* ptr = src + field->offset;
+	if (field->type == FIELD_FIXED) {
+		float f;
+		memcpy(&f, ptr, sizeof(float));
+		return (uint32_t) (int32_t) lroundf(f * field->scale);
+	}
+	switch (field->size) {
+		case 1:
+			return *ptr;
+		case 2: {
+			uint16_t v;
+			memcpy(&v, ptr, sizeof(v));
+			return v;
+		}
+		default: {
+			uint32_t v;
+			memcpy(&v, ptr, sizeof(v));
+			return v;
+		}
+	}
+}
+
+// Values that do not fit their bits saturate (instead of wrapping around), with a warning
+static uint32_t clamp_field(const field_t* field, uint32_t value, int index) {
+	if (field->bits >= 32) {
+		return value;
+	}
+	if (field->type == FIELD_UNSIGNED) {
+		uint32_t max = (1u << field->bits) - 1;
+		if (value <= max) {
+			return value;
+		}
+		debugf_uart("schema field #%d: %lu overflows %d bits\n", index, (unsigned long) value, field->bits);
+		return max;
+	}
+	int32_t v = (int32_t) value;
+	if (field->type == FIELD_SIGNED && field->size < 4) {
+		// Sign extension of the struct member
+		v = (int32_t) (value << (32 - field->size * 8)) >> (32 - field->size * 8);
+	}
+	int32_t max = (1 << (field->bits - 1)) - 1;
+	int32_t min = -max - 1;
+	if (v >= min && v <= max) {
+		return (uint32_t) v;
+	}
+	debugf_uart("schema field #%d: %ld overflows %d bits\n", index, (long) v, field->bits);
+	return (uint32_t) (v < min ? min : max);
+}
+
+static void write_field(const field_t* field, uint8_t* dst, uint32_t value) {
+	uint8_t* ptr = dst + field->offset;
+	if (field->type != FIELD_UNSIGNED && field->bits < 32) {
+		// Sign extension
+		value = (uint32_t) ((int32_t) (value << (32 - field->bits)) >> (32 - field->bits));
+	}
+	if (field->type == FIELD_FIXED) {
+		float f = (int32_t) value / field->scale;
+		memcpy(ptr, &f, sizeof(float));
+		return;
+	}
+	switch (field->size) {
+		case 1:
+			*ptr = value;
+			break;
+		case 2: {
+			uint16_t v = value;
+			memcpy(ptr, &v, sizeof(v));
+			break;
+		}
+		default:
+			memcpy(ptr, &value, sizeof(value));
+			break;
+	}
+}
+
+
+// Packing
+
+int schema_packed_size(const schema_t* schema) {
+	int bits = 0;
+	for (int i=0; i<schema->count; i++) {
+		bits += field_bits(&schema->fields[i]);
+	}
+	return (bits + 7) / 8;
+}
+
+int schema_pack(const schema_t* schema, const void* src, uint8_t* dst) {
+	int pos = 0;
+	for (int i=0; i<schema->count; i++) {
+		const field_t* field = &schema->fields[i];
+		if (field->type == FIELD_BYTES) {
+			for (int k=0; k<field->size; k++) {
+				put_bits(dst, &pos, ((const uint8_t*) src)[field->offset + k], 8);
+			}
+		} else {
+			put_bits(dst, &pos, clamp_field(field, read_field(field, src), i), field->bits);
+		}
+	}
+	// Zero padding up to the next byte
+	if (pos & 7) {
+		put_bits(dst, &pos, 0, 8 - (pos & 7));
+	}
+	return pos / 8;
+}
+
+void schema_unpack(const schema_t* schema, const uint8_t* src, void* dst) {
+	int pos = 0;
+	for (int i=0; i<schema->count; i++) {
+		const field_t* field = &schema->fields[i];
+		if (field->type == FIELD_BYTES) {
+			for (int k=0; k<field->size; k++) {
+				((uint8_t*) dst)[field->offset + k] = get_bits(src, &pos, 8);
+			}
+		} else {
+			write_field(field, dst, get_bits(src, &pos, field->bits));
+		}
+	}
+}
+
+// Mask of the fields that differ between two packed payloads (one bit per field)
+uint32_t schema_diff(const schema_t* schema, const uint8_t* a, const uint8_t* b) {
+	assert(schema->count <= 32);
+	uint32_t changed = 0;
+	int pos = 0;
+	for (int i=0; i<schema->count; i++) {
+		int bits = field_bits(&schema->fields[i]);
+		int pos_b = pos;
+		bool differ = false;
+		while (bits > 0) {
+			int n = bits < 32 ? bits : 32;
+			differ |= get_bits(a, &pos, n) != get_bits(b, &pos_b, n);
+			bits -= n;
+		}
+		if (differ) {
+			changed |= 1 << i;
+		}
+	}
+	return changed;
+}
+
+
+// Checksum of a packed payload, seeded with the id of the object it belongs to
+
+static uint16_t crc16(const uint8_t * data, size_t len, uint16_t init) {
+    uint8_t x;
+    uint16_t crc = init;
+
+    while ( len-- )
+    {
+        x = crc >> 8 ^ *(data++);
+        x ^= x>>4;
+        crc = (
+            (crc << 8) ^ 
+            ((uint16_t)(x << 12)) ^ 
+            ((uint16_t)(x << 5)) ^ 
+            ((uint16_t)x)
+        );
+    }
+
+    return crc;
+}
+
+uint16_t calculate_crc16(const uint32_t id, const uint8_t * data, size_t len) {
+	uint16_t crc = crc16((uint8_t*) &id, sizeof(uint32_t), 0xffff);
+	return crc16(data, len, crc);
+}
+
+#ifdef DEBUG_MODE
+// Round trip of a sample value: unpacking then packing again must give the same payload,
+// and every field must come back within its quantization step
+bool schema_check(const schema_t* schema, const void* sample) {
+	int struct_size = 0;
+	for (int i=0; i<schema->count; i++) {
+		const field_t* field = &schema->fields[i];
+		if (field->offset + field->size > struct_size) {
+			struct_size = field->offset + field->size;
+		}
+	}
+	int packed_size = schema_packed_size(schema);
+	uint8_t* packed = calloc(1, packed_size);
+	uint8_t* repacked = calloc(1, packed_size);
+	uint8_t* copy = calloc(1, struct_size);
+	schema_pack(schema, sample, packed);
+	schema_unpack(schema, packed, copy);
+	schema_pack(schema, copy, repacked);
+	bool ok = (schema_diff(schema, packed, repacked) == 0);
+	for (int i=0; i<schema->count; i++) {
+		const field_t* field = &schema->fields[i];
+		bool same;
+		if (field->type == FIELD_FIXED) {
+			float a, b;
+			memcpy(&a, (const uint8_t*) sample + field->offset, sizeof(float));
+			memcpy(&b, copy + field->offset, sizeof(float));
+			same = fabsf(a - b) <= 0.5f / field->scale;
+		} else {
+			same = memcmp((const uint8_t*) sample + field->offset, copy + field->offset, field->size) == 0;
+		}
+		if (!same) {
+			debugf_uart("schema field #%d does not round trip\n", i);
+			ok = false;
+		}
+	}
+	free(packed);
+	free(repacked);
+	free(copy);
+	return ok;
+}
+#endif
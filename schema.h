@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Persisted types are described field by field, so that they can be bit-packed
+// instead of copying raw struct prefixes (with padding, full floats and ids).
+// Values that do not fit their bits saturate to the nearest representable one.
+
+typedef enum {
+	FIELD_UNSIGNED = 0,	// Integer stored on `bits` bits
+	FIELD_SIGNED,		// Two's complement integer stored on `bits` bits
+	FIELD_FIXED,		// Float quantized as round(value * scale), signed on `bits` bits
+	FIELD_BYTES			// Raw bytes, stored as-is
+} field_type_t;
+
+typedef struct {
+	uint16_t offset;
+	uint8_t size;		// Size in the struct, in bytes
+	uint8_t bits;		// Size in the packed payload, in bits (ignored for raw bytes)
+	field_type_t type;
+	float scale;		// Quantization step is 1/scale (fixed point fields only)
+} field_t;
+
+typedef struct {
+	const field_t* fields;
+	uint8_t count;
+} schema_t;
+
+#define FIELD(type, member, field_type, bits, scale) { offsetof(type, member), sizeof(((type*) 0)->member), bits, field_type, scale }
+#define RAW_FIELD(len) { 0, len, 0, FIELD_BYTES, 0 }
+#define SCHEMA(fields) { fields, sizeof(fields) / sizeof(fields[0]) }
+
+int schema_packed_size(const schema_t* schema);
+int schema_pack(const schema_t* schema, const void* src, uint8_t* dst);
+void schema_unpack(const schema_t* schema, const uint8_t* src, void* dst);
+uint32_t schema_diff(const schema_t* schema, const uint8_t* a, const uint8_t* b);
+uint16_t calculate_crc16(const uint32_t id, const uint8_t * data, size_t len);
+#ifdef DEBUG_MODE
+bool schema_check(const schema_t* schema, const void* sample);
+#endif
@@ -0,0 +1,575 @@
+#include <math.h>
+#include <string.h>
+#include "sim.h"
+#include "pc64.h"
+
+
+const level_t levels[TOTAL_LEVELS] = {
+	// cons.	att/s	att.grace	%att	%heat	%hipersist	rst/c	longrst		power	timer	desc
+	{ 1,		1.5f,	0.8f,		0,		0,		0,			0,		false,		0,		20,		"Your competitors are after you!\n\nPress and hold buttons to defend against attacks, don't let them overheat your console!" },
+	{ 2,		0.7f,	1.5f,		0,		0,		0,			0,		false,		0,		30,		"To defend multiple consoles, plug your controller into the corresponding slot.\n\nBetter get closer!" },
+	{ 2,		1.0f,	1.5f,		0,		0,		0,			1,		false,		0,		60,		"You are now allowed to reset each console once to mitigate overheat. Hitting the RESET button will help you cool the console you're plugged into.\n\nTold ya to get closer!" },
+	{ 3,		0.7f,	1.5f,		0.1f,	0,		0,			1,		true,		0,		60,		"Up next: long reset (holding 5 seconds) can cool your consoles even more.\n\nBeware: attacks will keep coming at your consoles!" },
+	{ 3,		0.7f,	1.5f,		0.9f,	0.9f,	0,			0,		false,		1,		60,		"One last trick in your bag: if things go out of hand, go hit that big POWER switch! Keep the console off for a few seconds, let your enemies feel the slow decay of that dear RDRAM!\n\nBut remember: don't let the memory decay to the point where you'll lose your consoles..." },
+	{ 3,		1.5f,	0.5f,		0.8f,	0.8f,	0.25f,		1,		true,		1,		60,		"Let's make it a bit harder..." },
+	{ 4,		1.0f,	1.5f,		0.7f,	0.8f,	0.25f,		2,		true,		1,		60,		"How about one more console?\n\nOK, you get 2 resets per console this time." },
+	{ 4,		1.2f,	1.0f,		0.5f,	0.5f,	0.35f,		0,		true,		2,		60,		"You're doing good, keep going!\n\nHow about a challenge: no reset, but 2 power offs allowed!" },
+	{ 4,		1.5f,	1.0f,		0.2f,	0.5f,	0.5f,		1,		true,		2,		60,		"Almost there..." },
+	{ 4,		1.5f,	0.5f,		0.1f,	0.5f,	0.75f,		0,		true,		3,		90,		"One last effort!" }
+};
+
+
+static void notify(sim_t* sim, sim_event_t event, int arg) {
+	if (sim->notify != NULL) {
+		sim->notify(sim, event, arg);
+	}
+}
+
+static void set_game_state(sim_t* sim, game_state_t state) {
+	sim->global->game_state = state;
+	notify(sim, SIM_STATE_CHANGED, 0);
+}
+
+
+// Overheat
+
+void sim_reset_overheat_timer(sim_t* sim, int idx) {
+	overheat_t* overheat = &sim->overheat[idx];
+	overheat->id = idx;
+	overheat->last_overheat = sim->clock->timer;
+	notify(sim, SIM_OVERHEAT_CHANGED, idx);
+}
+
+static void increase_overheat(sim_t* sim, int idx) {
+	overheat_t* overheat = &sim->overheat[idx];
+	overheat->id = idx;
+	overheat->overheat_level++;
+	overheat->last_overheat = sim->clock->timer;
+	debugf_uart("increase heat %d: level=%d\n", idx, overheat->overheat_level);
+	notify(sim, SIM_OVERHEAT_CHANGED, idx);
+}
+
+static void decrease_overheat(sim_t* sim, int idx) {
+	overheat_t* overheat = &sim->overheat[idx];
+	if (overheat->overheat_level > 0) {
+		overheat->overheat_level--;
+		overheat->last_overheat = sim->clock->timer;	// To avoid immediate increase (TODO Add grace period of a few additional seconds?)
+		debugf_uart("decrease heat %d: level=%d\n", idx, overheat->overheat_level);
+		notify(sim, SIM_OVERHEAT_CHANGED, idx);
+	}
+}
+
+
+// Attack schedule
+
+static void push_attack(sim_t* sim, int idx, float deadline) {
+	int i = sim->attacks_count++;
+	while (i > 0 && sim->attacks[(i-1)/2].deadline < deadline) {
+		sim->attacks[i] = sim->attacks[(i-1)/2];
+		i = (i-1)/2;
+	}
+	sim->attacks[i] = (sim_attack_t) { .deadline = deadline, .console = idx };
+}
+
+static int pop_attack(sim_t* sim) {
+	int idx = sim->attacks[0].console;
+	sim_attack_t last = sim->attacks[--sim->attacks_count];
+	int i = 0;
+	for (;;) {
+		int child = 2*i + 1;
+		if (child >= sim->attacks_count) {
+			break;
+		}
+		if (child + 1 < sim->attacks_count && sim->attacks[child+1].deadline > sim->attacks[child].deadline) {
+			child++;
+		}
+		if (sim->attacks[child].deadline <= last.deadline) {
+			break;
+		}
+		sim->attacks[i] = sim->attacks[child];
+		i = child;
+	}
+	sim->attacks[i] = last;
+	return idx;
+}
+
+// Drops the pending attack of a console, if any (the heap is at most MAX_CONSOLES long)
+static void cancel_attack(sim_t* sim, int idx) {
+	for (int i=0; i<sim->attacks_count; i++) {
+		if (sim->attacks[i].console == idx) {
+			sim_attack_t others[MAX_CONSOLES];
+			int count = 0;
+			for (int j=0; j<sim->attacks_count; j++) {
+				if (j != i) {
+					others[count++] = sim->attacks[j];
+				}
+			}
+			sim->attacks_count = 0;
+			for (int j=0; j<count; j++) {
+				push_attack(sim, others[j].console, others[j].deadline);
+			}
+			return;
+		}
+	}
+}
+
+// Attacks arrive at attack_rate once the grace period after the previous one is over, and
+// no later than twice the average interval. The delay is drawn once per attack.
+static void schedule_attack(sim_t* sim, int idx, rng_t* rng) {
+	const level_t* level = &levels[sim->global->current_level];
+	const attacker_t* attacker = &sim->attackers[idx];
+	cancel_attack(sim, idx);
+	if (attacker->spawned && attacker->level == QUEUE_LENGTH) {
+		// Rescheduled once shrunk
+		return;
+	}
+	float delay = -logf(1.0f - rng_float(rng)) / level->attack_rate;
+	if (!attacker->spawned) {
+		push_attack(sim, idx, sim->clock->timer - delay);
+	} else {
+		float max_time_between_attacks = 2.0f * (1.0f / level->attack_rate);
+		float since_last = fminf(level->attack_grace_pediod + delay, fmaxf(level->attack_grace_pediod, max_time_between_attacks));
+		push_attack(sim, idx, attacker->last_attack - since_last);
+	}
+}
+
+static void unschedule_attacks(sim_t* sim) {
+	sim->attacks_count = 0;
+	sim->attacks_scheduled = false;
+}
+
+
+// Attackers
+
+static void shrink_attacker(sim_t* sim, int idx, rng_t* rng) {
+	attacker_t* attacker = &sim->attackers[idx];
+	if (attacker->spawned && attacker->level > 0) {
+		// If level was QUEUE_LENGTH, avoid immediate reaction
+		bool was_full = (attacker->level == QUEUE_LENGTH);
+		if (was_full) {
+			attacker->last_attack = sim->clock->timer;
+			sim_reset_overheat_timer(sim, idx);
+		}
+		attacker->level--;
+		attacker->queue.start = (attacker->queue.start + 1) % QUEUE_LENGTH;
+		if (was_full && sim->attacks_scheduled) {
+			schedule_attack(sim, idx, rng);
+		}
+		debugf_uart("shrink %d: level=%d start=%d\n", idx, attacker->level, attacker->queue.start);
+		notify(sim, SIM_ATTACKER_SHRUNK, idx);
+	}
+}
+
+static void grow_attacker(sim_t* sim, int idx, rng_t* rng) {
+	attacker_t* attacker = &sim->attackers[idx];
+	if (attacker->spawned && attacker->level < QUEUE_LENGTH) {
+		if (attacker->level == 0) {
+			// Re-spawning
+			attacker->rival_type = rng_below(rng, TOTAL_RIVALS);
+			// TODO Should have a new random level of persistence?
+		}
+		attacker->level++;
+		attacker->queue.buttons[attacker->queue.end] = rng_below(rng, TOTAL_BUTTONS);
+		attacker->queue.end = (attacker->queue.end + 1) % QUEUE_LENGTH;
+		attacker->last_attack = sim->clock->timer;
+		sim_reset_overheat_timer(sim, idx);
+		debugf_uart("grow %d: level=%d end=%d\n", idx, attacker->level, attacker->queue.end);
+		notify(sim, SIM_ATTACKER_GROWN, idx);
+	}
+}
+
+static void spawn_attacker(sim_t* sim, int idx, rng_t* rng) {
+	attacker_t* attacker = &sim->attackers[idx];
+	attacker->id = idx;
+	attacker->spawned = true;
+	attacker->rival_type = rng_below(rng, TOTAL_RIVALS);
+	attacker->level = 0;
+	attacker->last_attack = sim->clock->timer;
+	attacker->queue.start = 0;
+	attacker->queue.end = 0;
+	debugf_uart("spawn %d: level=%d start=%d end=%d\n", idx, attacker->level, attacker->queue.start, attacker->queue.end);
+	notify(sim, SIM_ATTACKER_SPAWNED, idx);
+	grow_attacker(sim, idx, rng);
+}
+
+static void attack(sim_t* sim, int idx, rng_t* rng) {
+	if (!sim->attackers[idx].spawned) {
+		spawn_attacker(sim, idx, rng);
+	} else {
+		grow_attacker(sim, idx, rng);
+	}
+}
+
+queue_button_t get_attacker_button(const attacker_t* attacker, int i) {
+	const attack_queue_t* queue = &attacker->queue;
+	if (queue->start < queue->end) {
+		return queue->buttons[queue->start + i];
+	} else if (i <= (TOTAL_BUTTONS-1-queue->start)) {
+		return queue->buttons[queue->start + i];
+	} else {
+		return queue->buttons[i - (TOTAL_BUTTONS-queue->start)];
+	}
+}
+
+
+// Levels and games
+
+static void reset_level(sim_t* sim, int next_level) {
+	global_state_t* global = sim->global;
+	global->current_level = next_level;
+	memset(&global->level_reset_count_per_console, 0, sizeof(global->level_reset_count_per_console));
+	global->level_power_cycle_count = 0;
+	sim->clock->timer = next_level < TOTAL_LEVELS ? levels[next_level].duration : 0;
+	notify(sim, SIM_LEVEL_RESET, next_level);
+}
+
+static void new_game(sim_t* sim) {
+	global_state_t* global = sim->global;
+	global->id = 0;
+	global->game_state = INTRO;
+	global->current_level = 0;
+	memset(&global->level_reset_count_per_console, 0, sizeof(global->level_reset_count_per_console));
+	global->level_power_cycle_count = 0;
+	global->practice = false;
+	sim->clock->timer = 0;
+	notify(sim, SIM_NEW_GAME, 0);
+}
+
+static void start_level(sim_t* sim, int level) {
+	sim->holding = 0;
+	unschedule_attacks(sim);
+	notify(sim, SIM_LEVEL_STARTED, level);
+	set_game_state(sim, IN_GAME);
+}
+
+static void end_level(sim_t* sim) {
+	notify(sim, SIM_LEVEL_ENDED, sim->global->current_level);
+	memset(sim->attackers, 0, MAX_CONSOLES * sizeof(attacker_t));
+	memset(sim->overheat, 0, MAX_CONSOLES * sizeof(overheat_t));
+	sim->holding = 0;
+	unschedule_attacks(sim);
+}
+
+void sim_game_over(sim_t* sim, game_over_t reason) {
+	end_level(sim);
+	notify(sim, SIM_SOUND, SIM_SOUND_GAME_OVER);
+	sim->global->game_over = reason;
+	set_game_state(sim, GAME_OVER);
+}
+
+
+// Per-step rules
+
+static bool holds_button(uint16_t held, queue_button_t btn) {
+	static const uint16_t masks[TOTAL_BUTTONS] = { SIM_BUTTON_A, SIM_BUTTON_B, SIM_BUTTON_C_UP, SIM_BUTTON_C_DOWN };
+	uint16_t others = (SIM_BUTTON_A | SIM_BUTTON_B | SIM_BUTTON_C_UP | SIM_BUTTON_C_DOWN) & ~masks[btn];
+	return (held & masks[btn]) && !(held & others);
+}
+
+static void step_level(sim_t* sim, const sim_input_t* input, float dt, rng_t* rng) {
+	global_state_t* global = sim->global;
+	level_clock_t* clock = sim->clock;
+
+	float previous = clock->timer;
+	clock->timer -= dt;
+	// Only persisted periodically (and from the reset NMI)
+	if (floorf(clock->timer / LEVEL_TIMER_PERSIST_PERIOD) != floorf(previous / LEVEL_TIMER_PERSIST_PERIOD)) {
+		notify(sim, SIM_CLOCK_TICKED, 0);
+	}
+	bool cleared = (clock->timer < 0.0f);
+
+	// Spawn attackers and add attacks when due
+	const level_t* level = &levels[global->current_level];
+	if (!sim->attacks_scheduled) {
+		for (int i=0; i<level->consoles_count; i++) {
+			schedule_attack(sim, i, rng);
+		}
+		sim->attacks_scheduled = true;
+	}
+	while (sim->attacks_count > 0 && sim->attacks[0].deadline >= clock->timer) {
+		int i = pop_attack(sim);
+		attacker_t* attacker = &sim->attackers[i];
+		if (!attacker->spawned) {
+			notify(sim, SIM_SOUND, SIM_SOUND_ATTACK);
+			spawn_attacker(sim, i, rng);
+		} else if (attacker->last_attack - level->attack_grace_pediod >= clock->timer) {
+			notify(sim, SIM_SOUND, SIM_SOUND_ATTACK);
+			grow_attacker(sim, i, rng);
+		}
+		// Otherwise attacked again since this deadline was drawn (or full, left out until shrunk)
+		schedule_attack(sim, i, rng);
+	}
+
+	// Overheat consoles under full attack
+	for (int i=0; i<level->consoles_count; i++) {
+		attacker_t* attacker = &sim->attackers[i];
+		overheat_t* overheat = &sim->overheat[i];
+		bool overheating = attacker->spawned && attacker->level == QUEUE_LENGTH;
+		if (overheating && overheat->last_overheat - clock->timer >= OVERHEAT_PERIOD) {
+			notify(sim, SIM_SOUND, SIM_SOUND_WHOOSH);
+			increase_overheat(sim, i);
+			// Game over if reached level 4
+			if (overheat->overheat_level > 3) {
+				debugf_uart("OVERHEAT GAME OVER %d\n", i);
+				sim_game_over(sim, OVERHEATED);
+				return;
+			}
+		}
+	}
+
+	// Handle inputs
+	if (input->port != -1) {
+		int idx = input->port;
+		attacker_t* attacker = &sim->attackers[idx];
+		if (attacker->spawned && attacker->level > 0) {
+			if (holds_button(input->held, get_attacker_button(attacker, 0))) {
+				sim->holding += dt;
+				if (sim->holding >= BUTTON_HOLD_THRESHOLD) {	// TODO Threshold depending on enemy strength
+					shrink_attacker(sim, idx, rng);
+					sim->holding = 0;
+				}
+			} else {
+				sim->holding = 0;
+			}
+		}
+
+#ifdef DEBUG_MODE
+		// Debug commands
+		if (input->pressed & SIM_BUTTON_R) {
+			// Spawn attacker
+			attack(sim, idx, rng);
+		}
+		if (input->pressed & SIM_BUTTON_L) {
+			// Shrink attacker
+			shrink_attacker(sim, idx, rng);
+		}
+		if (input->pressed & SIM_BUTTON_D_UP) {
+			// Increase heat
+			increase_overheat(sim, idx);
+			// Game over if reached level 4
+			if (sim->overheat[idx].overheat_level > 3) {
+				debugf_uart("OVERHEAT GAME OVER %d\n", idx);
+				sim_game_over(sim, OVERHEATED);
+				return;
+			}
+		}
+		if (input->pressed & SIM_BUTTON_D_DOWN) {
+			// Decrease heat
+			decrease_overheat(sim, idx);
+		}
+		if (input->pressed & SIM_BUTTON_START) {
+			cleared = true;
+		}
+#endif
+
+		if (global->practice && (input->pressed & SIM_BUTTON_Z)) {
+			set_game_state(sim, INTRO);
+			end_level(sim);
+			new_game(sim);
+			notify(sim, SIM_SOUND, SIM_SOUND_BLIP);
+			return;
+		}
+	}
+
+	// Handle end condition and change level
+	if (!global->practice && cleared) {
+		set_game_state(sim, NEXT_LEVEL);
+		// TODO Keep level displayed for a few seconds, clear when loading the next level
+		end_level(sim);
+		reset_level(sim, global->current_level + 1);
+		notify(sim, SIM_SOUND, SIM_SOUND_BLIP);
+	}
+}
+
+void sim_step(sim_t* sim, const sim_input_t* input, float dt, rng_t* rng) {
+	global_state_t* global = sim->global;
+	switch (global->game_state) {
+		case INTRO: {
+			// Only accept first controller to start the game
+			if (input->port == 0) {
+				if (input->pressed & (SIM_BUTTON_A | SIM_BUTTON_START)) {
+					set_game_state(sim, NEXT_LEVEL);
+					reset_level(sim, global->current_level);
+					notify(sim, SIM_SOUND, SIM_SOUND_BLIP);
+				}
+				if (sim->practice_unlocked && (input->pressed & SIM_BUTTON_Z)) {
+					global->practice = true;
+					reset_level(sim, PRACTICE_LEVEL);
+					start_level(sim, PRACTICE_LEVEL);
+					notify(sim, SIM_SOUND, SIM_SOUND_BLIP);
+				}
+			}
+			break;
+		}
+		case IN_GAME:
+			step_level(sim, input, dt, rng);
+			break;
+		case NEXT_LEVEL: {
+			if (input->port != -1 && (input->pressed & (SIM_BUTTON_A | SIM_BUTTON_START))) {
+				// Load next level
+				int next_level = global->current_level;
+				if (next_level < TOTAL_LEVELS) {
+					start_level(sim, next_level);
+				} else {
+					notify(sim, SIM_SOUND, SIM_SOUND_BLIP);
+					set_game_state(sim, FINISHED);
+				}
+			}
+			break;
+		}
+		case FINISHED:
+		case GAME_OVER: {
+			if (input->port != -1 && (input->pressed & SIM_BUTTON_START)) {
+				new_game(sim);
+				notify(sim, SIM_SOUND, SIM_SOUND_BLIP);
+			}
+			break;
+		}
+	}
+}
+
+
+// Resets and power cycles, applied when booting back into a restored game
+
+// Rules state that does not survive a reboot (the console starts with a fresh sim_t)
+static void reboot(sim_t* sim) {
+	unschedule_attacks(sim);
+	sim->holding = 0;
+	sim->accumulator = 0;
+	sim->input = (sim_input_t) { .port = -1 };
+	sim->pending_pressed = 0;
+}
+
+void sim_power_cycle(sim_t* sim) {
+	global_state_t* global = sim->global;
+	reboot(sim);
+	if (global->game_state != IN_GAME || global->practice) {
+		return;
+	}
+	global->level_power_cycle_count++;
+	notify(sim, SIM_LEVEL_POWER_CYCLE_COUNTED, 0);
+	const level_t* level = &levels[global->current_level];
+	if (global->level_power_cycle_count > level->max_power_cycles) {
+		debugf_uart("Too many power cycles in level %d: %d > %d\n", global->current_level, global->level_power_cycle_count, level->max_power_cycles);
+		sim_game_over(sim, TOO_MANY_POWER_CYCLES);
+	}
+}
+
+void sim_reset(sim_t* sim, int console, uint32_t held_ms, rng_t* rng) {
+	global_state_t* global = sim->global;
+	reboot(sim);
+	if (global->game_state != IN_GAME) {
+		return;
+	}
+	const level_t* level = &levels[global->current_level];
+	if (!global->practice && console != -1) {
+		global->level_reset_count_per_console[console]++;
+		notify(sim, SIM_LEVEL_RESET_COUNTED, console);
+		if (global->level_reset_count_per_console[console] > level->max_resets_per_console) {
+			debugf_uart("Too many resets for console %d in level %d: %d > %d\n", console, global->current_level, global->level_reset_count_per_console[console], level->max_resets_per_console);
+			sim_game_over(sim, TOO_MANY_RESETS);
+			return;
+		}
+	}
+	for (int i=0; i<level->consoles_count; i++) {
+		overheat_t* overheat = &sim->overheat[i];
+		if (i == console) {
+			// Decrease overheat level of console depending on held_ms
+			if (overheat->overheat_level > 0) {
+				debugf_uart("DECREASE overheat of RESET CONSOLE: %d\n", i);
+				decrease_overheat(sim, i);
+				if (level->allow_long_reset && held_ms >= LONG_RESET_THRESHOLD) {
+					debugf_uart("DECREASE AGAIN overheat of RESET CONSOLE: %d held=%d\n", i, held_ms);
+					decrease_overheat(sim, i);
+				}
+			}
+		} else if (level->allow_long_reset && held_ms > LONG_RESET_GRACE_PERIOD) {
+			// For long presses of the reset button, apply attacks/overheat to the other consoles
+			float replay_ms = held_ms - LONG_RESET_GRACE_PERIOD;
+			attacker_t* attacker = &sim->attackers[i];
+			bool overheating = attacker->spawned && attacker->level == QUEUE_LENGTH;
+			if (overheating) {
+				debugf_uart("REPLAY OVERHEAT on console #%d: add %f s to overheat->last_overheat=%f\n", i, replay_ms / 1000.0f, overheat->last_overheat);
+				overheat->last_overheat += replay_ms / 1000.0f;
+			} else {
+				// Lower attack rate
+				float factor = 0.5f;
+				int attacks = (replay_ms / 1000.0f) * level->attack_rate * factor;
+				debugf_uart("REPLAY ATTACKS on console #%d: %f ms -> %d attacks\n", i, replay_ms, attacks);
+				for (int j=0; j<attacks; j++) {
+					attack(sim, i, rng);
+				}
+			}
+		}
+	}
+}
+
+
+// Fixed steps
+
+static void take_sample(sim_t* sim, const sim_sample_t* sample) {
+	sim->input = sample->input;
+	sim->input.pressed = 0;
+	sim->pending_pressed |= sample->input.pressed;
+}
+
+// Runs as many SIM_TICK steps as the frame time allows, so that rules behave the same at any
+// frame rate. Each step sees the latest sample taken before it ends, and the buttons pressed
+// since the previous step. Samples must be sorted by time.
+int sim_advance_samples(sim_t* sim, const sim_sample_t* samples, int count, float frame_dt, rng_t* rng) {
+	float step_end = -sim->accumulator;	// Since the previous frame
+	sim->accumulator += frame_dt;
+	int steps = 0;
+	int next = 0;
+	while (sim->accumulator >= SIM_TICK) {
+		if (steps == SIM_MAX_STEPS) {
+			// Far behind (e.g. stalled by persistence): drop the backlog instead of spiralling
+			sim->dropped_steps += (int) (sim->accumulator / SIM_TICK);
+			sim->accumulator = 0;
+			break;
+		}
+		step_end += SIM_TICK;
+		for (; next < count && samples[next].time <= step_end; next++) {
+			take_sample(sim, &samples[next]);
+		}
+		sim_input_t step_input = sim->input;
+		step_input.pressed = sim->pending_pressed;
+		sim->pending_pressed = 0;
+		sim->previous_timer = sim->clock->timer;
+		sim->previous_holding = sim->holding;
+		sim_step(sim, &step_input, SIM_TICK, rng);
+		sim->accumulator -= SIM_TICK;
+		steps++;
+	}
+	// Later samples are for the next frame's steps
+	for (; next < count; next++) {
+		take_sample(sim, &samples[next]);
+	}
+	return steps;
+}
+
+// Single input for the whole frame
+int sim_advance(sim_t* sim, const sim_input_t* input, float frame_dt, rng_t* rng) {
+	sim_sample_t sample = { .time = 0, .input = *input };
+	return sim_advance_samples(sim, &sample, 1, frame_dt, rng);
+}
+
+// Rendered values, between the two latest steps
+float sim_interpolated_timer(const sim_t* sim) {
+	float alpha = sim->accumulator / SIM_TICK;
+	float timer = sim->clock->timer;
+	if (sim->previous_timer < timer) {
+		// Clock was set (new level, restored game)
+		return timer;
+	}
+	return sim->previous_timer + (timer - sim->previous_timer) * alpha;
+}
+
+float sim_interpolated_holding(const sim_t* sim) {
+	float alpha = sim->accumulator / SIM_TICK;
+	if (sim->holding < sim->previous_holding) {
+		// Released, or shrunk the attacker
+		return sim->holding;
+	}
+	return sim->previous_holding + (sim->holding - sim->previous_holding) * alpha;
+}
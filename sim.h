@@ -0,0 +1,269 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "persistence.h"
+#include "rng.h"
+
+// Game rules, kept free of rendering, audio, joypad and persistence calls so that the same
+// code runs in the N64 build and headless on the host (see tools/). Changes that the
+// platform must react to (persist, play a sound, load a level...) are reported to a callback.
+
+
+// Constants
+
+#define BUTTON_HOLD_THRESHOLD (0.4f)
+#define OVERHEAT_PERIOD (8.0f)
+#define LONG_RESET_THRESHOLD (5000)
+#define LONG_RESET_GRACE_PERIOD (2000)
+#define LEVEL_TIMER_PERSIST_PERIOD (0.5f)
+#define MAX_CONSOLES (4)
+
+// Persisted consoles (see game_state.h). Payload sizes below are those of the schemas in
+// game_state.c, checked by check_schemas(): the host tools model persistence without them.
+#define CONSOLE_REPLICAS (200)
+#define CONSOLE_PAYLOAD_SIZE (18)
+
+
+// Levels
+
+#define TOTAL_LEVELS (10)
+
+typedef struct {
+	uint8_t consoles_count;
+	float attack_rate;					// Average attacks per second
+	float attack_grace_pediod;			// Grace period after each attack/shrink
+	float attacker_restore_threshold;	// Baseline proportion of replicas required for a successful restoration (lower proportion == more persistent)
+	float overheat_restore_threshold;	// Baseline proportion of replicas required for a successful restoration (lower proportion == more persistent)
+	float high_persistence_threshold;	// Proportion of high-persistence attackers/overheat
+	uint8_t max_resets_per_console;
+	bool allow_long_reset;				// Whether a long-press of the reset button decreases overheat even more
+	uint8_t max_power_cycles;
+	uint8_t duration;					// In seconds
+	char* description;
+} level_t;
+
+
+
+// Attackers
+
+#define ATTACKER_MAGIC (0x44556600)
+#define ATTACKER_MASK (0xffffff00)
+#define ATTACKER_REPLICAS (100)
+#define ATTACKER_PAYLOAD_SIZE (8)
+#define TOTAL_RIVALS (2)
+#define TOTAL_BUTTONS (4)
+#define QUEUE_LENGTH (4)
+
+typedef enum {
+	SATURN = 0,
+	PLAYSTATION
+} rival_t;
+
+typedef enum {
+	BTN_A = 0,
+	BTN_B,
+	BTN_C_UP,
+	BTN_C_DOWN,
+} queue_button_t;
+
+typedef struct {
+	uint8_t buttons[QUEUE_LENGTH];	// queue_button_t
+	uint8_t start;
+	uint8_t end;
+} attack_queue_t;
+
+typedef struct {
+	// Hot fields, read every frame by update()
+	bool spawned;
+	uint8_t level;			// Buttons in queue
+	uint8_t rival_type;		// Logo (rival_t)
+	attack_queue_t queue;	// Queue of buttons to be held
+	float last_attack;		// Time of the latest attack or shrink
+	// Cold fields, only used when persisting
+	uint32_t id;
+	int16_t min_replicas;	// Actual (partly random) number of replicas required for a successful restoration (lower == more persistent)
+	uint16_t seq;			// First event not included in this snapshot
+	// TODO Random persistence level
+	// TODO Vary strength (requires longer buttons presses? attacks faster? ...)
+	// Not persisted
+	replicas_t replicas;
+} attacker_t;
+
+
+
+// Overheat
+
+#define OVERHEAT_MAGIC (0x77889900)
+#define OVERHEAT_MASK (0xffffff00)
+#define OVERHEAT_REPLICAS (100)
+#define OVERHEAT_PAYLOAD_SIZE (6)
+
+typedef struct {
+	// Hot fields, read every frame by update()
+	uint8_t overheat_level;	// 3 levels of smoke
+	float last_overheat;	// Time of the latest level change
+	// Cold fields, only used when persisting
+	uint32_t id;
+	int16_t min_replicas;	// Actual (partly random) number of replicas required for a successful restoration (lower == more persistent)
+	uint16_t seq;			// First event not included in this snapshot
+	// TODO Random persistence level
+	// Not persisted
+	replicas_t replicas;
+} overheat_t;
+
+
+
+// Global game state
+
+#define GLOBAL_STATE_MAGIC (0xaabbcc00)
+#define GLOBAL_STATE_MASK (0xffffff00)
+#define GLOBAL_STATE_REPLICAS (200)
+#define GLOBAL_STATE_PAYLOAD_SIZE (11)
+
+typedef enum {
+	INTRO = 0,
+	IN_GAME,
+	NEXT_LEVEL,
+	FINISHED,
+	GAME_OVER
+} game_state_t;
+
+typedef enum {
+	OVERHEATED = 0,
+	TOO_MANY_RESETS,
+	TOO_MANY_POWER_CYCLES,
+	PARTIAL_RESTORATION
+} game_over_t;
+
+typedef struct {
+	uint32_t id;
+	game_state_t game_state;
+	game_over_t game_over;
+	uint8_t current_level;
+	uint8_t level_reset_count_per_console[MAX_CONSOLES];
+	uint8_t level_power_cycle_count;
+	bool practice;
+	rng_t rng;				// Gameplay stream, so that play resumes with the same draws after a reset
+	uint16_t seq;			// First event not included in this snapshot
+	// Not persisted
+	replicas_t replicas;
+} global_state_t;
+
+
+// Level clock (hot state)
+
+#define LEVEL_CLOCK_MAGIC (0xaabbee00)
+#define LEVEL_CLOCK_MASK (0xffffff00)
+#define LEVEL_CLOCK_REPLICAS (32)
+#define LEVEL_CLOCK_PAYLOAD_SIZE (4)
+
+typedef struct {
+	uint32_t id;
+	float timer;
+	// Not persisted
+	replicas_t replicas;
+} level_clock_t;
+
+
+
+// Simulation
+
+#define PRACTICE_LEVEL (5)
+#define SIM_TICK (1.0f / 60.0f)		// Fixed step of the rules, whatever the frame rate
+#define SIM_MAX_STEPS (4)			// Steps per frame before the backlog is dropped (after a long stall)
+
+typedef enum {
+	SIM_BUTTON_A		= 1 << 0,
+	SIM_BUTTON_B		= 1 << 1,
+	SIM_BUTTON_Z		= 1 << 2,
+	SIM_BUTTON_START	= 1 << 3,
+	SIM_BUTTON_C_UP		= 1 << 4,
+	SIM_BUTTON_C_DOWN	= 1 << 5,
+	SIM_BUTTON_L		= 1 << 6,
+	SIM_BUTTON_R		= 1 << 7,
+	SIM_BUTTON_D_UP		= 1 << 8,
+	SIM_BUTTON_D_DOWN	= 1 << 9,
+	SIM_BUTTON_C_RIGHT	= 1 << 10	// Not used by the rules (debug pause)
+} sim_button_t;
+
+typedef struct {
+	int8_t port;		// Port the single controller is plugged into (-1 if none, or several)
+	uint16_t held;		// Buttons currently down (sim_button_t)
+	uint16_t pressed;	// Buttons pressed since the previous step (sim_button_t)
+} sim_input_t;
+
+// Input sampled faster than frames are rendered: each fixed step sees the input of its own time
+typedef struct {
+	float time;			// Seconds since the previous frame
+	sim_input_t input;	// Input from then on (pressed: since the previous sample)
+} sim_sample_t;
+
+typedef enum {
+	SIM_ATTACKER_SPAWNED = 0,		// arg: console (reported before its first growth)
+	SIM_ATTACKER_GROWN,				// arg: console
+	SIM_ATTACKER_SHRUNK,			// arg: console
+	SIM_OVERHEAT_CHANGED,			// arg: console (level or timer)
+	SIM_LEVEL_RESET_COUNTED,		// arg: console
+	SIM_LEVEL_POWER_CYCLE_COUNTED,
+	SIM_CLOCK_TICKED,				// Level clock crossed a LEVEL_TIMER_PERSIST_PERIOD boundary
+	SIM_STATE_CHANGED,				// Game state, game over reason or practice flag
+	SIM_LEVEL_RESET,				// arg: level (level progress was reset)
+	SIM_NEW_GAME,					// Global state was reset for a new game
+	SIM_LEVEL_STARTED,				// arg: level (consoles must be loaded)
+	SIM_LEVEL_ENDED,				// Consoles must be cleared, attackers and overheat are wiped right after
+	SIM_SOUND						// arg: sim_sound_t
+} sim_event_t;
+
+typedef enum {
+	SIM_SOUND_BLIP = 0,
+	SIM_SOUND_ATTACK,
+	SIM_SOUND_WHOOSH,
+	SIM_SOUND_GAME_OVER
+} sim_sound_t;
+
+// Next attack of a console, on the level clock (which counts down)
+typedef struct {
+	float deadline;
+	uint8_t console;
+} sim_attack_t;
+
+typedef struct sim_s sim_t;
+
+struct sim_s {
+	// World, owned by the caller (the N64 build points to the persisted globals)
+	global_state_t* global;
+	level_clock_t* clock;
+	attacker_t* attackers;	// MAX_CONSOLES
+	overheat_t* overheat;	// MAX_CONSOLES
+	bool practice_unlocked;
+	// Rules state
+	float holding;			// Time the expected button has been held on the current console
+	sim_attack_t attacks[MAX_CONSOLES];	// Heap of upcoming attacks, soonest first (consoles with a full queue are left out)
+	uint8_t attacks_count;
+	bool attacks_scheduled;	// Cleared whenever the world changes behind the schedule (level change, reboot)
+	// Fixed steps (see sim_advance)
+	float accumulator;		// Frame time not simulated yet
+	sim_input_t input;		// Latest sampled input
+	uint16_t pending_pressed;	// Presses not seen by a step yet
+	float previous_timer;	// Level clock and holding time before the latest step, for interpolation
+	float previous_holding;
+	uint32_t dropped_steps;
+	// Platform callback (may be NULL)
+	void (*notify)(sim_t* sim, sim_event_t event, int arg);
+	void* user;				// Free for the caller
+};
+
+extern const level_t levels[TOTAL_LEVELS];
+
+void sim_step(sim_t* sim, const sim_input_t* input, float dt, rng_t* rng);
+int sim_advance(sim_t* sim, const sim_input_t* input, float frame_dt, rng_t* rng);
+int sim_advance_samples(sim_t* sim, const sim_sample_t* samples, int count, float frame_dt, rng_t* rng);
+float sim_interpolated_timer(const sim_t* sim);
+float sim_interpolated_holding(const sim_t* sim);
+void sim_reset(sim_t* sim, int console, uint32_t held_ms, rng_t* rng);
+void sim_power_cycle(sim_t* sim);
+void sim_game_over(sim_t* sim, game_over_t reason);
+void sim_reset_overheat_timer(sim_t* sim, int idx);
+queue_button_t get_attacker_button(const attacker_t* attacker, int i);
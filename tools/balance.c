@@ -0,0 +1,390 @@
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim.h"
+#include "decay.h"
+
+
+// Monte Carlo level balancer: plays millions of runs of each level with a scripted bot
+// (configurable skill and reaction time) that also resets and powers off its consoles,
+// restoring them through the persistence decay model
+
+#define TICK (1.0f / 60.0f)
+#define RUNS_PER_CHUNK (256)
+#define LAST_HEAP (TOTAL_HEAPS-1)	// With Expansion Pak
+
+#define CHUNK_HEADER_SIZE (8)
+
+void debugf_uart(char* format, ...) {
+}
+
+typedef struct {
+	float skill;		// Probability of holding the right button
+	float reaction;		// Seconds before reacting to a new button (or to a mistake)
+	float switch_time;	// Seconds to move the controller to another port
+	float off_seconds;	// Power off duration
+	float retention;	// Multiplier of the heap retention times (decay.h)
+	float shape;		// Shape of the retention time distribution
+	bool resets;
+	bool power_offs;
+} bot_config_t;
+
+typedef struct {
+	uint64_t runs;
+	uint64_t wins;
+	uint64_t game_overs[PARTIAL_RESTORATION+1];
+	double failure_time;	// Sum of times to failure
+	uint64_t resets;
+	uint64_t power_offs;
+} level_stats_t;
+
+// Persistence of the objects of a run, as the N64 build would have replicated them
+typedef struct {
+	persistence_level_t attacker_level[MAX_CONSOLES];
+	persistence_level_t overheat_level[MAX_CONSOLES];
+	bool overheat_replicated[MAX_CONSOLES];
+	rng_t replica_rng;
+} run_t;
+
+static bot_config_t bot = { .skill = 0.9f, .reaction = 0.25f, .switch_time = 1.0f, .off_seconds = 0.5f, .retention = 1.0f, .shape = DECAY_SHAPE, .resets = true, .power_offs = true };
+static uint32_t seed = 1;
+static int runs_per_level = 100000;
+static int first_level = 0;
+static int last_level = TOTAL_LEVELS-1;
+
+static uint64_t next_run = 0;
+static uint64_t total_runs;
+
+
+static uint32_t mix(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+
+// Persistence
+
+static int16_t min_replicas(int replicas, float threshold, rng_t* rng) {
+	int16_t min = (int) replicas * threshold;
+	if (min > 0) {
+		min += rng_below(rng, (replicas - min) / 3);
+	}
+	return min;
+}
+
+static persistence_level_t persistence_level(const level_t* level, persistence_level_t low, rng_t* rng) {
+	return rng_float(rng) < level->high_persistence_threshold ? HIGHEST : low;
+}
+
+static void on_event(sim_t* sim, sim_event_t event, int arg) {
+	run_t* run = sim->user;
+	const level_t* level = &levels[sim->global->current_level];
+	switch (event) {
+		case SIM_ATTACKER_SPAWNED:
+			sim->attackers[arg].min_replicas = min_replicas(ATTACKER_REPLICAS, level->attacker_restore_threshold, &run->replica_rng);
+			run->attacker_level[arg] = persistence_level(level, LOW, &run->replica_rng);
+			break;
+		case SIM_OVERHEAT_CHANGED:
+			if (!run->overheat_replicated[arg]) {
+				sim->overheat[arg].min_replicas = min_replicas(OVERHEAT_REPLICAS, level->overheat_restore_threshold, &run->replica_rng);
+				run->overheat_level[arg] = persistence_level(level, LOWEST, &run->replica_rng);
+				run->overheat_replicated[arg] = true;
+			}
+			break;
+		case SIM_LEVEL_ENDED:
+			memset(run->overheat_replicated, 0, sizeof(run->overheat_replicated));
+			break;
+		default:
+			break;
+	}
+}
+
+// Replicas whose chunk kept all its bits (anything else is rejected by the crc)
+static int surviving_replicas(int replicas, persistence_level_t level, int payload, float off_ms, rng_t* rng) {
+	int min_heap = first_heap(level, LAST_HEAP);
+	int heaps = LAST_HEAP - min_heap + 1;
+	int bits = (CHUNK_HEADER_SIZE + payload) * 8;
+	int survivors = 0;
+	for (int j=min_heap; j<=LAST_HEAP; j++) {
+		int count = replicas / heaps + ((j - min_heap) < (replicas % heaps) ? 1 : 0);
+		float p = powf(1.0f - decay_model(heap_retention_ms[j] * bot.retention, bot.shape, off_ms), bits);
+		for (int k=0; k<count; k++) {
+			survivors += rng_float(rng) < p;
+		}
+	}
+	return survivors;
+}
+
+// Same decisions as the followup boot sequence in main.c
+static void power_off(sim_t* sim, run_t* run) {
+	float off_ms = bot.off_seconds * 1000.0f;
+	const level_t* level = &levels[sim->global->current_level];
+	bool lost = surviving_replicas(GLOBAL_STATE_REPLICAS, HIGHEST, GLOBAL_STATE_PAYLOAD_SIZE, off_ms, &run->replica_rng) == 0;
+	for (int i=0; i<level->consoles_count; i++) {
+		lost |= surviving_replicas(CONSOLE_REPLICAS, HIGHEST, CONSOLE_PAYLOAD_SIZE, off_ms, &run->replica_rng) == 0;
+	}
+	if (lost) {
+		sim_game_over(sim, PARTIAL_RESTORATION);
+		return;
+	}
+	if (surviving_replicas(LEVEL_CLOCK_REPLICAS, HIGHEST, LEVEL_CLOCK_PAYLOAD_SIZE, off_ms, &run->replica_rng) == 0) {
+		sim->clock->timer = level->duration;
+	}
+	for (int i=0; i<level->consoles_count; i++) {
+		overheat_t* overheat = &sim->overheat[i];
+		if (run->overheat_replicated[i]) {
+			int survivors = surviving_replicas(OVERHEAT_REPLICAS, run->overheat_level[i], OVERHEAT_PAYLOAD_SIZE, off_ms, &run->replica_rng);
+			if (survivors == 0 || survivors < overheat->min_replicas) {
+				memset(overheat, 0, sizeof(overheat_t));
+				run->overheat_replicated[i] = false;
+			}
+		}
+		attacker_t* attacker = &sim->attackers[i];
+		if (attacker->spawned) {
+			int survivors = surviving_replicas(ATTACKER_REPLICAS, run->attacker_level[i], ATTACKER_PAYLOAD_SIZE, off_ms, &run->replica_rng);
+			if (survivors == 0 || survivors < attacker->min_replicas) {
+				memset(attacker, 0, sizeof(attacker_t));
+			} else if (overheat->last_overheat == 0) {
+				sim_reset_overheat_timer(sim, i);
+			}
+		}
+	}
+	sim->holding = 0;
+	sim_power_cycle(sim);
+}
+
+
+// Bot player
+
+typedef struct {
+	int port;
+	float busy_until;		// Moving the controller, or reacting
+	uint32_t front;			// Signature of the button currently expected
+	queue_button_t choice;
+} bot_t;
+
+static const uint16_t button_masks[TOTAL_BUTTONS] = { SIM_BUTTON_A, SIM_BUTTON_B, SIM_BUTTON_C_UP, SIM_BUTTON_C_DOWN };
+
+static int pick_console(const sim_t* sim, int current, int count) {
+	const attacker_t* attackers = sim->attackers;
+	int worst = current;
+	for (int i=0; i<count; i++) {
+		if (attackers[i].level > attackers[worst].level) {
+			worst = i;
+		}
+	}
+	// Stay on the current console while it is under attack, unless another one overheats
+	if (attackers[current].level > 0 && attackers[worst].level < QUEUE_LENGTH) {
+		return current;
+	}
+	return worst;
+}
+
+static void bot_step(bot_t* b, sim_t* sim, float t, sim_input_t* input, rng_t* rng) {
+	const level_t* level = &levels[sim->global->current_level];
+	input->held = 0;
+	input->pressed = 0;
+	int target = pick_console(sim, b->port, level->consoles_count);
+	if (target != b->port) {
+		b->port = target;
+		b->busy_until = t + bot.switch_time;
+		b->front = 0;
+	}
+	if (t < b->busy_until && b->front == 0) {
+		input->port = -1;
+		return;
+	}
+	input->port = b->port;
+	const attacker_t* attacker = &sim->attackers[b->port];
+	if (!attacker->spawned || attacker->level == 0) {
+		return;
+	}
+	queue_button_t expected = get_attacker_button(attacker, 0);
+	uint32_t front = 1 | (attacker->queue.start << 1) | (attacker->level << 4) | (b->port << 8);
+	if (front != b->front || (t >= b->busy_until && b->choice != expected)) {
+		// New button, or noticed a mistake: react, then hold the right button (most of the time)
+		b->front = front;
+		b->busy_until = t + bot.reaction;
+		b->choice = rng_float(rng) < bot.skill ? expected : (expected + 1 + rng_below(rng, TOTAL_BUTTONS-1)) % TOTAL_BUTTONS;
+	}
+	if (t >= b->busy_until) {
+		input->held = button_masks[b->choice];
+	}
+}
+
+
+// Runs
+
+static void play_level(int level_idx, uint32_t run_idx, level_stats_t* stats) {
+	const level_t* level = &levels[level_idx];
+	global_state_t global = { .game_state = IN_GAME, .current_level = level_idx };
+	level_clock_t clock = { .timer = level->duration };
+	attacker_t attackers[MAX_CONSOLES] = { 0 };
+	overheat_t overheat[MAX_CONSOLES] = { 0 };
+	run_t run = { 0 };
+	sim_t sim = {
+		.global = &global,
+		.clock = &clock,
+		.attackers = attackers,
+		.overheat = overheat,
+		.notify = on_event,
+		.user = &run
+	};
+	// Each run has its own streams, so results do not depend on the number of threads
+	uint32_t run_seed = mix(seed ^ mix(level_idx * 1000003u + run_idx));
+	rng_seed_stream(&global.rng, run_seed, RNG_STREAM_GAMEPLAY);
+	rng_seed_stream(&run.replica_rng, run_seed, RNG_STREAM_REPLICAS);
+	rng_t bot_rng;
+	rng_seed(&bot_rng, mix(run_seed ^ 0x7f4a7c15));
+
+	bot_t b = { .port = 0 };
+	sim_input_t input = { .port = -1 };
+	float t = 0;
+	int max_ticks = 10 * level->duration / TICK;
+	for (int tick=0; tick<max_ticks && global.game_state == IN_GAME; tick++) {
+		bot_step(&b, &sim, t, &input, &bot_rng);
+		sim_step(&sim, &input, TICK, &global.rng);
+		t += TICK;
+		if (global.game_state != IN_GAME) {
+			break;
+		}
+		// Reset the hottest console before it overheats for good (moving the controller during the reboot)
+		int hottest = 0;
+		for (int i=1; i<level->consoles_count; i++) {
+			if (overheat[i].overheat_level > overheat[hottest].overheat_level) {
+				hottest = i;
+			}
+		}
+		if (bot.resets && overheat[hottest].overheat_level >= 2 && global.level_reset_count_per_console[hottest] < level->max_resets_per_console) {
+			uint32_t held_ms = level->allow_long_reset ? LONG_RESET_THRESHOLD : 200;
+			sim.holding = 0;
+			sim_reset(&sim, hottest, held_ms, &global.rng);
+			b.port = hottest;
+			b.front = 0;
+			stats->resets++;
+			continue;
+		}
+		// Power off when a console is about to overheat and resets cannot help
+		if (bot.power_offs && global.level_power_cycle_count < level->max_power_cycles) {
+			for (int i=0; i<level->consoles_count; i++) {
+				if (overheat[i].overheat_level >= 3 && attackers[i].level == QUEUE_LENGTH) {
+					power_off(&sim, &run);
+					stats->power_offs++;
+					break;
+				}
+			}
+		}
+	}
+
+	stats->runs++;
+	if (global.game_state == NEXT_LEVEL) {
+		stats->wins++;
+	} else {
+		stats->game_overs[global.game_over]++;
+		stats->failure_time += level->duration - clock.timer;
+	}
+}
+
+static void* worker(void* arg) {
+	level_stats_t* stats = arg;
+	uint64_t runs = (uint64_t) runs_per_level;
+	while (true) {
+		uint64_t start = __atomic_fetch_add(&next_run, RUNS_PER_CHUNK, __ATOMIC_RELAXED);
+		if (start >= total_runs) {
+			break;
+		}
+		uint64_t end = start + RUNS_PER_CHUNK < total_runs ? start + RUNS_PER_CHUNK : total_runs;
+		for (uint64_t i=start; i<end; i++) {
+			int level_idx = first_level + i / runs;
+			play_level(level_idx, i % runs, &stats[level_idx]);
+		}
+	}
+	return NULL;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [-n runs per level] [-j threads] [-l level] [-s seed] [-k skill] [-r reaction s] [-w switch s] [-o power off s] [-t retention multiplier] [-e retention shape] [-R (no resets)] [-P (no power offs)]\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "n:j:l:s:k:r:w:o:t:e:RPh")) != -1) {
+		switch (opt) {
+			case 'n': runs_per_level = atoi(optarg); break;
+			case 'j': threads = atoi(optarg); break;
+			case 'l': first_level = last_level = atoi(optarg); break;
+			case 's': seed = strtoul(optarg, NULL, 0); break;
+			case 'k': bot.skill = atof(optarg); break;
+			case 'r': bot.reaction = atof(optarg); break;
+			case 'w': bot.switch_time = atof(optarg); break;
+			case 'o': bot.off_seconds = atof(optarg); break;
+			case 't': bot.retention = atof(optarg); break;
+			case 'e': bot.shape = atof(optarg); break;
+			case 'R': bot.resets = false; break;
+			case 'P': bot.power_offs = false; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (runs_per_level <= 0 || threads <= 0 || first_level < 0 || last_level >= TOTAL_LEVELS) {
+		usage(argv[0]);
+	}
+	total_runs = (uint64_t) runs_per_level * (last_level - first_level + 1);
+
+	pthread_t* tids = calloc(threads, sizeof(pthread_t));
+	level_stats_t (*stats)[TOTAL_LEVELS] = calloc(threads, sizeof(*stats));
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i=0; i<threads; i++) {
+		pthread_create(&tids[i], NULL, worker, stats[i]);
+	}
+	for (int i=0; i<threads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("bot: skill %.2f, reaction %.2fs, switch %.2fs, power off %.1fs, resets %s, power offs %s\n",
+		bot.skill, bot.reaction, bot.switch_time, bot.off_seconds, bot.resets ? "on" : "off", bot.power_offs ? "on" : "off");
+	printf("decay: retention x%.2f, shape %.1f\n", bot.retention, bot.shape);
+	printf("%llu runs on %d threads in %.2fs (%.0f runs/s), seed %08x\n\n", (unsigned long long) total_runs, threads, elapsed, total_runs / elapsed, seed);
+	printf("level    runs     win%%  overheat%%  resets%%  power%%  partial%%  ttf(s)  resets/run  offs/run\n");
+	for (int l=first_level; l<=last_level; l++) {
+		level_stats_t total = { 0 };
+		for (int i=0; i<threads; i++) {
+			level_stats_t* s = &stats[i][l];
+			total.runs += s->runs;
+			total.wins += s->wins;
+			for (int r=0; r<=PARTIAL_RESTORATION; r++) {
+				total.game_overs[r] += s->game_overs[r];
+			}
+			total.failure_time += s->failure_time;
+			total.resets += s->resets;
+			total.power_offs += s->power_offs;
+		}
+		double runs = total.runs;
+		uint64_t failures = total.runs - total.wins;
+		printf("%5d %7llu  %6.2f  %9.2f  %7.2f  %6.2f  %8.2f  %6.1f  %10.2f  %8.2f\n", l, (unsigned long long) total.runs,
+			100.0 * total.wins / runs,
+			100.0 * total.game_overs[OVERHEATED] / runs,
+			100.0 * total.game_overs[TOO_MANY_RESETS] / runs,
+			100.0 * total.game_overs[TOO_MANY_POWER_CYCLES] / runs,
+			100.0 * total.game_overs[PARTIAL_RESTORATION] / runs,
+			failures > 0 ? total.failure_time / failures : 0.0,
+			total.resets / runs,
+			total.power_offs / runs);
+	}
+	free(stats);
+	free(tids);
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <libdragon.h>
+#include "persistence.h"
+
+
+// Event log (persistence.c) across a reboot: the most recent run of events is restored in
+// order, including when the sequence number wraps around, and numbering carries on after it
+
+uint32_t host_ticks;
+static bool verbose = false;
+static int failures = 0;
+
+void debugf_uart(char* format, ...) {
+	if (verbose) {
+		va_list args;
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+	}
+}
+
+static void check(bool ok, const char* what) {
+	printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok) {
+		failures++;
+	}
+}
+
+// Boot as main.c does: clear everything, then start a new log
+static void boot() {
+	init_heaps(false);
+	clear_heaps();
+	init_event_log();
+}
+
+// Events carry their sequence number as argument, to tell laps of the ring apart
+static void append(int count) {
+	for (int i=0; i<count; i++) {
+		uint16_t seq = event_log_head();
+		append_event(1, 0, (int16_t) seq);
+	}
+}
+
+// Reset or power cycle: the log is read back from the heaps, which kept their content
+static int reboot(event_t* events) {
+	init_heaps(false);
+	return restore_events(events, EVENT_LOG_CAPACITY);
+}
+
+// Restored events are consecutive, end with the last appended one, and were not overwritten
+static bool in_order(const event_t* events, int count, uint16_t last) {
+	for (int i=0; i<count; i++) {
+		uint16_t seq = (uint16_t) (last - (count - 1 - i));
+		if (events[i].seq != seq || (uint16_t) events[i].arg != seq) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+	event_t events[EVENT_LOG_CAPACITY];
+
+	boot();
+	check(reboot(events) == 0, "empty log restores no events");
+
+	append(10);
+	int count = reboot(events);
+	check(count == 10 && in_order(events, count, 9), "partial first lap restores every event");
+	check(event_log_head() == 10, "numbering carries on after the restored events");
+
+	// The log is cleared at each boot, numbering is not
+	boot();
+	append(EVENT_LOG_CAPACITY * 3 + 5);
+	count = reboot(events);
+	check(count == EVENT_LOG_CAPACITY && in_order(events, count, event_log_head() - 1), "later laps restore a full ring");
+
+	// Sequence number wrap: run the log up to just before it, then past it
+	boot();
+	append((uint16_t) (65536 - 20 - event_log_head()));
+	count = reboot(events);
+	check(count == EVENT_LOG_CAPACITY && in_order(events, count, 65535 - 20), "full ring before the wrap");
+	append(30);
+	count = reboot(events);
+	check(count == EVENT_LOG_CAPACITY && in_order(events, count, 9), "full ring across the wrap");
+	check(event_log_head() == 10, "numbering carries on after the wrap");
+	boot();
+	append(EVENT_LOG_CAPACITY / 2);
+	count = reboot(events);
+	check(count == EVENT_LOG_CAPACITY / 2 && in_order(events, count, 9 + EVENT_LOG_CAPACITY / 2), "new log after the wrap");
+
+	printf("%s\n", failures == 0 ? "all passed" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
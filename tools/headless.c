@@ -0,0 +1,129 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sim.h"
+
+
+// Runs the game rules headless, much faster than real time, with a bot that always
+// holds the expected button of the most threatened console
+
+#define TICK (1.0f / 60.0f)
+
+static bool verbose = false;
+
+void debugf_uart(char* format, ...) {
+	if (verbose) {
+		va_list args;
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+	}
+}
+
+typedef struct {
+	uint64_t events[SIM_SOUND+1];
+	uint32_t games;
+	uint32_t levels_cleared;
+	uint32_t finished;
+	uint32_t game_overs[PARTIAL_RESTORATION+1];
+} stats_t;
+
+static void on_event(sim_t* sim, sim_event_t event, int arg) {
+	stats_t* stats = sim->user;
+	stats->events[event]++;
+	if (event == SIM_LEVEL_RESET && arg > 0 && arg != PRACTICE_LEVEL) {
+		stats->levels_cleared++;
+	}
+}
+
+static const uint16_t button_masks[TOTAL_BUTTONS] = { SIM_BUTTON_A, SIM_BUTTON_B, SIM_BUTTON_C_UP, SIM_BUTTON_C_DOWN };
+
+static void bot_input(const sim_t* sim, uint64_t tick, sim_input_t* input) {
+	// Buttons are "pressed" every other tick, so that presses are seen as new ones
+	uint16_t pulse = (tick & 1) ? 0 : 0xffff;
+	input->held = 0;
+	input->pressed = 0;
+	switch (sim->global->game_state) {
+		case INTRO:
+			input->port = 0;
+			input->pressed = SIM_BUTTON_START & pulse;
+			break;
+		case IN_GAME: {
+			// Stay on the current console while it is under attack, otherwise move to the worst one
+			const level_t* level = &levels[sim->global->current_level];
+			if (input->port < 0 || input->port >= level->consoles_count || sim->attackers[input->port].level == 0) {
+				int worst = 0;
+				for (int i=1; i<level->consoles_count; i++) {
+					if (sim->attackers[i].level > sim->attackers[worst].level) {
+						worst = i;
+					}
+				}
+				input->port = worst;
+			}
+			const attacker_t* attacker = &sim->attackers[input->port];
+			if (attacker->spawned && attacker->level > 0) {
+				input->held = button_masks[get_attacker_button(attacker, 0)];
+			}
+			break;
+		}
+		case NEXT_LEVEL:
+			input->pressed = SIM_BUTTON_A & pulse;
+			break;
+		case FINISHED:
+		case GAME_OVER:
+			input->pressed = SIM_BUTTON_START & pulse;
+			break;
+	}
+}
+
+int main(int argc, char** argv) {
+	double seconds = argc > 1 ? atof(argv[1]) : 24 * 3600;
+	uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+	verbose = argc > 3 && strcmp(argv[3], "-v") == 0;
+
+	global_state_t global = { .game_state = INTRO };
+	level_clock_t clock = { 0 };
+	attacker_t attackers[MAX_CONSOLES] = { 0 };
+	overheat_t overheat[MAX_CONSOLES] = { 0 };
+	stats_t stats = { 0 };
+	sim_t sim = {
+		.global = &global,
+		.clock = &clock,
+		.attackers = attackers,
+		.overheat = overheat,
+		.notify = on_event,
+		.user = &stats
+	};
+	rng_seed_stream(&global.rng, seed, RNG_STREAM_GAMEPLAY);
+
+	uint64_t ticks = seconds / TICK;
+	sim_input_t input = { .port = -1 };
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (uint64_t tick=0; tick<ticks; tick++) {
+		game_state_t before = global.game_state;
+		bot_input(&sim, tick, &input);
+		sim_step(&sim, &input, TICK, &global.rng);
+		if (global.game_state != before) {
+			if (global.game_state == GAME_OVER) {
+				stats.game_overs[global.game_over]++;
+			} else if (global.game_state == FINISHED) {
+				stats.finished++;
+			} else if (before == INTRO) {
+				stats.games++;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("seed %08x: %llu ticks (%.0fs of gameplay) in %.3fs, %.0f ticks/s (%.0fx real time)\n",
+		seed, (unsigned long long) ticks, seconds, elapsed, ticks / elapsed, seconds / elapsed);
+	printf("games %u, levels cleared %u, finished %u, game overs %u (overheat)\n",
+		stats.games, stats.levels_cleared, stats.finished, stats.game_overs[OVERHEATED]);
+	printf("attacks spawned %llu, grown %llu, shrunk %llu\n",
+		(unsigned long long) stats.events[SIM_ATTACKER_SPAWNED], (unsigned long long) stats.events[SIM_ATTACKER_GROWN], (unsigned long long) stats.events[SIM_ATTACKER_SHRUNK]);
+	return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+// The few libdragon definitions used by the shared modules built into the host tools,
+// with a clock the tool advances itself
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+extern uint32_t host_ticks;
+
+#define TICKS_PER_SECOND (93750000/2)
+#define TICKS_READ() (host_ticks)
+#define TICKS_DISTANCE(from, to) ((int32_t)((uint32_t)(to) - (uint32_t)(from)))
+#define TICKS_SINCE(from) TICKS_DISTANCE(from, TICKS_READ())
+#define TICKS_BEFORE(t1, t2) (TICKS_DISTANCE(t1, t2) > 0)
+#define TICKS_FROM_MS(val) ((uint32_t)((val) * (TICKS_PER_SECOND / 1000)))
+#define TICKS_TO_MS(val) (((int64_t)(val)) * 1000 / TICKS_PER_SECOND)
+#define TICKS_FROM_US(val) ((uint32_t)((val) * (TICKS_PER_SECOND / 1000000.0)))
+#define TICKS_TO_US(val) (((int64_t)(val)) * 1000000 / TICKS_PER_SECOND)
+
+// A single address space: the tool aliases the cached and uncached heaps itself
+#define UncachedAddr(addr) ((void*) (addr))
+#define CachedAddr(addr) ((void*) (addr))
+
+static inline void data_cache_hit_writeback(volatile const void* addr, unsigned long length) {}
+static inline void data_cache_hit_writeback_invalidate(volatile void* addr, unsigned long length) {}
@@ -0,0 +1,140 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "perf.h"
+
+
+// Extracts the profiler packets (see perf.h) from a capture of the debug UART, which also holds
+// the text logs: prints one CSV line per frame (microseconds), and per column stats on stderr.
+// Plot with e.g. gnuplot: set datafile separator ','; plot for [i=3:11] 'perf.csv' using 1:i with lines title columnhead
+
+static const char* zone_names[PERF_ZONES] = { "mixer", "input", "update", "persistence", "save", "offscreen", "render_3d", "render_2d", "wait" };
+static const char* phase_names[PERF_RDP_PHASES] = { "rdp_offscreen_0", "rdp_offscreen_1", "rdp_offscreen_2", "rdp_offscreen_3", "rdp_3d", "rdp_2d" };
+
+// Frame, zones, RDP busy/pipe/TMEM, RDP phases
+#define COLUMNS (1 + PERF_ZONES + 3 + PERF_RDP_PHASES)
+
+typedef struct {
+	uint64_t sum;
+	uint32_t max;
+	uint32_t* values;
+} column_stats_t;
+
+static uint32_t get_u16(const uint8_t* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+	return get_u16(p) | (get_u16(p + 2) << 16);
+}
+
+static uint32_t rdp_us(uint32_t cycles) {
+	return (uint64_t) cycles * 1000000 / PERF_RDP_HZ;
+}
+
+static int compare(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static const char* column_name(int c) {
+	static const char* rdp_names[3] = { "rdp_busy", "rdp_pipe", "rdp_tmem" };
+	if (c == 0) {
+		return "frame_us";
+	} else if (c <= PERF_ZONES) {
+		return zone_names[c-1];
+	} else if (c <= PERF_ZONES + 3) {
+		return rdp_names[c-1-PERF_ZONES];
+	}
+	return phase_names[c-1-PERF_ZONES-3];
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s uart-capture > perf.csv\n", argv[0]);
+		return 1;
+	}
+	FILE* file = fopen(argv[1], "rb");
+	if (file == NULL) {
+		fprintf(stderr, "cannot open %s\n", argv[1]);
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t* data = malloc(size);
+	if (data == NULL || fread(data, 1, size, file) != size) {
+		fprintf(stderr, "cannot read %s\n", argv[1]);
+		return 1;
+	}
+	fclose(file);
+
+	column_stats_t stats[COLUMNS] = { 0 };
+	long capacity = size / PERF_PACKET_SIZE + 1;
+	for (int c=0; c<COLUMNS; c++) {
+		stats[c].values = malloc(capacity * sizeof(uint32_t));
+	}
+
+	printf("frame");
+	for (int c=0; c<COLUMNS; c++) {
+		printf(",%s", column_name(c));
+	}
+	printf(",rdp_utilization,bound\n");
+	long count = 0, rdp_bound = 0;
+	uint32_t lost = 0, previous = 0;
+	for (long offset=0; offset + PERF_PACKET_SIZE <= size; offset++) {
+		const uint8_t* p = data + offset;
+		if (get_u32(p) != PERF_MAGIC) {
+			continue;
+		}
+		uint32_t frame = get_u32(p + 4);
+		if (count > 0 && frame > previous + 1) {
+			lost += frame - previous - 1;
+		}
+		previous = frame;
+
+		uint32_t values[COLUMNS];
+		const uint8_t* q = p + 8;
+		for (int c=0; c<1+PERF_ZONES; c++, q += 2) {
+			values[c] = get_u16(q);
+		}
+		uint32_t clock = get_u32(q);
+		uint32_t busy_cycles = get_u32(q + 4);
+		q += 4;
+		for (int c=1+PERF_ZONES; c<1+PERF_ZONES+3; c++, q += 4) {
+			values[c] = rdp_us(get_u32(q));
+		}
+		for (int c=1+PERF_ZONES+3; c<COLUMNS; c++, q += 2) {
+			values[c] = get_u16(q);
+		}
+		// Same rule as the overlay: the RDP was busy for longer than the CPU (frame minus its waits)
+		uint32_t busy = values[1+PERF_ZONES];
+		bool bound = busy > values[0] - values[1+PERF_WAIT];
+		rdp_bound += bound;
+
+		printf("%u", frame);
+		for (int c=0; c<COLUMNS; c++) {
+			printf(",%u", values[c]);
+			stats[c].sum += values[c];
+			stats[c].max = values[c] > stats[c].max ? values[c] : stats[c].max;
+			stats[c].values[count] = values[c];
+		}
+		printf(",%.1f,%s\n", clock > 0 ? 100.0 * busy_cycles / clock : 0.0, bound ? "rdp" : "cpu");
+		count++;
+		offset += PERF_PACKET_SIZE - 1;
+	}
+	if (count == 0) {
+		fprintf(stderr, "no profiler packets (ROM built with -DDEBUG_MODE=1 -DPERF_UART=1?)\n");
+		return 1;
+	}
+
+	fprintf(stderr, "%ld frames (%u lost), %ld RDP bound\n%-16s %8s %8s %8s\n", count, lost, rdp_bound, "column", "avg", "p99", "max");
+	for (int c=0; c<COLUMNS; c++) {
+		qsort(stats[c].values, count, sizeof(uint32_t), compare);
+		fprintf(stderr, "%-16s %6lluus %6uus %6uus\n", column_name(c),
+			(unsigned long long) (stats[c].sum / count), stats[c].values[count * 99 / 100], stats[c].max);
+	}
+	return 0;
+}
@@ -0,0 +1,128 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "replay.h"
+
+
+// Replays an input recording (see replay.h) through the game rules, as a fixed workload:
+// the same recording gives the same outcome on every build, only the time it takes changes
+
+static bool verbose = false;
+
+void debugf_uart(char* format, ...) {
+	if (verbose) {
+		va_list args;
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+	}
+}
+
+typedef struct {
+	uint64_t events[SIM_SOUND+1];
+	uint32_t frames;
+	uint32_t resets;
+	uint32_t power_cycles;
+	double seconds;		// Recorded gameplay time
+} stats_t;
+
+static void on_event(sim_t* sim, sim_event_t event, int arg) {
+	stats_t* stats = sim->user;
+	stats->events[event]++;
+}
+
+// Same sequence as the console: a whole recording, from the initial boot
+static bool play(const char* path, stats_t* stats, global_state_t* global, level_clock_t* clock) {
+	attacker_t attackers[MAX_CONSOLES] = { 0 };
+	overheat_t overheat[MAX_CONSOLES] = { 0 };
+	*global = (global_state_t) { .game_state = INTRO };
+	*clock = (level_clock_t) { 0 };
+	*stats = (stats_t) { 0 };
+	sim_t sim = {
+		.global = global,
+		.clock = clock,
+		.attackers = attackers,
+		.overheat = overheat,
+		.notify = on_event,
+		.user = stats
+	};
+	uint32_t seed;
+	if (!replay_open(path, &seed)) {
+		return false;
+	}
+	rng_seed_stream(&global->rng, seed, RNG_STREAM_GAMEPLAY);
+
+	replay_record_t record;
+	sim_input_t input;
+	sim_sample_t samples[32];
+	int samples_count = 0;
+	while (replay_next(&record)) {
+		switch (record.kind) {
+			case REPLAY_SAMPLE:
+				if (samples_count < sizeof(samples) / sizeof(samples[0])) {
+					samples[samples_count].time = record.time;
+					replay_sim_input(&record, &samples[samples_count].input);
+					samples_count++;
+				}
+				break;
+			case REPLAY_FRAME:
+				if (samples_count > 0) {
+					sim_advance_samples(&sim, samples, samples_count, record.dt, &global->rng);
+					samples_count = 0;
+				} else {
+					// Recorded before samples, or no input change during the frame
+					replay_sim_input(&record, &input);
+					sim_advance(&sim, &input, record.dt, &global->rng);
+				}
+				stats->frames++;
+				stats->seconds += record.dt;
+				break;
+			case REPLAY_RESET:
+				sim_reset(&sim, record.console, record.held_ms, &global->rng);
+				stats->resets++;
+				break;
+			case REPLAY_POWER_CYCLE:
+				sim_power_cycle(&sim);
+				stats->power_cycles++;
+				break;
+		}
+	}
+	replay_close();
+	return true;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s recording [iterations] [-v]\n", argv[0]);
+		return 1;
+	}
+	const char* path = argv[1];
+	int iterations = argc > 2 ? atoi(argv[2]) : 1;
+	verbose = argc > 3 && strcmp(argv[3], "-v") == 0;
+
+	stats_t stats;
+	global_state_t global;
+	level_clock_t clock;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i=0; i<iterations; i++) {
+		if (!play(path, &stats, &global, &clock)) {
+			fprintf(stderr, "cannot play %s\n", path);
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%s: %u frames (%.1fs of gameplay), %u resets, %u power cycles\n",
+		path, stats.frames, stats.seconds, stats.resets, stats.power_cycles);
+	printf("%d iterations in %.3fs, %.1fns per frame\n",
+		iterations, elapsed, elapsed * 1e9 / ((double) stats.frames * iterations));
+	printf("attacks spawned %llu, grown %llu, shrunk %llu\n",
+		(unsigned long long) stats.events[SIM_ATTACKER_SPAWNED], (unsigned long long) stats.events[SIM_ATTACKER_GROWN], (unsigned long long) stats.events[SIM_ATTACKER_SHRUNK]);
+	printf("final state %d, level %d, timer %.3f, rng %08x\n",
+		global.game_state, global.current_level, clock.timer, global.rng.state);
+	return 0;
+}
@@ -0,0 +1,121 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "schema.h"
+
+
+// Packing of each field type at its boundaries, negative values, values that overflow their
+// bits (they saturate), raw bytes, and the changed field mask
+
+static bool verbose = false;
+static int failures = 0;
+
+void debugf_uart(char* format, ...) {
+	if (verbose) {
+		va_list args;
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+	}
+}
+
+typedef struct {
+	uint8_t u4;
+	int8_t s6;
+	int16_t s8;
+	float fixed;
+	uint32_t u32;
+	int32_t s32;
+	uint16_t u16;
+	uint8_t raw[3];
+	float wide;
+} sample_t;
+
+static const field_t fields[] = {
+	FIELD(sample_t, u4,		FIELD_UNSIGNED,	4,	0),
+	FIELD(sample_t, s6,		FIELD_SIGNED,	6,	0),
+	FIELD(sample_t, s8,		FIELD_SIGNED,	8,	0),
+	FIELD(sample_t, fixed,	FIELD_FIXED,	16,	100.0f),
+	FIELD(sample_t, u32,	FIELD_UNSIGNED,	32,	0),
+	FIELD(sample_t, s32,	FIELD_SIGNED,	32,	0),
+	FIELD(sample_t, u16,	FIELD_UNSIGNED,	13,	0),
+	FIELD(sample_t, raw,	FIELD_BYTES,	0,	0),
+	FIELD(sample_t, wide,	FIELD_FIXED,	24,	1.0f),
+};
+static const schema_t schema = SCHEMA(fields);
+
+static void check(bool ok, const char* what) {
+	printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok) {
+		failures++;
+	}
+}
+
+static sample_t round_trip(const sample_t* in) {
+	uint8_t packed[32] = { 0 };
+	sample_t out;
+	memset(&out, 0, sizeof(out));
+	schema_pack(&schema, in, packed);
+	schema_unpack(&schema, packed, &out);
+	return out;
+}
+
+static bool same(const sample_t* a, const sample_t* b) {
+	return a->u4 == b->u4 && a->s6 == b->s6 && a->s8 == b->s8 && a->fixed == b->fixed && a->u32 == b->u32
+		&& a->s32 == b->s32 && a->u16 == b->u16 && memcmp(a->raw, b->raw, sizeof(a->raw)) == 0 && a->wide == b->wide;
+}
+
+int main(int argc, char** argv) {
+	verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+	// 4+6+8+16+32+32+13+24+24 bits
+	check(schema_packed_size(&schema) == 20, "packed size rounds up to whole bytes");
+
+	sample_t zero = { 0 };
+	sample_t out = round_trip(&zero);
+	check(same(&out, &zero), "zero round trips");
+
+	sample_t max = { .u4 = 15, .s6 = 31, .s8 = 127, .fixed = 327.67f, .u32 = 0xffffffff, .s32 = 0x7fffffff, .u16 = 8191, .raw = { 0xff, 0x00, 0xa5 }, .wide = 8388607.0f };
+	out = round_trip(&max);
+	check(same(&out, &max), "largest values round trip");
+
+	sample_t min = { .u4 = 0, .s6 = -32, .s8 = -128, .fixed = -327.68f, .u32 = 0, .s32 = (int32_t) 0x80000000, .u16 = 0, .raw = { 0x80, 0x7f, 0x01 }, .wide = -8388608.0f };
+	out = round_trip(&min);
+	check(same(&out, &min), "smallest (negative) values round trip");
+
+	sample_t negatives = { .s6 = -1, .s8 = -2, .fixed = -0.01f, .s32 = -3, .wide = -1.0f };
+	out = round_trip(&negatives);
+	check(same(&out, &negatives), "small negative values round trip");
+
+	sample_t quantized = { .fixed = 1.236f, .wide = -2.6f };
+	out = round_trip(&quantized);
+	check(out.fixed == 1.24f && out.wide == -3.0f, "fixed point values are rounded to their step");
+
+	sample_t over = { .u4 = 16, .s6 = 40, .s8 = 300, .fixed = 400.0f, .u16 = 9000, .wide = 1e8f };
+	out = round_trip(&over);
+	check(out.u4 == 15 && out.s6 == 31 && out.s8 == 127 && out.fixed == 327.67f && out.u16 == 8191 && out.wide == 8388607.0f,
+		"values above their range saturate to the largest value");
+
+	sample_t under = { .s6 = -33, .s8 = -200, .fixed = -1000.0f, .wide = -1e8f };
+	out = round_trip(&under);
+	check(out.s6 == -32 && out.s8 == -128 && out.fixed == -327.68f && out.wide == -8388608.0f,
+		"values below their range saturate to the smallest value");
+
+	uint8_t a[32] = { 0 }, b[32] = { 0 };
+	sample_t changed = max;
+	changed.s8 = -5;
+	changed.raw[2] = 0;
+	schema_pack(&schema, &max, a);
+	schema_pack(&schema, &changed, b);
+	check(schema_diff(&schema, a, b) == ((1 << 2) | (1 << 7)), "diff reports exactly the changed fields");
+	check(schema_diff(&schema, a, a) == 0, "diff of identical payloads is empty");
+
+	uint8_t repacked[32] = { 0 };
+	out = round_trip(&min);
+	schema_pack(&schema, &out, repacked);
+	schema_pack(&schema, &min, a);
+	check(memcmp(a, repacked, schema_packed_size(&schema)) == 0, "unpacked values pack to the same payload");
+
+	printf("%s\n", failures == 0 ? "all passed" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}